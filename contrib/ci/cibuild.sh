@@ -21,7 +21,7 @@ cmake -DMAINTAINER=ON \
 
 # Build, Test & Install
 make -j4
-#make test
+make test
 DESTDIR=/tmp/install_root/ make install
 cd ..
 rm -rf build/
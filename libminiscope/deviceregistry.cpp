@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "deviceregistry.h"
+
+#include <algorithm>
+#include <QDebug>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+
+#include "scopeintf.h"
+
+// defined in miniscope.cpp, must be called from outside of any namespace
+void initLibraryResources();
+
+using namespace MScope;
+
+typedef QHash<QString, QString> ControlIdToNameHash;
+Q_GLOBAL_STATIC_WITH_ARGS(ControlIdToNameHash, g_controlIdToName, ( {
+    { QLatin1String("frameRate"), QLatin1String("Framerate") },
+    { QLatin1String("led0"), QLatin1String("Excitation") },
+    { QLatin1String("gain"), QLatin1String("Gain") },
+    { QLatin1String("ewl"), QLatin1String("EWL") },
+    }
+));
+
+static int msconfStringToInt(const QString &s)
+{
+    // Should return a uint8 type of value (0 to 255)
+    bool ok = false;
+    int value;
+    int size = s.size();
+    if (size == 0) {
+        qCDebug(logMScope) << "No data in string to convert to int";
+        value = SEND_COMMAND_ERROR;
+        ok = false;
+    }
+    else if (s.left(2) == "0x"){
+        // HEX
+        value = s.right(size - 2).toUInt(&ok, 16);
+    }
+    else if (s.left(2) == "0b"){
+        // Binary
+        value = s.right(size - 2).toUInt(&ok, 2);
+    }
+    else {
+        value = s.toUInt(&ok, 10);
+        if (ok == false) {
+            // This is then a string
+            if (s == "I2C")
+                value = PROTOCOL_I2C;
+            else if (s == "SPI")
+                value = PROTOCOL_SPI;
+            else if (s == "valueH24")
+                value = SEND_COMMAND_VALUE_H24;
+            else if (s == "valueH16")
+                value = SEND_COMMAND_VALUE_H16;
+            else if (s == "valueH")
+                value = SEND_COMMAND_VALUE_H;
+            else if (s == "valueL")
+                value = SEND_COMMAND_VALUE_L;
+            else if (s == "value")
+                value = SEND_COMMAND_VALUE;
+            else if (s == "value2H")
+                value = SEND_COMMAND_VALUE2_H;
+            else if (s == "value2L")
+                value = SEND_COMMAND_VALUE2_L;
+            else
+                value = SEND_COMMAND_ERROR;
+            ok = true;
+        }
+    }
+
+    if (ok == true)
+        return value;
+    else
+        return SEND_COMMAND_ERROR;
+}
+
+static std::vector<QHash<QString, int>> msconfParseSendCommand(const QJsonArray &sendCommand)
+{
+    // creates a mapping to handle future I2C/SPI slider value send commands
+    std::vector<QHash<QString, int>> output;
+    QHash<QString, int> commandStructure;
+    QJsonObject jObj;
+    QStringList keys;
+
+    for (int i = 0; i < sendCommand.size(); i++) {
+        jObj = sendCommand[i].toObject();
+        keys = jObj.keys();
+
+        for (int j = 0; j < keys.size(); j++) {
+            // -1 = controlValue, -2 = error
+            if (jObj[keys[j]].isString())
+                commandStructure[keys[j]] = msconfStringToInt(jObj[keys[j]].toString());
+            else if (jObj[keys[j]].isDouble())
+                commandStructure[keys[j]] = jObj[keys[j]].toInt();
+        }
+        output.push_back(commandStructure);
+    }
+
+    return output;
+}
+
+static std::vector<ControlCommand> msconfCompileSendCommand(const QJsonArray &sendCommand, const QString &context, bool allowValues)
+{
+    // Turn the command descriptions into packet templates once, so applying
+    // a value later only needs to fill in a few bytes.
+    std::vector<ControlCommand> program;
+
+    // TODO: Handle int values greater than 8 bits
+    for (const auto &command : msconfParseSendCommand(sendCommand)) {
+        if (command.value("protocol") != PROTOCOL_I2C) {
+            qCDebug(logMScope) << command.value("protocol") << " protocol for " << context << " not yet supported";
+            continue;
+        }
+
+        ControlCommand cmd;
+        cmd.preambleKey = 0;
+
+        cmd.packet.push_back(command.value("addressW"));
+        cmd.preambleKey = (cmd.preambleKey << 8) | cmd.packet.back();
+
+        const auto regLength = command.value("regLength");
+        for (int j = 0; j < regLength; j++) {
+            cmd.packet.push_back(command.value(QStringLiteral("reg%1").arg(j)));
+            cmd.preambleKey = (cmd.preambleKey << 8) | cmd.packet.back();
+        }
+
+        const auto dataLength = command.value("dataLength");
+        for (int j = 0; j < dataLength; j++) {
+            const auto tempValue = command.value(QStringLiteral("data%1").arg(j));
+
+            // TODO: Handle value1 through value3
+            CommandValueSlot slot;
+            slot.offset = cmd.packet.size();
+            slot.shift = 0;
+            slot.secondValue = false;
+            bool isValue = true;
+            switch (tempValue) {
+            case SEND_COMMAND_VALUE_H24:
+                slot.shift = 24;
+                break;
+            case SEND_COMMAND_VALUE_H16:
+                slot.shift = 16;
+                break;
+            case SEND_COMMAND_VALUE_H:
+                slot.shift = 8;
+                break;
+            case SEND_COMMAND_VALUE_L:
+                slot.shift = 0;
+                break;
+            case SEND_COMMAND_VALUE2_H:
+                slot.shift = 8;
+                slot.secondValue = true;
+                break;
+            case SEND_COMMAND_VALUE2_L:
+                slot.shift = 0;
+                slot.secondValue = true;
+                break;
+            default:
+                isValue = false;
+            }
+
+            if (allowValues && isValue) {
+                cmd.packet.push_back(0);
+                cmd.valueSlots.push_back(slot);
+            } else {
+                cmd.packet.push_back(static_cast<quint8>(tempValue));
+                cmd.preambleKey = (cmd.preambleKey << 8) | cmd.packet.back();
+            }
+        }
+
+        program.push_back(cmd);
+    }
+
+    return program;
+}
+
+static std::shared_ptr<DeviceDefinition> msconfParseDevice(const QString &deviceType, const QJsonObject &devConfig)
+{
+    auto dev = std::make_shared<DeviceDefinition>();
+    dev->type = deviceType;
+
+    // load basic settings
+    dev->resolution = cv::Size(devConfig["width"].toInt(-1), devConfig["height"].toInt(-1));
+    dev->supportsColor = devConfig["isColor"].toBool(false);
+    dev->sensorType = devConfig["sensor"].toString("unknown");
+    dev->pixelClock = devConfig["pixelClock"].toDouble(-1);
+
+    // prepare all commands to initialize the Miniscope hardware
+    dev->initCommands = msconfCompileSendCommand(devConfig["initialize"].toArray(),
+                                                 QStringLiteral("initialization"),
+                                                 false);
+
+    // load information about available controls
+    const auto controlSettings = devConfig["controlSettings"].toObject();
+    if (controlSettings.isEmpty()) {
+        qCWarning(logMScope) << "controlSettings missing from miniscopes.json for deviceType = " << deviceType;
+        return dev;
+    }
+
+    for (const QString& controlKey : controlSettings.keys()) {
+        const auto values = controlSettings.value(controlKey).toObject();
+        const auto keys = values.keys();
+        ControlCommandRule commandRule;
+        ControlDefinition control;
+        control.id = controlKey;
+        control.name = g_controlIdToName->value(control.id, control.id);
+
+        QJsonValue startValue;
+        for (const auto &key : values.keys()) {
+            const auto value = values[key];
+            if (key == "sendCommand") {
+                commandRule.commands = msconfCompileSendCommand(value.toArray(), controlKey, true);
+            } else if (key == "min") {
+                control.valueMin = value.toInt();
+            } else if (key == "max") {
+                control.valueMax = value.toInt();
+            } else if (key == "stepSize") {
+                control.stepSize = value.toInt();
+            } else if (key == "startValue") {
+                startValue = value;
+            } else if (key == "displayValueScale") {
+                commandRule.valueScale = value.toDouble(1);
+            } else if (key == "displayValueOffset") {
+                commandRule.valueOffset = value.toDouble(0);
+            } else if (key == "displayValueBitShift") {
+                commandRule.valueBitshift = value.toInt(0);
+            } else if (key == "displaySpinBoxValues") {
+                QStringList labels;
+                for (const auto &text : value.toArray())
+                    labels.append(text.toString());
+                control.labels = labels;
+            } else if (key == "outputValues") {
+                std::vector<double> outVals;
+                for (const auto &v : value.toArray())
+                    outVals.push_back(v.toDouble());
+                commandRule.valueMap = outVals;
+            } else if (key == "displayTextValues") {
+                std::vector<double> numLabels;
+                for (const auto &n : value.toArray())
+                    numLabels.push_back(n.toDouble());
+                commandRule.numLabelMap = numLabels;
+            }
+        }
+
+        // if we have a list of labels, we are a selector, otherwise
+        // we assume a sliding-value controller
+        if (control.labels.isEmpty()) {
+            control.kind = ControlKind::Slider;
+        } else {
+            control.kind = ControlKind::Selector;
+            control.valueMin = 0;
+            control.valueMax = control.labels.length() - 1;
+            commandRule.valueScale = 1;
+        }
+
+        // set the start value
+        if (!startValue.isNull()) {
+            if (startValue.isString()) {
+                control.valueStart = control.labels.indexOf(startValue.toString());
+            } else {
+                control.valueStart = startValue.toInt();
+            }
+        }
+
+        // the framerate is a special case, as we control that in software
+        // we set the default here
+        if (controlKey == "frameRate") {
+            if (commandRule.numLabelMap.empty()) {
+                dev->defaultFps = control.valueStart;
+            } else {
+                dev->defaultFps = commandRule.numLabelMap[control.valueStart];
+            }
+
+            if (dev->defaultFps <= 1)
+                dev->defaultFps = 20;
+        }
+
+        dev->controlRules[control.id] = commandRule;
+        dev->controls.push_back(control);
+    }
+
+    // create a preferred order for our controls
+    std::sort(dev->controls.begin(), dev->controls.end(),[](const ControlDefinition& lhs, const ControlDefinition& rhs) {
+        if (lhs.kind > rhs.kind)
+            return true;
+        if (lhs.kind < rhs.kind)
+            return false;
+        return lhs.name.compare(rhs.name, Qt::CaseInsensitive) > 0;
+    });
+
+    return dev;
+}
+
+DeviceRegistry::DeviceRegistry()
+{
+    initLibraryResources();
+
+    QFile msTypesRc(QStringLiteral(":/config/miniscopes.json"));
+    if (!msTypesRc.open(QIODevice::ReadOnly)) {
+        qCWarning(logMScope).noquote() << "Unable to find Miniscope hardware definitions!";
+        return;
+    }
+
+    QString error;
+    if (!loadJson(msTypesRc.readAll(), msTypesRc.fileName(), &error))
+        qCWarning(logMScope).noquote() << error;
+}
+
+DeviceRegistry *DeviceRegistry::instance()
+{
+    // created on first use, thread-safe as of C++11
+    static DeviceRegistry registry;
+    return &registry;
+}
+
+bool DeviceRegistry::loadJson(const QByteArray &data, const QString &origin, QString *error)
+{
+    QJsonParseError parseError;
+    const auto jDoc = QJsonDocument::fromJson(data, &parseError);
+    if (!jDoc.isObject()) {
+        if (error != nullptr)
+            *error = QStringLiteral("Unable to parse device definitions from %1: %2").arg(origin, parseError.errorString());
+        return false;
+    }
+
+    // parse everything before taking the lock, so readers are never blocked for long
+    const auto allDevConfigs = jDoc.object();
+    QHash<QString, std::shared_ptr<const DeviceDefinition>> newDevices;
+    for (const auto &deviceType : allDevConfigs.keys())
+        newDevices.insert(deviceType, msconfParseDevice(deviceType, allDevConfigs[deviceType].toObject()));
+
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    for (const auto &deviceType : newDevices.keys()) {
+        if (m_devices.contains(deviceType))
+            qCInfo(logMScope).noquote() << "Device definition" << deviceType << "replaced by definition from" << origin;
+        m_devices.insert(deviceType, newDevices.value(deviceType));
+    }
+
+    return true;
+}
+
+bool DeviceRegistry::loadFile(const QString &fname, QString *error)
+{
+    QFile file(fname);
+    if (!file.open(QIODevice::ReadOnly)) {
+        if (error != nullptr)
+            *error = QStringLiteral("Unable to open device definitions file '%1': %2").arg(fname, file.errorString());
+        return false;
+    }
+
+    return loadJson(file.readAll(), fname, error);
+}
+
+QStringList DeviceRegistry::deviceTypes() const
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    auto deviceTypes = m_devices.keys();
+    std::sort(deviceTypes.begin(), deviceTypes.end());
+    return deviceTypes;
+}
+
+std::shared_ptr<const DeviceDefinition> DeviceRegistry::device(const QString &deviceType) const
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    return m_devices.value(deviceType);
+}
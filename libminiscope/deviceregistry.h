@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEVICEREGISTRY_H
+#define DEVICEREGISTRY_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <QHash>
+#include <QString>
+#include <QStringList>
+#include <opencv2/core.hpp>
+
+#include "miniscope.h"
+
+namespace MScope
+{
+
+/**
+ * @brief Position in a command packet that a control value is written to
+ */
+struct CommandValueSlot
+{
+    size_t offset;
+    uint shift;
+    bool secondValue;
+};
+
+/**
+ * @brief A control packet, compiled from its definition in miniscopes.json
+ *
+ * The packet holds all constant bytes already, only the bytes referenced by
+ * the value slots have to be filled in when a value is applied.
+ */
+struct ControlCommand
+{
+    std::vector<quint8> packet;
+    std::vector<CommandValueSlot> valueSlots;
+    long preambleKey; // Holds a value that represents the address and reg
+};
+
+/**
+ * @brief Defines a rule to scale values and convert them to a packet
+ */
+class ControlCommandRule
+{
+public:
+    explicit ControlCommandRule()
+        : valueScale(1),
+          valueOffset(0),
+          valueBitshift(0)
+    {}
+    std::vector<ControlCommand> commands;
+    double valueScale;
+    double valueOffset;
+    int valueBitshift;
+    std::vector<double> valueMap;
+    std::vector<double> numLabelMap;
+};
+
+/**
+ * @brief Everything we know about a Miniscope device type, ready to use
+ */
+class DeviceDefinition
+{
+public:
+    explicit DeviceDefinition()
+        : supportsColor(false),
+          pixelClock(-1),
+          defaultFps(0)
+    {}
+
+    QString type;
+    cv::Size resolution;
+    bool supportsColor;
+    QString sensorType;
+    double pixelClock;
+    double defaultFps; /// framerate selected by default, 0 if the device has no framerate control
+
+    std::vector<ControlDefinition> controls;
+    QHash<QString, ControlCommandRule> controlRules;
+    std::vector<ControlCommand> initCommands;
+};
+
+/**
+ * @brief Process-wide registry of Miniscope device definitions
+ *
+ * The built-in definitions are parsed once, the first time the registry is
+ * used. Additional definitions can be loaded from JSON files in the same format,
+ * and replace built-in definitions of the same name.
+ * Definitions are immutable once registered, so they can be shared freely
+ * between Miniscope instances and threads.
+ */
+class DeviceRegistry
+{
+public:
+    static DeviceRegistry *instance();
+
+    QStringList deviceTypes() const;
+    std::shared_ptr<const DeviceDefinition> device(const QString &deviceType) const;
+
+    bool loadFile(const QString &fname, QString *error);
+
+private:
+    explicit DeviceRegistry();
+    Q_DISABLE_COPY(DeviceRegistry)
+
+    mutable std::mutex m_mutex;
+    QHash<QString, std::shared_ptr<const DeviceDefinition>> m_devices;
+
+    bool loadJson(const QByteArray &data, const QString &origin, QString *error);
+};
+
+} // end of MiniScope namespace
+
+#endif // DEVICEREGISTRY_H
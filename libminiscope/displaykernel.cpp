@@ -0,0 +1,703 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "displaykernel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define MS_KERNEL_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define MS_KERNEL_NEON
+#include <arm_neon.h>
+#endif
+
+// MSVC allows intrinsics for any instruction set everywhere, GCC and Clang need
+// to be told which functions may use them
+#if defined(MS_KERNEL_X86) && !defined(_MSC_VER)
+#define MS_TARGET(isa) __attribute__((target(isa)))
+#else
+#define MS_TARGET(isa)
+#endif
+
+using namespace MScope;
+
+static inline uint8_t clampToU8(float value)
+{
+    // Round half to even like the SIMD conversions do. Adding and subtracting 1.5 * 2^23 makes
+    // the FPU round away all fraction bits, which is a lot faster than a call to lrint().
+    // All values we see here are far below 2^22, where this trick stops working.
+    const auto i = static_cast<int>((value + 12582912.0f) - 12582912.0f);
+    return static_cast<uint8_t>(std::min(std::max(i, 0), 255));
+}
+
+// gray levels per 100% change of the fluorescence, in the dF/F view
+static const float DELTA_F_SCALE = 100.0f;
+
+static inline void *backgroundAt(void *bg, int x, const DisplayKernelParams &p)
+{
+    if (p.mode == DisplayMode::RawFrames)
+        return nullptr;
+    if (p.fixedPoint)
+        return static_cast<uint16_t*>(bg) + x;
+    return static_cast<float*>(bg) + x;
+}
+
+static inline float *varianceAt(float *var, int x, const DisplayKernelParams &p)
+{
+    return p.mode == DisplayMode::StdDeviation? var + x : nullptr;
+}
+
+static inline uint32_t scaleFixed(uint32_t value, uint32_t alpha)
+{
+    // value * alpha / 2^16, rounded
+    return (value * alpha + 32768) >> 16;
+}
+
+static inline float temporalValueScalar(float f, float *bg, float *var, const DisplayKernelParams &p)
+{
+    // the operations and their order match the SIMD versions exactly
+    switch (p.mode) {
+    case DisplayMode::DeltaFOverF:
+        *bg = *bg + p.bgAlpha * (f - *bg);
+        return (f - *bg) / std::max(*bg, 1.0f) * DELTA_F_SCALE;
+    case DisplayMode::MaxProjection:
+        // the maximum decays towards the current frame
+        *bg = std::max(f, *bg + p.bgAlpha * (f - *bg));
+        return *bg;
+    default: {
+        // exponentially weighted Welford update of mean and variance
+        const auto diff = f - *bg;
+        const auto incr = p.bgAlpha * diff;
+        *bg = *bg + incr;
+        *var = p.bgKeep * (*var + diff * incr);
+        return std::sqrt(*var);
+    }
+    }
+}
+
+static inline uint8_t processPixelScalar(uint8_t px, void *bgPtr, float *var, const DisplayKernelParams &p)
+{
+    if (p.mode == DisplayMode::RawFrames)
+        return px;
+    if (p.mode != DisplayMode::BackgroundDiff)
+        return clampToU8(temporalValueScalar(static_cast<float>(px), static_cast<float*>(bgPtr), var, p));
+
+    int bg8;
+    if (p.fixedPoint) {
+        // move towards the target by alpha times the distance, in whichever direction
+        const auto bg = static_cast<uint16_t*>(bgPtr);
+        const auto target = static_cast<int>(px) << 8;
+        const auto up = static_cast<uint32_t>(std::max(target - *bg, 0));
+        const auto down = static_cast<uint32_t>(std::max(*bg - target, 0));
+        *bg = static_cast<uint16_t>(*bg + scaleFixed(up, p.bgAlphaFixed) - scaleFixed(down, p.bgAlphaFixed));
+        bg8 = (*bg + 128) >> 8;
+    } else {
+        const auto bg = static_cast<float*>(bgPtr);
+        *bg = *bg + p.bgAlpha * (static_cast<float>(px) - *bg);
+        bg8 = clampToU8(*bg);
+    }
+
+    return static_cast<uint8_t>(std::max(px - bg8, 0));
+}
+
+static inline void addToHistogram(uint32_t *histogram, const uint8_t *values)
+{
+    // spread consecutive pixels over four histograms, so increments of equal
+    // values don't have to wait for each other
+    for (int i = 0; i < 16; i += 4) {
+        histogram[values[i]]++;
+        histogram[256 + values[i + 1]]++;
+        histogram[512 + values[i + 2]]++;
+        histogram[768 + values[i + 3]]++;
+    }
+}
+
+static void displayRowScalar(const uint8_t *src, void *bg, float *var, uint8_t *dst, int width,
+                             const DisplayKernelParams &p, uint8_t &minValue, uint8_t &maxValue)
+{
+    int minV = minValue;
+    int maxV = maxValue;
+    for (int x = 0; x < width; x++) {
+        const int v = processPixelScalar(src[x], backgroundAt(bg, x, p), varianceAt(var, x, p), p);
+        minV = std::min(minV, v);
+        maxV = std::max(maxV, v);
+        p.histogram[(x & 3) * 256 + v]++;
+        dst[x] = clampToU8(static_cast<float>(v) * p.scale + p.offset);
+    }
+    minValue = static_cast<uint8_t>(minV);
+    maxValue = static_cast<uint8_t>(maxV);
+}
+
+#ifdef MS_KERNEL_X86
+MS_TARGET("sse4.1")
+static inline __m128i packFloatsSse41(__m128 f0, __m128 f1, __m128 f2, __m128 f3)
+{
+    const auto lo = _mm_packs_epi32(_mm_cvtps_epi32(f0), _mm_cvtps_epi32(f1));
+    const auto hi = _mm_packs_epi32(_mm_cvtps_epi32(f2), _mm_cvtps_epi32(f3));
+    return _mm_packus_epi16(lo, hi);
+}
+
+MS_TARGET("sse4.1")
+static inline void unpackFloatsSse41(__m128i px, __m128 *f)
+{
+    const auto lo16 = _mm_cvtepu8_epi16(px);
+    const auto hi16 = _mm_cvtepu8_epi16(_mm_srli_si128(px, 8));
+    f[0] = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(lo16));
+    f[1] = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(lo16, 8)));
+    f[2] = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(hi16));
+    f[3] = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(hi16, 8)));
+}
+
+MS_TARGET("sse4.1")
+static inline uint8_t hminEpu8Sse41(__m128i v)
+{
+    // widen to 16 bit and let minpos do the horizontal part
+    const auto zero = _mm_setzero_si128();
+    const auto m = _mm_min_epu16(_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero));
+    return static_cast<uint8_t>(_mm_cvtsi128_si32(_mm_minpos_epu16(m)) & 0xFF);
+}
+
+MS_TARGET("sse4.1")
+static inline __m128i scaleFixedSse41(__m128i value, __m128i alpha)
+{
+    // the low half of the product holds the rounding bit
+    return _mm_add_epi16(_mm_mulhi_epu16(value, alpha), _mm_srli_epi16(_mm_mullo_epi16(value, alpha), 15));
+}
+
+MS_TARGET("sse4.1")
+static inline __m128i updateBackgroundFixedSse41(__m128i bg, __m128i target, __m128i alpha)
+{
+    const auto up = _mm_subs_epu16(target, bg);
+    const auto down = _mm_subs_epu16(bg, target);
+    return _mm_add_epi16(_mm_sub_epi16(bg, scaleFixedSse41(down, alpha)), scaleFixedSse41(up, alpha));
+}
+
+MS_TARGET("sse4.1")
+static inline __m128i backgroundFixedSse41(__m128i px, uint16_t *bg, __m128i alpha)
+{
+    const auto zero = _mm_setzero_si128();
+    const auto round = _mm_set1_epi16(128);
+    auto bgLo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bg));
+    auto bgHi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bg + 8));
+    bgLo = updateBackgroundFixedSse41(bgLo, _mm_unpacklo_epi8(zero, px), alpha);
+    bgHi = updateBackgroundFixedSse41(bgHi, _mm_unpackhi_epi8(zero, px), alpha);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(bg), bgLo);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(bg + 8), bgHi);
+
+    return _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(bgLo, round), 8),
+                            _mm_srli_epi16(_mm_add_epi16(bgHi, round), 8));
+}
+
+MS_TARGET("sse4.1")
+static inline __m128 temporalValueSse41(__m128 f, float *bg, float *var, DisplayMode mode, __m128 alpha, __m128 keep)
+{
+    auto b = _mm_loadu_ps(bg);
+    switch (mode) {
+    case DisplayMode::DeltaFOverF:
+        b = _mm_add_ps(b, _mm_mul_ps(alpha, _mm_sub_ps(f, b)));
+        _mm_storeu_ps(bg, b);
+        return _mm_mul_ps(_mm_div_ps(_mm_sub_ps(f, b), _mm_max_ps(b, _mm_set1_ps(1.0f))), _mm_set1_ps(DELTA_F_SCALE));
+    case DisplayMode::MaxProjection:
+        b = _mm_max_ps(f, _mm_add_ps(b, _mm_mul_ps(alpha, _mm_sub_ps(f, b))));
+        _mm_storeu_ps(bg, b);
+        return b;
+    default: {
+        const auto diff = _mm_sub_ps(f, b);
+        const auto incr = _mm_mul_ps(alpha, diff);
+        _mm_storeu_ps(bg, _mm_add_ps(b, incr));
+        const auto v = _mm_mul_ps(keep, _mm_add_ps(_mm_loadu_ps(var), _mm_mul_ps(diff, incr)));
+        _mm_storeu_ps(var, v);
+        return _mm_sqrt_ps(v);
+    }
+    }
+}
+
+MS_TARGET("sse4.1")
+static void displayRowSse41(const uint8_t *src, void *bgPtr, float *var, uint8_t *dst, int width,
+                            const DisplayKernelParams &p, uint8_t &minValue, uint8_t &maxValue)
+{
+    const auto alpha = _mm_set1_ps(p.bgAlpha);
+    const auto keep = _mm_set1_ps(p.bgKeep);
+    const auto alphaFixed = _mm_set1_epi16(static_cast<short>(p.bgAlphaFixed));
+    const auto scale = _mm_set1_ps(p.scale);
+    const auto offset = _mm_set1_ps(p.offset);
+    auto vmin = _mm_set1_epi8(static_cast<char>(minValue));
+    auto vmax = _mm_set1_epi8(static_cast<char>(maxValue));
+
+    __m128 f[4];
+    uint8_t values[16];
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        auto px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        if (p.fixedPoint) {
+            px = _mm_subs_epu8(px, backgroundFixedSse41(px, static_cast<uint16_t*>(bgPtr) + x, alphaFixed));
+        } else if (p.mode == DisplayMode::BackgroundDiff) {
+            const auto bg = static_cast<float*>(bgPtr) + x;
+            unpackFloatsSse41(px, f);
+            for (int i = 0; i < 4; i++) {
+                auto b = _mm_loadu_ps(bg + i * 4);
+                b = _mm_add_ps(b, _mm_mul_ps(alpha, _mm_sub_ps(f[i], b)));
+                _mm_storeu_ps(bg + i * 4, b);
+                f[i] = b;
+            }
+            px = _mm_subs_epu8(px, packFloatsSse41(f[0], f[1], f[2], f[3]));
+        } else if (p.mode != DisplayMode::RawFrames) {
+            const auto bg = static_cast<float*>(bgPtr) + x;
+            unpackFloatsSse41(px, f);
+            for (int i = 0; i < 4; i++)
+                f[i] = temporalValueSse41(f[i], bg + i * 4, varianceAt(var, x + i * 4, p), p.mode, alpha, keep);
+            px = packFloatsSse41(f[0], f[1], f[2], f[3]);
+        }
+        vmin = _mm_min_epu8(vmin, px);
+        vmax = _mm_max_epu8(vmax, px);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(values), px);
+        addToHistogram(p.histogram, values);
+
+        unpackFloatsSse41(px, f);
+        for (int i = 0; i < 4; i++)
+            f[i] = _mm_add_ps(_mm_mul_ps(f[i], scale), offset);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), packFloatsSse41(f[0], f[1], f[2], f[3]));
+    }
+
+    // max(v) == 255 - min(255 - v)
+    minValue = hminEpu8Sse41(vmin);
+    maxValue = static_cast<uint8_t>(255 - hminEpu8Sse41(_mm_xor_si128(vmax, _mm_set1_epi8(-1))));
+    if (x < width)
+        displayRowScalar(src + x, backgroundAt(bgPtr, x, p), varianceAt(var, x, p), dst + x, width - x, p, minValue, maxValue);
+}
+
+MS_TARGET("avx2")
+static inline __m128i packFloatsAvx2(__m256 f0, __m256 f1)
+{
+    // the 256-bit packs work per 128-bit lane, so the lanes need to be put back in order
+    auto packed = _mm256_packs_epi32(_mm256_cvtps_epi32(f0), _mm256_cvtps_epi32(f1));
+    packed = _mm256_permute4x64_epi64(packed, 0xD8);
+    return _mm_packus_epi16(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1));
+}
+
+MS_TARGET("avx2")
+static inline __m256i scaleFixedAvx2(__m256i value, __m256i alpha)
+{
+    return _mm256_add_epi16(_mm256_mulhi_epu16(value, alpha), _mm256_srli_epi16(_mm256_mullo_epi16(value, alpha), 15));
+}
+
+MS_TARGET("avx2")
+static inline __m128i backgroundFixedAvx2(__m128i px, uint16_t *bg, __m256i alpha)
+{
+    const auto target = _mm256_slli_epi16(_mm256_cvtepu8_epi16(px), 8);
+    auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bg));
+    const auto up = _mm256_subs_epu16(target, b);
+    const auto down = _mm256_subs_epu16(b, target);
+    b = _mm256_add_epi16(_mm256_sub_epi16(b, scaleFixedAvx2(down, alpha)), scaleFixedAvx2(up, alpha));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(bg), b);
+
+    const auto bg8 = _mm256_srli_epi16(_mm256_add_epi16(b, _mm256_set1_epi16(128)), 8);
+    return _mm_packus_epi16(_mm256_castsi256_si128(bg8), _mm256_extracti128_si256(bg8, 1));
+}
+
+MS_TARGET("avx2")
+static inline __m256 temporalValueAvx2(__m256 f, float *bg, float *var, DisplayMode mode, __m256 alpha, __m256 keep)
+{
+    auto b = _mm256_loadu_ps(bg);
+    switch (mode) {
+    case DisplayMode::DeltaFOverF:
+        b = _mm256_add_ps(b, _mm256_mul_ps(alpha, _mm256_sub_ps(f, b)));
+        _mm256_storeu_ps(bg, b);
+        return _mm256_mul_ps(_mm256_div_ps(_mm256_sub_ps(f, b), _mm256_max_ps(b, _mm256_set1_ps(1.0f))),
+                             _mm256_set1_ps(DELTA_F_SCALE));
+    case DisplayMode::MaxProjection:
+        b = _mm256_max_ps(f, _mm256_add_ps(b, _mm256_mul_ps(alpha, _mm256_sub_ps(f, b))));
+        _mm256_storeu_ps(bg, b);
+        return b;
+    default: {
+        const auto diff = _mm256_sub_ps(f, b);
+        const auto incr = _mm256_mul_ps(alpha, diff);
+        _mm256_storeu_ps(bg, _mm256_add_ps(b, incr));
+        const auto v = _mm256_mul_ps(keep, _mm256_add_ps(_mm256_loadu_ps(var), _mm256_mul_ps(diff, incr)));
+        _mm256_storeu_ps(var, v);
+        return _mm256_sqrt_ps(v);
+    }
+    }
+}
+
+MS_TARGET("avx2")
+static void displayRowAvx2(const uint8_t *src, void *bgPtr, float *var, uint8_t *dst, int width,
+                           const DisplayKernelParams &p, uint8_t &minValue, uint8_t &maxValue)
+{
+    const auto alpha = _mm256_set1_ps(p.bgAlpha);
+    const auto keep = _mm256_set1_ps(p.bgKeep);
+    const auto alphaFixed = _mm256_set1_epi16(static_cast<short>(p.bgAlphaFixed));
+    const auto scale = _mm256_set1_ps(p.scale);
+    const auto offset = _mm256_set1_ps(p.offset);
+    auto vmin = _mm_set1_epi8(static_cast<char>(minValue));
+    auto vmax = _mm_set1_epi8(static_cast<char>(maxValue));
+
+    uint8_t values[16];
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        auto px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        if (p.fixedPoint) {
+            px = _mm_subs_epu8(px, backgroundFixedAvx2(px, static_cast<uint16_t*>(bgPtr) + x, alphaFixed));
+        } else if (p.mode == DisplayMode::BackgroundDiff) {
+            const auto bg = static_cast<float*>(bgPtr) + x;
+            const auto f0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(px));
+            const auto f1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(px, 8)));
+            auto b0 = _mm256_loadu_ps(bg);
+            auto b1 = _mm256_loadu_ps(bg + 8);
+            b0 = _mm256_add_ps(b0, _mm256_mul_ps(alpha, _mm256_sub_ps(f0, b0)));
+            b1 = _mm256_add_ps(b1, _mm256_mul_ps(alpha, _mm256_sub_ps(f1, b1)));
+            _mm256_storeu_ps(bg, b0);
+            _mm256_storeu_ps(bg + 8, b1);
+            px = _mm_subs_epu8(px, packFloatsAvx2(b0, b1));
+        } else if (p.mode != DisplayMode::RawFrames) {
+            const auto bg = static_cast<float*>(bgPtr) + x;
+            auto f0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(px));
+            auto f1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(px, 8)));
+            f0 = temporalValueAvx2(f0, bg, varianceAt(var, x, p), p.mode, alpha, keep);
+            f1 = temporalValueAvx2(f1, bg + 8, varianceAt(var, x + 8, p), p.mode, alpha, keep);
+            px = packFloatsAvx2(f0, f1);
+        }
+        vmin = _mm_min_epu8(vmin, px);
+        vmax = _mm_max_epu8(vmax, px);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(values), px);
+        addToHistogram(p.histogram, values);
+
+        auto f0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(px));
+        auto f1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(px, 8)));
+        f0 = _mm256_add_ps(_mm256_mul_ps(f0, scale), offset);
+        f1 = _mm256_add_ps(_mm256_mul_ps(f1, scale), offset);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), packFloatsAvx2(f0, f1));
+    }
+
+    minValue = hminEpu8Sse41(vmin);
+    maxValue = static_cast<uint8_t>(255 - hminEpu8Sse41(_mm_xor_si128(vmax, _mm_set1_epi8(-1))));
+    if (x < width)
+        displayRowScalar(src + x, backgroundAt(bgPtr, x, p), varianceAt(var, x, p), dst + x, width - x, p, minValue, maxValue);
+}
+
+static bool cpuSupports(const char *isa)
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+    __cpuid(info, 1);
+    const bool sse41 = (info[2] & (1 << 19)) != 0;
+    if (std::strcmp(isa, "sse4.1") == 0)
+        return sse41;
+
+    // AVX needs OS support for saving the YMM registers as well
+    const bool osAvx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0
+                           && (_xgetbv(0) & 0x6) == 0x6;
+    if (!osAvx || maxLeaf < 7)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    if (std::strcmp(isa, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    return __builtin_cpu_supports("sse4.1");
+#endif
+}
+#endif // MS_KERNEL_X86
+
+#ifdef MS_KERNEL_NEON
+static inline uint8x16_t packFloatsNeon(float32x4_t f0, float32x4_t f1, float32x4_t f2, float32x4_t f3)
+{
+    const auto lo = vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(f0)), vqmovn_s32(vcvtnq_s32_f32(f1)));
+    const auto hi = vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(f2)), vqmovn_s32(vcvtnq_s32_f32(f3)));
+    return vcombine_u8(vqmovun_s16(lo), vqmovun_s16(hi));
+}
+
+static inline void unpackFloatsNeon(uint8x16_t px, float32x4_t *f)
+{
+    const auto lo16 = vmovl_u8(vget_low_u8(px));
+    const auto hi16 = vmovl_u8(vget_high_u8(px));
+    f[0] = vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo16)));
+    f[1] = vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo16)));
+    f[2] = vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi16)));
+    f[3] = vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi16)));
+}
+
+static inline uint16x8_t scaleFixedNeon(uint16x8_t value, uint16x4_t alpha)
+{
+    return vcombine_u16(vrshrn_n_u32(vmull_u16(vget_low_u16(value), alpha), 16),
+                        vrshrn_n_u32(vmull_u16(vget_high_u16(value), alpha), 16));
+}
+
+static inline uint8x8_t backgroundFixedNeon(uint8x8_t px, uint16_t *bg, uint16x4_t alpha)
+{
+    const auto target = vshll_n_u8(px, 8);
+    auto b = vld1q_u16(bg);
+    const auto up = vqsubq_u16(target, b);
+    const auto down = vqsubq_u16(b, target);
+    b = vaddq_u16(vsubq_u16(b, scaleFixedNeon(down, alpha)), scaleFixedNeon(up, alpha));
+    vst1q_u16(bg, b);
+    return vqrshrn_n_u16(b, 8);
+}
+
+static inline float32x4_t temporalValueNeon(float32x4_t f, float *bg, float *var, const DisplayKernelParams &p)
+{
+    auto b = vld1q_f32(bg);
+    switch (p.mode) {
+    case DisplayMode::DeltaFOverF:
+        b = vaddq_f32(b, vmulq_n_f32(vsubq_f32(f, b), p.bgAlpha));
+        vst1q_f32(bg, b);
+        return vmulq_n_f32(vdivq_f32(vsubq_f32(f, b), vmaxq_f32(b, vdupq_n_f32(1.0f))), DELTA_F_SCALE);
+    case DisplayMode::MaxProjection:
+        b = vmaxq_f32(f, vaddq_f32(b, vmulq_n_f32(vsubq_f32(f, b), p.bgAlpha)));
+        vst1q_f32(bg, b);
+        return b;
+    default: {
+        const auto diff = vsubq_f32(f, b);
+        const auto incr = vmulq_n_f32(diff, p.bgAlpha);
+        vst1q_f32(bg, vaddq_f32(b, incr));
+        const auto v = vmulq_n_f32(vaddq_f32(vld1q_f32(var), vmulq_f32(diff, incr)), p.bgKeep);
+        vst1q_f32(var, v);
+        return vsqrtq_f32(v);
+    }
+    }
+}
+
+static void displayRowNeon(const uint8_t *src, void *bgPtr, float *var, uint8_t *dst, int width,
+                           const DisplayKernelParams &p, uint8_t &minValue, uint8_t &maxValue)
+{
+    const auto offset = vdupq_n_f32(p.offset);
+    const auto alphaFixed = vdup_n_u16(p.bgAlphaFixed);
+    auto vmin = vdupq_n_u8(minValue);
+    auto vmax = vdupq_n_u8(maxValue);
+
+    float32x4_t f[4];
+    uint8_t values[16];
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        auto px = vld1q_u8(src + x);
+        if (p.fixedPoint) {
+            const auto bg = static_cast<uint16_t*>(bgPtr) + x;
+            const auto bg8 = vcombine_u8(backgroundFixedNeon(vget_low_u8(px), bg, alphaFixed),
+                                         backgroundFixedNeon(vget_high_u8(px), bg + 8, alphaFixed));
+            px = vqsubq_u8(px, bg8);
+        } else if (p.mode == DisplayMode::BackgroundDiff) {
+            const auto bg = static_cast<float*>(bgPtr) + x;
+            unpackFloatsNeon(px, f);
+            for (int i = 0; i < 4; i++) {
+                auto b = vld1q_f32(bg + i * 4);
+                b = vaddq_f32(b, vmulq_n_f32(vsubq_f32(f[i], b), p.bgAlpha));
+                vst1q_f32(bg + i * 4, b);
+                f[i] = b;
+            }
+            px = vqsubq_u8(px, packFloatsNeon(f[0], f[1], f[2], f[3]));
+        } else if (p.mode != DisplayMode::RawFrames) {
+            const auto bg = static_cast<float*>(bgPtr) + x;
+            unpackFloatsNeon(px, f);
+            for (int i = 0; i < 4; i++)
+                f[i] = temporalValueNeon(f[i], bg + i * 4, varianceAt(var, x + i * 4, p), p);
+            px = packFloatsNeon(f[0], f[1], f[2], f[3]);
+        }
+        vmin = vminq_u8(vmin, px);
+        vmax = vmaxq_u8(vmax, px);
+        vst1q_u8(values, px);
+        addToHistogram(p.histogram, values);
+
+        unpackFloatsNeon(px, f);
+        for (int i = 0; i < 4; i++)
+            f[i] = vaddq_f32(vmulq_n_f32(f[i], p.scale), offset);
+        vst1q_u8(dst + x, packFloatsNeon(f[0], f[1], f[2], f[3]));
+    }
+
+    minValue = vminvq_u8(vmin);
+    maxValue = vmaxvq_u8(vmax);
+    if (x < width)
+        displayRowScalar(src + x, backgroundAt(bgPtr, x, p), varianceAt(var, x, p), dst + x, width - x, p, minValue, maxValue);
+}
+#endif // MS_KERNEL_NEON
+
+struct DisplayKernelIsa
+{
+    const char *name;
+    DisplayKernelRowFunc rowFunc;
+};
+
+static std::vector<DisplayKernelIsa> supportedIsas()
+{
+    std::vector<DisplayKernelIsa> isas;
+    isas.push_back({"generic", displayRowScalar});
+#if defined(MS_KERNEL_X86)
+    if (cpuSupports("sse4.1"))
+        isas.push_back({"SSE4.1", displayRowSse41});
+    if (cpuSupports("avx2"))
+        isas.push_back({"AVX2", displayRowAvx2});
+#elif defined(MS_KERNEL_NEON)
+    isas.push_back({"NEON", displayRowNeon});
+#endif
+    return isas;
+}
+
+DisplayKernel::DisplayKernel()
+    : m_precision(BackgroundModelPrecision::Float),
+      m_stateMode(DisplayMode::RawFrames),
+      m_minValue(0),
+      m_maxValue(0)
+{
+    m_histogram.fill(0);
+
+    // use the fastest implementation, which is the last one
+    const auto isa = supportedIsas().back();
+    m_rowFunc = isa.rowFunc;
+    m_isaName = isa.name;
+}
+
+bool DisplayKernel::supported(const cv::Mat &frame)
+{
+    return frame.type() == CV_8UC1;
+}
+
+void DisplayKernel::process(const cv::Mat &frame, cv::Mat &out, DisplayMode mode, double alpha,
+                            int minDisplay, int maxDisplay)
+{
+    // all modes but the raw one keep per-pixel state, which is (re)initialized from
+    // the frame when the mode, the frame size or the precision change
+    const bool fixedPoint = mode == DisplayMode::BackgroundDiff && m_precision == BackgroundModelPrecision::FixedPoint;
+    const int bgType = fixedPoint? CV_16UC1 : CV_32FC1;
+    if (mode != DisplayMode::RawFrames
+            && (mode != m_stateMode || m_background.rows != frame.rows
+                || m_background.cols != frame.cols || m_background.type() != bgType)) {
+        frame.convertTo(m_background, bgType, fixedPoint? 256.0 : 1.0);
+        if (mode == DisplayMode::StdDeviation)
+            m_variance = cv::Mat::zeros(frame.rows, frame.cols, CV_32FC1);
+        else
+            m_variance.release();
+        m_stateMode = mode;
+    }
+    out.create(frame.rows, frame.cols, CV_8UC1);
+
+    DisplayKernelParams params;
+    params.mode = mode;
+    params.fixedPoint = fixedPoint;
+    params.bgAlpha = static_cast<float>(alpha);
+    params.bgKeep = 1.0f - params.bgAlpha;
+    params.bgAlphaFixed = static_cast<uint16_t>(std::min(std::max(std::round(alpha * 65536.0), 0.0), 65535.0));
+    params.scale = 255.0f / static_cast<float>(std::max(maxDisplay - minDisplay, 1));
+    params.offset = -static_cast<float>(minDisplay) * params.scale;
+    params.histogram = m_subHistograms.data();
+    m_subHistograms.fill(0);
+
+    uint8_t minValue = 255;
+    uint8_t maxValue = 0;
+    for (int y = 0; y < frame.rows; y++) {
+        m_rowFunc(frame.ptr<uint8_t>(y),
+                  mode != DisplayMode::RawFrames? m_background.ptr(y) : nullptr,
+                  mode == DisplayMode::StdDeviation? m_variance.ptr<float>(y) : nullptr,
+                  out.ptr<uint8_t>(y),
+                  frame.cols,
+                  params,
+                  minValue,
+                  maxValue);
+    }
+
+    m_minValue = minValue;
+    m_maxValue = maxValue;
+    for (size_t i = 0; i < m_histogram.size(); i++)
+        m_histogram[i] = m_subHistograms[i] + m_subHistograms[256 + i] + m_subHistograms[512 + i] + m_subHistograms[768 + i];
+}
+
+void DisplayKernel::resetBackground()
+{
+    m_background.release();
+    m_variance.release();
+}
+
+BackgroundModelPrecision DisplayKernel::precision() const
+{
+    return m_precision;
+}
+
+void DisplayKernel::setPrecision(BackgroundModelPrecision precision)
+{
+    m_precision = precision;
+}
+
+int DisplayKernel::minValue() const
+{
+    return m_minValue;
+}
+
+int DisplayKernel::maxValue() const
+{
+    return m_maxValue;
+}
+
+const char *DisplayKernel::isaName() const
+{
+    return m_isaName;
+}
+
+std::vector<const char*> DisplayKernel::availableIsas()
+{
+    std::vector<const char*> names;
+    for (const auto &isa : supportedIsas())
+        names.push_back(isa.name);
+    return names;
+}
+
+bool DisplayKernel::setIsa(const char *name)
+{
+    for (const auto &isa : supportedIsas()) {
+        if (std::strcmp(isa.name, name) == 0) {
+            m_rowFunc = isa.rowFunc;
+            m_isaName = isa.name;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const std::array<uint32_t, 256> &DisplayKernel::histogram() const
+{
+    return m_histogram;
+}
+
+int DisplayKernel::histogramPercentile(const std::array<uint32_t, 256> &histogram, double percent)
+{
+    uint64_t total = 0;
+    for (const auto count : histogram)
+        total += count;
+    if (total == 0)
+        return 0;
+
+    const auto wanted = static_cast<uint64_t>(std::ceil(total * std::min(std::max(percent, 0.0), 100.0) / 100.0));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < histogram.size(); i++) {
+        seen += histogram[i];
+        if (seen >= wanted && seen > 0)
+            return static_cast<int>(i);
+    }
+
+    return static_cast<int>(histogram.size() - 1);
+}
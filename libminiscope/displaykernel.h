@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DISPLAYKERNEL_H
+#define DISPLAYKERNEL_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "miniscope.h"
+
+namespace MScope
+{
+
+/**
+ * @brief Per-row parameters of the display kernel
+ */
+struct DisplayKernelParams
+{
+    DisplayMode mode;      // which values to compute from the frame
+    bool fixedPoint;       // background is 8.8 fixed point uint16_t instead of float (background diff only)
+    float bgAlpha;         // weight of the new frame in the per-pixel state
+    float bgKeep;          // 1 - bgAlpha
+    uint16_t bgAlphaFixed; // the same weight, in units of 1/65536
+    float scale;           // contrast window, display value = value * scale + offset
+    float offset;
+    uint32_t *histogram;   // four interleaved 256-bin histograms of the values before contrast mapping
+};
+
+typedef void (*DisplayKernelRowFunc)(const uint8_t *src, void *bg, float *var, uint8_t *dst, int width,
+                                     const DisplayKernelParams &params, uint8_t &minValue, uint8_t &maxValue);
+
+/**
+ * @brief Single-pass display processing of 8-bit gray frames
+ *
+ * Computes the values of the selected display mode from the frame and the
+ * per-pixel state of that mode, tracks the minimum and maximum of the resulting
+ * values, builds their histogram and maps them through the display contrast
+ * window, all in one sweep over the frame. For background subtraction, doing
+ * this with separate OpenCV calls needs seven full passes and two intermediate
+ * float images.
+ *
+ * The display modes compute:
+ *  - BackgroundDiff: frame minus its running average, clipped at zero
+ *  - DeltaFOverF: (frame - running average) / running average, one gray level per percent
+ *  - MaxProjection: running maximum, which decays towards the current frame at rate alpha
+ *  - StdDeviation: exponentially weighted running standard deviation, in gray levels
+ *
+ * The fastest implementation the CPU supports (AVX2, SSE4.1, NEON or plain C++)
+ * is selected at runtime. All implementations produce identical results.
+ *
+ * The background model is kept either as floats in the 0-255 range, or as
+ * 16-bit fixed point numbers with 8 fractional bits, which halves the memory
+ * traffic of the model. In fixed point, background changes of less than about
+ * 1/(512 * alpha) gray levels per frame are lost, which is invisible in
+ * the background difference display.
+ * All float state is initialized from the first frame, and reset whenever the
+ * display mode, frame size or the precision changes. No memory is allocated
+ * after that.
+ */
+class DisplayKernel
+{
+public:
+    explicit DisplayKernel();
+
+    /**
+     * @brief Process a frame for display
+     *
+     * @param frame 8-bit single channel input frame, is never modified.
+     * @param out Output image, (re)allocated if its size or type do not match.
+     * @param mode Which values to display.
+     * @param alpha Weight of this frame in the per-pixel running state.
+     * @param minDisplay Value that is mapped to black.
+     * @param maxDisplay Value that is mapped to white.
+     */
+    void process(const cv::Mat &frame, cv::Mat &out, DisplayMode mode, double alpha,
+                 int minDisplay, int maxDisplay);
+
+    void resetBackground();
+
+    BackgroundModelPrecision precision() const;
+    void setPrecision(BackgroundModelPrecision precision);
+
+    /**
+     * @brief Minimum and maximum value of the last processed frame, before contrast mapping
+     */
+    int minValue() const;
+    int maxValue() const;
+
+    /**
+     * @brief Histogram of the last processed frame, before contrast mapping
+     */
+    const std::array<uint32_t, 256> &histogram() const;
+
+    /**
+     * @brief Value below which the given percentage of the pixels in the histogram lie
+     */
+    static int histogramPercentile(const std::array<uint32_t, 256> &histogram, double percent);
+
+    /**
+     * @brief Name of the instruction set the kernel uses on this machine
+     */
+    const char *isaName() const;
+
+    /**
+     * @brief Names of all implementations that can run on this machine, slowest first
+     */
+    static std::vector<const char*> availableIsas();
+
+    /**
+     * @brief Use the named implementation instead of the fastest one, for tests and benchmarks
+     * @return false if there is no such implementation for this machine.
+     */
+    bool setIsa(const char *name);
+
+    static bool supported(const cv::Mat &frame);
+
+private:
+    DisplayKernelRowFunc m_rowFunc;
+    const char *m_isaName;
+    BackgroundModelPrecision m_precision;
+    DisplayMode m_stateMode;
+    cv::Mat m_background;
+    cv::Mat m_variance;
+    int m_minValue;
+    int m_maxValue;
+    std::array<uint32_t, 4 * 256> m_subHistograms;
+    std::array<uint32_t, 256> m_histogram;
+};
+
+} // end of MiniScope namespace
+
+#endif // DISPLAYKERNEL_H
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "framepool.h"
+
+#include <QDebug>
+
+#include "miniscope.h"
+
+using namespace MScope;
+
+// row alignment FFmpeg needs to be able to read frames without copying them
+static const int POOL_ROW_ALIGNMENT = 32;
+
+FramePool::FramePool(size_t initialCount, size_t maxCount)
+    : m_initialCount(initialCount),
+      m_maxCount(maxCount < initialCount? initialCount : maxCount),
+      m_type(-1),
+      m_next(0),
+      m_exhaustedWarned(false)
+{
+}
+
+size_t FramePool::alignedStep(int width, int type)
+{
+    // padding the width (rather than the byte count) to the alignment keeps the
+    // step a multiple of the element size, so we can use a regular cv::Mat
+    const auto paddedWidth = (width + POOL_ROW_ALIGNMENT - 1) / POOL_ROW_ALIGNMENT * POOL_ROW_ALIGNMENT;
+    return static_cast<size_t>(paddedWidth) * CV_ELEM_SIZE(type);
+}
+
+cv::Mat FramePool::allocateBuffer() const
+{
+    const auto paddedWidth = static_cast<int>(alignedStep(m_size.width, m_type) / CV_ELEM_SIZE(m_type));
+    return cv::Mat(m_size.height, paddedWidth, m_type);
+}
+
+bool FramePool::isFree(const cv::Mat &buffer)
+{
+    // the buffer is free if the pool holds the only reference to it.
+    // The refcount is modified atomically by OpenCV from other threads, so read it atomically too.
+    return CV_XADD(&buffer.u->refcount, 0) == 1;
+}
+
+void FramePool::clear()
+{
+    m_buffers.clear();
+    m_next = 0;
+    m_type = -1;
+    m_size = cv::Size();
+    m_exhaustedWarned = false;
+}
+
+cv::Mat FramePool::acquire(const cv::Size &size, int type)
+{
+    if (size != m_size || type != m_type) {
+        clear();
+        m_size = size;
+        m_type = type;
+        if (m_size.area() <= 0)
+            return cv::Mat();
+
+        m_buffers.reserve(m_maxCount);
+        for (size_t i = 0; i < m_initialCount; i++)
+            m_buffers.push_back(allocateBuffer());
+    }
+
+    // Buffers are usually released in the order we handed them out, so searching
+    // from the position after the last one we returned will find a free one quickly.
+    const auto bufferCount = m_buffers.size();
+    for (size_t i = 0; i < bufferCount; i++) {
+        const auto idx = (m_next + i) % bufferCount;
+        if (isFree(m_buffers[idx])) {
+            m_next = (idx + 1) % bufferCount;
+            return m_buffers[idx].colRange(0, m_size.width);
+        }
+    }
+
+    // all buffers are in use, some downstream stage must be lagging behind
+    if (bufferCount < m_maxCount) {
+        m_buffers.push_back(allocateBuffer());
+        m_next = 0;
+        return m_buffers.back().colRange(0, m_size.width);
+    }
+
+    if (!m_exhaustedWarned) {
+        qCWarning(logMScope).noquote() << "Frame buffer pool exhausted, allocating frames outside of the pool.";
+        m_exhaustedWarned = true;
+    }
+    return allocateBuffer().colRange(0, m_size.width);
+}
+
+size_t FramePool::count() const
+{
+    return m_buffers.size();
+}
+
+size_t FramePool::inUseCount() const
+{
+    size_t n = 0;
+    for (const auto &buffer : m_buffers) {
+        if (!isFree(buffer))
+            n++;
+    }
+    return n;
+}
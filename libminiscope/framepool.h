@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace MScope
+{
+
+/**
+ * @brief Pool of reusable, preallocated frame buffers
+ *
+ * All buffers share the same size and type, and their rows are padded to
+ * a multiple of 32 bytes, so FFmpeg's SIMD code can read them directly.
+ *
+ * A buffer handed out by acquire() is a regular cv::Mat that can be passed
+ * on to other threads freely. Once the last reference to it outside of the
+ * pool is gone, the buffer is reused. If all buffers are in use, the pool
+ * grows up to its maximum size, so in steady state no memory is allocated.
+ *
+ * The pool itself is not thread-safe and must only be used by one thread.
+ */
+class FramePool
+{
+public:
+    explicit FramePool(size_t initialCount, size_t maxCount);
+
+    /**
+     * @brief Get a free buffer of the given size and type
+     *
+     * If the size or type differs from the one the pool was last used with,
+     * all buffers are discarded and new ones are allocated.
+     */
+    cv::Mat acquire(const cv::Size &size, int type);
+
+    /**
+     * @brief Drop all buffers the pool owns
+     *
+     * Buffers which are still in use elsewhere stay valid until they are released.
+     */
+    void clear();
+
+    size_t count() const;
+    size_t inUseCount() const;
+
+    static size_t alignedStep(int width, int type);
+
+private:
+    size_t m_initialCount;
+    size_t m_maxCount;
+    cv::Size m_size;
+    int m_type;
+
+    std::vector<cv::Mat> m_buffers;
+    size_t m_next;
+    bool m_exhaustedWarned;
+
+    cv::Mat allocateBuffer() const;
+    static bool isFree(const cv::Mat &buffer);
+};
+
+} // end of MiniScope namespace
+
+#endif // FRAMEPOOL_H
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "framesource.h"
+
+#include <thread>
+#include <QDebug>
+#include <opencv2/imgproc.hpp>
+
+#include "miniscope.h"
+
+using namespace MScope;
+
+CvFrameSource::CvFrameSource()
+{
+}
+
+CvFrameSource::~CvFrameSource()
+{
+    release();
+}
+
+QString CvFrameSource::name() const
+{
+    return QString::fromStdString(m_cam.getBackendName());
+}
+
+bool CvFrameSource::open(int camId, const cv::Size &resolution)
+{
+    // Use V4L on Linux, as apparently the GStreamer backend, if automatically chosen, has issues
+    // with some properties of the Miniscope camera and will refuse to grab any proper frame.
+    // On Windows on the other hand, the MSMF backend seems to be the best and most complete option.
+    // If any of them fail, just try the API autodetection in OpenCV.
+    auto apiPreference = cv::CAP_ANY;
+    bool ret;
+#ifdef Q_OS_LINUX
+    apiPreference = cv::CAP_V4L2;
+#elif defined(Q_OS_WIN)
+    apiPreference = cv::CAP_MSMF;
+#endif
+    m_lastError.clear();
+    ret = m_cam.open(camId, apiPreference);
+    if (!ret) {
+        // we failed opening the camera - try again using OpenCV's backend autodetection
+        qCWarning(logMScope).noquote() << "Unable to use preferred camera backend, falling back to autodetection.";
+        ret = m_cam.open(camId);
+    }
+
+    if (!ret) {
+        m_lastError = QStringLiteral("Unable to open camera %1").arg(camId);
+        return false;
+    }
+
+    // set height/width for new DAQ firmware versions which can support
+    // multiple Miniscope device types
+    if (resolution.width > 0)
+        m_cam.set(cv::CAP_PROP_FRAME_WIDTH, resolution.width);
+    if (resolution.height > 0)
+        m_cam.set(cv::CAP_PROP_FRAME_HEIGHT, resolution.height);
+    m_size = cv::Size(static_cast<int>(m_cam.get(cv::CAP_PROP_FRAME_WIDTH)),
+                      static_cast<int>(m_cam.get(cv::CAP_PROP_FRAME_HEIGHT)));
+
+    // The Miniscope sensor is monochrome, so letting OpenCV convert every frame to BGR
+    // just so we can convert it back to gray is a waste. Ask for the raw data instead,
+    // backends which don't support this will ignore the request and still give us BGR.
+    m_cam.set(cv::CAP_PROP_CONVERT_RGB, 0);
+
+    return true;
+}
+
+void CvFrameSource::release()
+{
+    m_cam.release();
+}
+
+bool CvFrameSource::isOpened() const
+{
+    return m_cam.isOpened();
+}
+
+void CvFrameSource::setFps(double fps)
+{
+    m_cam.set(cv::CAP_PROP_FPS, fps);
+}
+
+bool CvFrameSource::grab()
+{
+    return m_cam.grab();
+}
+
+bool CvFrameSource::retrieve(cv::Mat &frame)
+{
+    if (!m_cam.retrieve(m_rawFrame))
+        return false;
+
+    const auto pixelCount = static_cast<size_t>(m_size.area());
+    if (m_rawFrame.rows == 1 && pixelCount > 0 && m_rawFrame.depth() == CV_8U) {
+        // unconverted V4L buffer, we get the driver data as a single row of bytes
+        const auto bytes = m_rawFrame.total() * m_rawFrame.elemSize();
+        if (bytes == pixelCount) {
+            m_rawFrame.reshape(1, m_size.height).copyTo(frame);
+            return true;
+        }
+        if (bytes == pixelCount * 2) {
+            // YUYV, the luma of each pixel is stored in every other byte
+            cv::extractChannel(m_rawFrame.reshape(2, m_size.height), frame, 0);
+            return true;
+        }
+        m_lastError = QStringLiteral("Received frame of unexpected size (%1 bytes).").arg(bytes);
+        return false;
+    }
+
+    switch (m_rawFrame.channels()) {
+    case 1:
+        m_rawFrame.copyTo(frame);
+        break;
+    case 2:
+        cv::extractChannel(m_rawFrame, frame, 0);
+        break;
+    case 3:
+        cv::cvtColor(m_rawFrame, frame, cv::COLOR_BGR2GRAY);
+        break;
+    default:
+        cv::cvtColor(m_rawFrame, frame, cv::COLOR_BGRA2GRAY);
+    }
+
+    return true;
+}
+
+std::chrono::milliseconds CvFrameSource::frameTimestamp()
+{
+    return std::chrono::milliseconds(static_cast<long>(m_cam.get(cv::CAP_PROP_POS_MSEC)));
+}
+
+bool CvFrameSource::sendControlBytes(double head, double middle, double tail)
+{
+    // Linux apparently is faster at USB communication than Windows, and since our DAQ
+    // board is slow at clearing data from its control endpoint, not waiting a bit before
+    // sending the next command will result in the old command being overridden (which breaks
+    // our packet layout)
+    // Waiting >100µs seems to generally work. We call the wait function on all platforms,
+    // just in case some computers on Windows also manage to communicate with similar speeds then
+    // Windows, but keep in mind that Windows may not be able to wait with microsecond accuracy and
+    // may wait 1ms instead of our set value.
+    const auto controlReqCooldownTime = std::chrono::microseconds(128);
+
+    bool ret = m_cam.set(cv::CAP_PROP_CONTRAST, head);
+    std::this_thread::sleep_for(controlReqCooldownTime);
+    ret = m_cam.set(cv::CAP_PROP_GAMMA, middle) && ret;
+    std::this_thread::sleep_for(controlReqCooldownTime);
+    ret = m_cam.set(cv::CAP_PROP_SHARPNESS, tail) && ret;
+    std::this_thread::sleep_for(controlReqCooldownTime);
+
+    return ret;
+}
+
+bool CvFrameSource::setRecordingState(bool recording)
+{
+    return m_cam.set(cv::CAP_PROP_SATURATION, recording? 0x0001 : 0x0000);
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESOURCE_H
+#define FRAMESOURCE_H
+
+#include <chrono>
+#include <QString>
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+namespace MScope
+{
+
+/**
+ * @brief The FrameSource class
+ *
+ * Abstract source of Miniscope frames, used by the DAQ thread.
+ * This hides whether frames come from a real DAQ board, are generated
+ * synthetically or are replayed from a previous recording.
+ *
+ * The grab() / retrieve() split mirrors cv::VideoCapture: grab() should
+ * return as quickly as possible once a new frame is available, so the
+ * timestamp we take around it is as precise as possible.
+ */
+class FrameSource
+{
+public:
+    virtual ~FrameSource() {}
+
+    virtual QString name() const = 0;
+
+    virtual bool open(int camId, const cv::Size &resolution) = 0;
+    virtual void release() = 0;
+    virtual bool isOpened() const = 0;
+
+    virtual void setFps(double fps) = 0;
+
+    virtual bool grab() = 0;
+
+    /**
+     * @brief Fetch the last grabbed frame as single-channel 8-bit image
+     */
+    virtual bool retrieve(cv::Mat &frame) = 0;
+
+    /**
+     * @brief Driver/device timestamp of the last grabbed frame
+     */
+    virtual std::chrono::milliseconds frameTimestamp() = 0;
+
+    /**
+     * @brief Device sequence number of the last grabbed frame, or -1 if the source has none
+     *
+     * Gaps in the sequence mean that frames were lost before they reached us.
+     */
+    virtual qint64 frameSequence()
+    {
+        return -1;
+    }
+
+    /**
+     * @brief Time at which the last grabbed frame was captured, on the steady clock
+     *
+     * Returns false if the source can not tell, in which case the DAQ thread
+     * estimates the time from the duration of grab().
+     */
+    virtual bool frameCaptureTime(std::chrono::time_point<std::chrono::steady_clock> &)
+    {
+        return false;
+    }
+
+    /**
+     * @brief Submit a control packet (split into three 16-bit parts) to the DAQ board
+     */
+    virtual bool sendControlBytes(double head, double middle, double tail) = 0;
+
+    /**
+     * @brief Tell the DAQ board whether we are recording (enables the sync trigger output)
+     */
+    virtual bool setRecordingState(bool recording) = 0;
+
+    QString lastError() const
+    {
+        return m_lastError;
+    }
+
+protected:
+    QString m_lastError;
+};
+
+/**
+ * @brief Frames from a Miniscope DAQ board, read via OpenCV's VideoCapture
+ */
+class CvFrameSource : public FrameSource
+{
+public:
+    explicit CvFrameSource();
+    ~CvFrameSource() override;
+
+    QString name() const override;
+
+    bool open(int camId, const cv::Size &resolution) override;
+    void release() override;
+    bool isOpened() const override;
+
+    void setFps(double fps) override;
+
+    bool grab() override;
+    bool retrieve(cv::Mat &frame) override;
+    std::chrono::milliseconds frameTimestamp() override;
+
+    bool sendControlBytes(double head, double middle, double tail) override;
+    bool setRecordingState(bool recording) override;
+
+private:
+    cv::VideoCapture m_cam;
+    cv::Size m_size;
+    cv::Mat m_rawFrame;
+};
+
+} // end of MiniScope namespace
+
+#endif // FRAMESOURCE_H
@@ -65,6 +65,15 @@ enum class VideoCodec {
 std::string videoCodecToString(VideoCodec codec);
 VideoCodec stringToVideoCodec(const std::string& str);
 
+/**
+ * @brief How the video encoder spreads its work over multiple threads
+ */
+enum class EncoderThreading {
+    Auto,  /// frame or slice threading, whatever the codec supports
+    Frame, /// encode several frames in parallel, adds a few frames of latency
+    Slice  /// split every frame into slices which are encoded in parallel
+};
+
 } // end of MiniScope namespace
 
 #endif // MEDIATYPES_H
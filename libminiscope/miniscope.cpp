@@ -19,16 +19,15 @@
 
 #include "miniscope.h"
 
+#include <array>
 #include <chrono>
+#include <cmath>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <QDebug>
 #include <QQueue>
-#include <QFile>
-#include <QJsonDocument>
-#include <QJsonObject>
-#include <QJsonArray>
 #include <QHash>
 #include <QDateTime>
 #include <opencv2/highgui.hpp>
@@ -37,8 +36,22 @@
 #include <opencv2/opencv_modules.hpp>
 #include <opencv2/videoio.hpp>
 
-#include "scopeintf.h"
 #include "videowriter.h"
+#include "spscring.h"
+#include "triplebuffer.h"
+#include "framepool.h"
+#include "pipelinestats.h"
+#include "displaykernel.h"
+#include "motioncorrection.h"
+#include "roiengine.h"
+#include "tracerecorder.h"
+#include "deviceregistry.h"
+#include "framesource.h"
+#include "syntheticsource.h"
+#include "replaysource.h"
+#ifdef Q_OS_LINUX
+#include "v4l2source.h"
+#endif
 
 void initLibraryResources()
 {
@@ -51,22 +64,30 @@ namespace MScope
 Q_LOGGING_CATEGORY(logMScope, "miniscope")
 
 /**
- * @brief Defines a rule to scale values and convert them to a packet
+ * @brief A frame handed from the acquisition thread to the display thread
  */
-class ControlCommandRule
+struct DisplayPacket
 {
-public:
-    explicit ControlCommandRule()
-        : valueScale(1),
-          valueOffset(0),
-          valueBitshift(0)
-    {}
-    std::vector<QHash<QString, int>> commands;
-    double valueScale;
-    double valueOffset;
-    int valueBitshift;
-    std::vector<double> valueMap;
-    std::vector<double> numLabelMap;
+    cv::Mat frame;
+    milliseconds_t timestamp = milliseconds_t(0);
+    bool dropped = false;
+};
+
+enum class RecordAction {
+    Frame,
+    Start,
+    Stop
+};
+
+/**
+ * @brief A frame or recording state change handed from the acquisition thread to the recording thread
+ */
+struct RecordPacket
+{
+    RecordAction action = RecordAction::Frame;
+    cv::Mat frame;
+    milliseconds_t timestamp = milliseconds_t(0);
+    cv::Point2d motionShift;
 };
 
 #pragma GCC diagnostic push
@@ -83,27 +104,63 @@ public:
           failed(false),
           checkRecTrigger(false),
           droppedFramesCount(0),
+          deviceDroppedFramesCount(0),
           useColor(false),
           printExtraDebug(true)
     {
         fps = 30;
-        displayQueue.clear();
+        displayHistoryLength = 0;
+        displaySequence = 0;
+        lastDisplayRequestNsec = 0;
+        headless = false;
+        displayRateLimit = 0;
+        lastReadDisplaySequence = 0;
+        sourceKind = FrameSourceKind::Device;
+        replaySpeed = 1;
+        replayLoop = false;
+        captureBufferCount = 4;
         videoCodec = VideoCodec::FFV1;
         videoContainer = VideoContainer::Matroska;
+        videoEncoderThreads = 0;
+        concurrentRecordings = 0;
+        videoEncoderThreading = EncoderThreading::Auto;
+        videoFfv1Slices = 0;
+        videoFfv1SliceCrc = true;
 
         showRed = true;
         showGreen = true;
         showBlue = true;
 
         displayMode = DisplayMode::RawFrames;
+        bgModelPrecision = BackgroundModelPrecision::Float;
 
         minFluorDisplay = 0;
         maxFluorDisplay = 255;
+        autoContrast = false;
+        autoContrastLow = 1.0;
+        autoContrastHigh = 99.5;
+        displayHistogram.resize(256, 0);
 
         recordingSliceInterval = 0; // don't slice
+        encoderQueueHighWatermark = 512;
+        encoderQueueLowWatermark = 384;
+        encoderQueueDepth = 0;
+        encoderQueuePeakDepth = 0;
+        encoderBackpressureCount = 0;
         bgAccumulateAlpha = 0.01;
 
+        motionCorrection = false;
+        motionCorrectDisplay = true;
+        motionCorrectRecording = false;
+        motionDownsample = 2;
+
+        roiGeneration = 0;
+        roiNeuropil = false;
+        roiNeuropilFactor = 0.7;
+        roiTraceHistoryLength = 0;
+
         startTimepoint = std::chrono::time_point<std::chrono::steady_clock>::min();
+        recordingStartTimepoint = std::chrono::time_point<std::chrono::steady_clock>::min();
         useUnixTime = false; // no timestamps in UNIX time by default
         unixCaptureStartTime = milliseconds_t(0);
 
@@ -111,29 +168,66 @@ public:
         controlChangeCallback.first = nullptr;
         frameCallback.first = nullptr;
         displayFrameCallback.first = nullptr;
+        roiTraceCallback.first = nullptr;
     }
 
     std::thread *thread;
-    std::mutex frameMutex;
     std::mutex timeMutex;
     std::mutex cmdMutex;
+    std::condition_variable cmdCond;
+    std::mutex sourceMutex;
+
+    // The acquisition thread only grabs frames and hands them off to the other
+    // stages via these rings, so it never has to wait for any of them.
+    // If displaying is too slow, we just skip frames for display. If recording
+    // can't keep up, we fail, as we must never silently lose recorded data.
+    SPSCRing<DisplayPacket> displayRing{8};
+    SPSCRing<RecordPacket> recordRing{256};
+    std::atomic_bool acquisitionDone;
+    std::atomic_bool daqRecordingState;
+
+    // the display and record threads sleep on these while their ring is empty
+    std::mutex stageMutex;
+    std::condition_variable displayCond;
+    std::condition_variable recordCond;
+
+    void wakeStage(std::condition_variable &cond)
+    {
+        // taking the lock orders this with the emptiness check of the sleeping thread,
+        // so it can not miss the wakeup. The lock is only ever held for that check.
+        {
+            const std::lock_guard<std::mutex> lock(stageMutex);
+        }
+        cond.notify_all();
+    }
+    std::atomic<size_t> displaySkippedCount;
+
+    // buffers for captured frames, owned by the acquisition thread. The pool may grow large enough
+    // to hold all frames that can be queued for recording, but only does so if the encoder lags behind.
+    FramePool framePool{24, 1024};
+
+    PipelineStats stats;
+    TraceRecorder trace;
+    QString traceFname;
 
     std::pair<StatusMessageCallback, void*> statusCallback;
     std::pair<ControlChangeCallback, void*> controlChangeCallback;
 
-    cv::VideoCapture cam;
+    std::unique_ptr<FrameSource> source;
+    FrameSourceKind sourceKind;
+    SyntheticSourceSettings syntheticSettings;
+    QString replayFname;
+    double replaySpeed;
+    bool replayLoop;
+    uint captureBufferCount;
     int scopeCamId;
+
+    mutable std::mutex schedMutex;
+    std::array<ThreadScheduling, static_cast<size_t>(ThreadRole::Last)> threadScheduling;
     bool emulateTimestamps;
 
-    QJsonObject deviceConfig;
     QString deviceType;
-    cv::Size resolution;
-    bool supportsColor;
-    QString sensorType;
-    double pixelClock;
-
-    std::vector<ControlDefinition> controls;
-    QHash<QString, ControlCommandRule> controlRules;
+    std::shared_ptr<const DeviceDefinition> device;
     QHash<QString, double> controlValueCache;
 
     QQueue<QPair<long, std::vector<quint8> >> commandQueue;
@@ -143,6 +237,7 @@ public:
     bool useUnixTime;
     std::atomic<milliseconds_t> unixCaptureStartTime;
     std::chrono::time_point<std::chrono::steady_clock> startTimepoint;
+    std::chrono::time_point<std::chrono::steady_clock> recordingStartTimepoint;
     std::atomic_bool captureStartTimeInitialized;
 
     std::atomic_int minFluor;
@@ -150,9 +245,36 @@ public:
     std::atomic_int minFluorDisplay;
     std::atomic_int maxFluorDisplay;
 
+    std::atomic_bool autoContrast;
+    std::atomic<double> autoContrastLow;
+    std::atomic<double> autoContrastHigh;
+    mutable std::mutex histogramMutex;
+    std::vector<int> displayHistogram;
+
     std::atomic<DisplayMode> displayMode;
+    std::atomic<BackgroundModelPrecision> bgModelPrecision;
     std::atomic<double> bgAccumulateAlpha;  // NOTE: Double may not actually be atomic
 
+    std::atomic_bool motionCorrection;
+    std::atomic_bool motionCorrectDisplay;
+    std::atomic_bool motionCorrectRecording;
+    std::atomic_int motionDownsample;
+    mutable std::mutex motionMutex;
+    cv::Rect motionRegion;
+    cv::Point2d motionShift;
+
+    // ROI definitions are compiled by the acquisition thread, which picks them up
+    // whenever the generation counter changed
+    std::mutex roiMutex;
+    std::vector<RoiDefinition> rois;
+    std::atomic<uint64_t> roiGeneration;
+    std::atomic_bool roiNeuropil;
+    std::atomic<double> roiNeuropilFactor;
+    std::mutex roiReadMutex;
+    uint roiTraceHistoryLength;
+    std::unique_ptr<SPSCRing<RoiTrace>> roiTraceHistory;
+    std::pair<RoiTraceCallback, void*> roiTraceCallback;
+
     bool connected;
     std::atomic_bool running;
     std::atomic_bool recording;
@@ -160,10 +282,22 @@ public:
     std::atomic_bool checkRecTrigger;
 
     std::atomic<size_t> droppedFramesCount;
+    std::atomic<size_t> deviceDroppedFramesCount;
     std::atomic_uint currentFPS;
     std::atomic<milliseconds_t> lastRecordedFrameTime;
 
-    QQueue<cv::Mat> displayQueue;
+    // The display thread publishes every frame here, readers always get the newest one.
+    // Readers are serialized by their own lock, so they never block the display thread.
+    TripleBuffer<DisplayFrame> displayBuffer;
+    std::mutex displayReadMutex;
+    uint64_t lastReadDisplaySequence;
+    uint64_t displaySequence;
+    uint displayHistoryLength;
+    std::atomic<int64_t> lastDisplayRequestNsec;
+
+    std::atomic_bool headless;
+    std::atomic<double> displayRateLimit;
+    std::unique_ptr<SPSCRing<DisplayFrame>> displayHistory;
     std::pair<RawFrameCallback, void*> frameCallback;
     std::pair<DisplayFrameCallback, void*> displayFrameCallback;
 
@@ -175,33 +309,41 @@ public:
     VideoCodec videoCodec;
     VideoContainer videoContainer;
     bool recordLossless;
+    int videoEncoderThreads;
+    std::atomic_int concurrentRecordings;
+    EncoderThreading videoEncoderThreading;
+    int videoFfv1Slices;
+    bool videoFfv1SliceCrc;
     uint recordingSliceInterval;
+    std::atomic_uint encoderQueueHighWatermark;
+    std::atomic_uint encoderQueueLowWatermark;
+    std::atomic<size_t> encoderQueueDepth;
+    std::atomic<size_t> encoderQueuePeakDepth;
+    std::atomic<size_t> encoderBackpressureCount;
 
     bool printExtraDebug;
+
+    // written by the acquisition and record threads when they fail, read from anywhere
+    mutable std::mutex errorMutex;
     QString lastError;
+
+    void setLastError(const QString &msg)
+    {
+        const std::lock_guard<std::mutex> lock(errorMutex);
+        lastError = msg;
+    }
 };
 #pragma GCC diagnostic pop
 
 } // end of namespace MScope
 
 
-typedef QHash<QString, QString> ControlIdToNameHash;
-Q_GLOBAL_STATIC_WITH_ARGS(ControlIdToNameHash, g_controlIdToName, ( {
-    { QLatin1String("frameRate"), QLatin1String("Framerate") },
-    { QLatin1String("led0"), QLatin1String("Excitation") },
-    { QLatin1String("gain"), QLatin1String("Gain") },
-    { QLatin1String("ewl"), QLatin1String("EWL") },
-    }
-));
-
-
 Miniscope::Miniscope()
     : d(new Miniscope::Private())
 {
     initLibraryResources();
 
     d->fps = 20;
-    d->deviceConfig = QJsonObject();
 }
 
 Miniscope::~Miniscope()
@@ -215,101 +357,19 @@ static void msgInfo(const QString &msg)
     qCInfo(logMScope).noquote() << msg;
 }
 
-static QJsonObject msconfGetDevicesJson()
-{
-    QFile msTypesRc(QStringLiteral(":/config/miniscopes.json"));
-    if (!msTypesRc.open(QIODevice::ReadOnly)) {
-        qCWarning(logMScope).noquote() << "Unable to find Miniscope hardware definitions!";
-        return QJsonObject();
-    }
-    const auto jDoc = QJsonDocument::fromJson(msTypesRc.readAll());
-
-    return jDoc.object();
-}
-
-static int msconfStringToInt(const QString &s)
+QStringList Miniscope::availableDeviceTypes() const
 {
-    // Should return a uint8 type of value (0 to 255)
-    bool ok = false;
-    int value;
-    int size = s.size();
-    if (size == 0) {
-        qCDebug(logMScope) << "No data in string to convert to int";
-        value = SEND_COMMAND_ERROR;
-        ok = false;
-    }
-    else if (s.left(2) == "0x"){
-        // HEX
-        value = s.right(size - 2).toUInt(&ok, 16);
-    }
-    else if (s.left(2) == "0b"){
-        // Binary
-        value = s.right(size - 2).toUInt(&ok, 2);
-    }
-    else {
-        value = s.toUInt(&ok, 10);
-        if (ok == false) {
-            // This is then a string
-            if (s == "I2C")
-                value = PROTOCOL_I2C;
-            else if (s == "SPI")
-                value = PROTOCOL_SPI;
-            else if (s == "valueH24")
-                value = SEND_COMMAND_VALUE_H24;
-            else if (s == "valueH16")
-                value = SEND_COMMAND_VALUE_H16;
-            else if (s == "valueH")
-                value = SEND_COMMAND_VALUE_H;
-            else if (s == "valueL")
-                value = SEND_COMMAND_VALUE_L;
-            else if (s == "value")
-                value = SEND_COMMAND_VALUE;
-            else if (s == "value2H")
-                value = SEND_COMMAND_VALUE2_H;
-            else if (s == "value2L")
-                value = SEND_COMMAND_VALUE2_L;
-            else
-                value = SEND_COMMAND_ERROR;
-            ok = true;
-        }
-    }
-
-    if (ok == true)
-        return value;
-    else
-        return SEND_COMMAND_ERROR;
+    return DeviceRegistry::instance()->deviceTypes();
 }
 
-static std::vector<QHash<QString, int>> msconfParseSendCommand(const QJsonArray &sendCommand)
+bool Miniscope::loadDeviceDefinitions(const QString &fname)
 {
-    // creates a mapping to handle future I2C/SPI slider value send commands
-    std::vector<QHash<QString, int>> output;
-    QHash<QString, int> commandStructure;
-    QJsonObject jObj;
-    QStringList keys;
-
-    for (int i = 0; i < sendCommand.size(); i++) {
-        jObj = sendCommand[i].toObject();
-        keys = jObj.keys();
-
-        for (int j = 0; j < keys.size(); j++) {
-            // -1 = controlValue, -2 = error
-            if (jObj[keys[j]].isString())
-                commandStructure[keys[j]] = msconfStringToInt(jObj[keys[j]].toString());
-            else if (jObj[keys[j]].isDouble())
-                commandStructure[keys[j]] = jObj[keys[j]].toInt();
-        }
-        output.push_back(commandStructure);
+    QString error;
+    if (!DeviceRegistry::instance()->loadFile(fname, &error)) {
+        d->setLastError(error);
+        return false;
     }
-
-    return output;
-}
-
-QStringList Miniscope::availableDeviceTypes() const
-{
-    auto deviceTypes = msconfGetDevicesJson().keys();
-    std::sort(deviceTypes.begin(), deviceTypes.end());
-    return deviceTypes;
+    return true;
 }
 
 bool Miniscope::loadDeviceConfig(const QString &deviceType)
@@ -318,120 +378,18 @@ bool Miniscope::loadDeviceConfig(const QString &deviceType)
     if (d->connected)
         disconnect();
 
-    // load new device data
-    const auto allDevConfigs = msconfGetDevicesJson();
-    if (!allDevConfigs.contains(deviceType)) {
-        d->lastError = QStringLiteral("Unable to find device configuration with name '%1'").arg(deviceType);
+    // fetch the (already parsed) device data
+    const auto device = DeviceRegistry::instance()->device(deviceType);
+    if (!device) {
+        d->setLastError(QStringLiteral("Unable to find device configuration with name '%1'").arg(deviceType));
         return false;
     }
-    d->deviceConfig = allDevConfigs[deviceType].toObject();
+    d->device = device;
     d->deviceType = deviceType;
 
-    // load basic settings
-    d->resolution = cv::Size(d->deviceConfig["width"].toInt(-1), d->deviceConfig["height"].toInt(-1));
-    d->supportsColor = d->deviceConfig["isColor"].toBool(false);
-    d->sensorType = d->deviceConfig["sensor"].toString("unknown");
-    d->pixelClock = d->deviceConfig["pixelClock"].toDouble(-1);
-
-    // load information about available controls
-    d->controls.clear();
-    d->controlRules.clear();
-    const auto controlSettings = d->deviceConfig["controlSettings"].toObject();
-    if (controlSettings.isEmpty()) {
-        qCWarning(logMScope) << "controlSettings missing from miniscopes.json for deviceType = " << d->deviceType;
-        return true;
-    }
-
-    for (const QString& controlKey : controlSettings.keys()) {
-        const auto values = controlSettings.value(controlKey).toObject();
-        const auto keys = values.keys();
-        ControlCommandRule commandRule;
-        ControlDefinition control;
-        control.id = controlKey;
-        control.name = g_controlIdToName->value(control.id, control.id);
-
-        QJsonValue startValue;
-        for (const auto &key : values.keys()) {
-            const auto value = values[key];
-            if (key == "sendCommand") {
-                commandRule.commands = msconfParseSendCommand(value.toArray());
-            } else if (key == "min") {
-                control.valueMin = value.toInt();
-            } else if (key == "max") {
-                control.valueMax = value.toInt();
-            } else if (key == "stepSize") {
-                control.stepSize = value.toInt();
-            } else if (key == "startValue") {
-                startValue = value;
-            } else if (key == "displayValueScale") {
-                commandRule.valueScale = value.toDouble(1);
-            } else if (key == "displayValueOffset") {
-                commandRule.valueOffset = value.toDouble(0);
-            } else if (key == "displayValueBitShift") {
-                commandRule.valueBitshift = value.toInt(0);
-            } else if (key == "displaySpinBoxValues") {
-                QStringList labels;
-                for (const auto &text : value.toArray())
-                    labels.append(text.toString());
-                control.labels = labels;
-            } else if (key == "outputValues") {
-                std::vector<double> outVals;
-                for (const auto &v : value.toArray())
-                    outVals.push_back(v.toDouble());
-                commandRule.valueMap = outVals;
-            } else if (key == "displayTextValues") {
-                std::vector<double> numLabels;
-                for (const auto &n : value.toArray())
-                    numLabels.push_back(n.toDouble());
-                commandRule.numLabelMap = numLabels;
-            }
-        }
-
-        // if we have a list of labels, we are a selector, otherwise
-        // we assume a sliding-value controller
-        if (control.labels.isEmpty()) {
-            control.kind = ControlKind::Slider;
-        } else {
-            control.kind = ControlKind::Selector;
-            control.valueMin = 0;
-            control.valueMax = control.labels.length() - 1;
-            commandRule.valueScale = 1;
-        }
-
-        // set the start value
-        if (!startValue.isNull()) {
-            if (startValue.isString()) {
-                control.valueStart = control.labels.indexOf(startValue.toString());
-            } else {
-                control.valueStart = startValue.toInt();
-            }
-        }
-
-        // the framerate is a special case, as we control that in software
-        // we set the default here
-        if (controlKey == "frameRate") {
-            if (commandRule.numLabelMap.empty()) {
-                d->fps = control.valueStart;
-            } else {
-                d->fps = commandRule.numLabelMap[control.valueStart];
-            }
-
-            if (d->fps <= 1)
-                d->fps = 20;
-        }
-
-        d->controlRules[control.id] = commandRule;
-        d->controls.push_back(control);
-    }
-
-    // create a preferred order for our controls
-    std::sort(d->controls.begin(), d->controls.end(),[](const ControlDefinition& lhs, const ControlDefinition& rhs) {
-        if (lhs.kind > rhs.kind)
-            return true;
-        if (lhs.kind < rhs.kind)
-            return false;
-        return lhs.name.compare(rhs.name, Qt::CaseInsensitive) > 0;
-    });
+    // the framerate is a special case, as we control that in software
+    if (device->defaultFps > 0)
+        d->fps = device->defaultFps;
 
     return true;
 }
@@ -473,7 +431,7 @@ void Miniscope::fail(const QString &msg)
     d->recording = false;
     d->running = false;
     d->failed = true;
-    d->lastError = msg;
+    d->setLastError(msg);
 
     qCWarning(logMScope).noquote() << msg;
 }
@@ -488,49 +446,148 @@ int Miniscope::scopeCamId() const
     return d->scopeCamId;
 }
 
-void Miniscope::enqueueI2CCommand(long preambleKey, std::vector<quint8> packet)
+FrameSourceKind Miniscope::frameSourceKind() const
+{
+    return d->sourceKind;
+}
+
+void Miniscope::setFrameSourceKind(FrameSourceKind kind)
+{
+    // the new source is used the next time we connect
+    d->sourceKind = kind;
+}
+
+SyntheticSourceSettings Miniscope::syntheticSourceSettings() const
 {
-    std::lock_guard<std::mutex> lock(d->cmdMutex);
+    return d->syntheticSettings;
+}
 
-    // add packet to the queue to send to the camera for control modification
-    d->commandQueue.enqueue(qMakePair(preambleKey, packet));
+void Miniscope::setSyntheticSourceSettings(const SyntheticSourceSettings &settings)
+{
+    d->syntheticSettings = settings;
 }
 
-static bool scopeDAQSendBytes(cv::VideoCapture *cam, double head, double middle, double tail)
+QString Miniscope::replayFilename() const
 {
-    // Linux apparently is faster at USB communication than Windows, and since our DAQ
-    // board is slow at clearing data from its control endpoint, not waiting a bit before
-    // sending the next command will result in the old command being overridden (which breaks
-    // our packet layout)
-    // Waiting >100µs seems to generally work. We call the wait function on all platforms,
-    // just in case some computers on Windows also manage to communicate with similar speeds then
-    // Windows, but keep in mind that Windows may not be able to wait with microsecond accuracy and
-    // may wait 1ms instead of our set value.
-    const auto controlReqCooldownTime = std::chrono::microseconds(128);
+    return d->replayFname;
+}
 
-    bool ret = cam->set(cv::CAP_PROP_CONTRAST, head);
-    std::this_thread::sleep_for(controlReqCooldownTime);
-    ret = cam->set(cv::CAP_PROP_GAMMA, middle) && ret;
-    std::this_thread::sleep_for(controlReqCooldownTime);
-    ret = cam->set(cv::CAP_PROP_SHARPNESS, tail) && ret;
-    std::this_thread::sleep_for(controlReqCooldownTime);
+void Miniscope::setReplayFilename(const QString &fname)
+{
+    d->replayFname = fname;
+}
 
-    return ret;
+double Miniscope::replaySpeed() const
+{
+    return d->replaySpeed;
+}
+
+void Miniscope::setReplaySpeed(double factor)
+{
+    if (factor < 0)
+        factor = 0;
+    d->replaySpeed = factor;
+}
+
+bool Miniscope::replayLoop() const
+{
+    return d->replayLoop;
+}
+
+void Miniscope::setReplayLoop(bool loop)
+{
+    d->replayLoop = loop;
+}
+
+uint Miniscope::captureBufferCount() const
+{
+    return d->captureBufferCount;
+}
+
+void Miniscope::setCaptureBufferCount(uint count)
+{
+    // only used by sources that manage their own buffers, takes effect on the next connect
+    d->captureBufferCount = count < 2? 2 : count;
+}
+
+void Miniscope::setThreadScheduling(ThreadRole role, const ThreadScheduling &sched)
+{
+    if (role == ThreadRole::Last)
+        return;
+    const std::lock_guard<std::mutex> lock(d->schedMutex);
+    d->threadScheduling[static_cast<size_t>(role)] = sched;
+}
+
+ThreadScheduling Miniscope::threadScheduling(ThreadRole role) const
+{
+    if (role == ThreadRole::Last)
+        return ThreadScheduling();
+    const std::lock_guard<std::mutex> lock(d->schedMutex);
+    return d->threadScheduling[static_cast<size_t>(role)];
+}
+
+void Miniscope::applySchedulingForRole(ThreadRole role)
+{
+    const auto sched = threadScheduling(role);
+    if (sched.isDefault())
+        return;
+
+    // we keep running with default settings if we can't get what we want,
+    // as losing some realtime guarantees is better than not acquiring at all
+    QString error;
+    if (!applyThreadScheduling(sched, &error))
+        qCWarning(logMScope).noquote().nospace() << "Unable to apply scheduling settings for " << QString::fromStdString(threadRoleToString(role))
+                                                 << " thread: " << error;
+}
+
+void Miniscope::enqueueI2CCommand(long preambleKey, std::vector<quint8> packet, bool coalesce)
+{
+    {
+        std::lock_guard<std::mutex> lock(d->cmdMutex);
+
+        // Only the latest value written to a register matters, so if a packet for the same
+        // register is still waiting to be sent, we just replace its data. This way, quickly
+        // changing a control (e.g. by dragging a slider) doesn't flood the DAQ board.
+        bool replaced = false;
+        if (coalesce) {
+            for (auto &pending : d->commandQueue) {
+                if (pending.first == preambleKey) {
+                    pending.second = std::move(packet);
+                    replaced = true;
+                    break;
+                }
+            }
+        }
+
+        // add packet to the queue to send to the camera for control modification
+        if (!replaced)
+            d->commandQueue.enqueue(qMakePair(preambleKey, std::move(packet)));
+    }
+    d->cmdCond.notify_one();
 }
 
 void Miniscope::sendCommandsToDevice()
 {
-    std::lock_guard<std::mutex> lock(d->cmdMutex);
+    uint sentCount = 0;
+
+    while (true) {
+        std::vector<quint8> packet;
+        {
+            // we only hold the lock to take the next packet, so new commands can be
+            // queued while we are sending or waiting for the DAQ board
+            std::lock_guard<std::mutex> lock(d->cmdMutex);
+            if (d->commandQueue.isEmpty())
+                break;
+            packet = d->commandQueue.dequeue().second;
+        }
 
-    while (!d->commandQueue.isEmpty()) {
         // Slow down command submission to give the DAQ board time to process
         // some of them. Connection instability increases if we are sending a
         // large set of packets in a short time.
-        if ((d->commandQueue.size() % 4) == 0)
+        if (sentCount > 0 && (sentCount % 4) == 0)
             std::this_thread::sleep_for(milliseconds_t(10));
+        sentCount++;
 
-        const auto pair = d->commandQueue.dequeue();
-        const auto packet = pair.second;
         bool success = false;
         quint64 tempPacket;
 
@@ -543,10 +600,9 @@ void Miniscope::sendCommandsToDevice()
 
             if (d->printExtraDebug)
                 qCDebug(logMScope).noquote().nospace() << "Send 1-5: 0x" << QString::number(tempPacket,16);
-            success = scopeDAQSendBytes(&d->cam,
-                                        tempPacket & 0x00000000FFFF,
-                                        (tempPacket & 0x0000FFFF0000) >> 16,
-                                        (tempPacket & 0xFFFF00000000) >> 32);
+            success = d->source->sendControlBytes(tempPacket & 0x00000000FFFF,
+                                                  (tempPacket & 0x0000FFFF0000) >> 16,
+                                                  (tempPacket & 0xFFFF00000000) >> 32);
             if (!success)
                 qCWarning(logMScope) << "Unable to send short control packet";
         } else if (packet.size() == 6) {
@@ -557,10 +613,9 @@ void Miniscope::sendCommandsToDevice()
 
             if (d->printExtraDebug)
                 qCDebug(logMScope).noquote().nospace() << "Send 6: 0x" << QString::number(tempPacket,16);
-            success = scopeDAQSendBytes(&d->cam,
-                                        tempPacket & 0x00000000FFFF,
-                                        (tempPacket & 0x0000FFFF0000) >> 16,
-                                        (tempPacket & 0xFFFF00000000) >> 32);
+            success = d->source->sendControlBytes(tempPacket & 0x00000000FFFF,
+                                                  (tempPacket & 0x0000FFFF0000) >> 16,
+                                                  (tempPacket & 0xFFFF00000000) >> 32);
             if (!success)
                 qCDebug(logMScope).noquote() << "Unable to send long control packet";
         }
@@ -578,53 +633,55 @@ bool Miniscope::openCamera()
         disconnect();
     }
 
-    // Use V4L on Linux, as apparently the GStreamer backend, if automatically chosen, has issues
-    // with some properties of the Miniscope camera and will refuse to grab any proper frame.
-    // On Windows on the other hand, the MSMF backend seems to be the best and most complete option.
-    // If any of them fail, just try the API autodetection in OpenCV.
-    auto apiPreference = cv::CAP_ANY;
-    bool ret;
+    switch (d->sourceKind) {
+    case FrameSourceKind::Synthetic:
+        d->source.reset(new SyntheticFrameSource(d->syntheticSettings));
+        break;
+    case FrameSourceKind::Replay:
+        d->source.reset(new ReplayFrameSource(d->replayFname, d->replaySpeed, d->replayLoop));
+        break;
+    case FrameSourceKind::DeviceV4L2:
 #ifdef Q_OS_LINUX
-    apiPreference = cv::CAP_V4L2;
-#elif defined(Q_OS_WIN)
-    apiPreference = cv::CAP_MSMF;
+        d->source.reset(new V4L2FrameSource(d->captureBufferCount));
+#else
+        qCWarning(logMScope).noquote() << "Direct V4L2 capture is only available on Linux, using the default backend.";
+        d->source.reset(new CvFrameSource);
 #endif
-    ret = d->cam.open(d->scopeCamId, apiPreference);
-    if (!ret) {
-        // we failed opening the camera - try again using OpenCV's backend autodetection
-        qCWarning(logMScope).noquote() << "Unable to use preferred camera backend, falling back to autodetection.";
-        ret = d->cam.open(d->scopeCamId);
+        break;
+    default:
+        d->source.reset(new CvFrameSource);
+        break;
     }
 
-    if (!ret)
+    bool ret = d->source->open(d->scopeCamId, d->device->resolution);
+    if (!ret) {
+        d->setLastError(d->source->lastError());
         return ret;
-    qCInfo(logMScope).noquote() << "Using backend API:" << QString::fromStdString(d->cam.getBackendName());
-
-    // set height/width for new DAQ firmware versions which can support
-    // multiple Miniscope device types
-    if (d->resolution.width > 0)
-        d->cam.set(cv::CAP_PROP_FRAME_WIDTH, d->resolution.width);
-    if (d->resolution.height > 0)
-        d->cam.set(cv::CAP_PROP_FRAME_HEIGHT, d->resolution.height);
+    }
+    qCInfo(logMScope).noquote() << "Using frame source:" << d->source->name();
 
     // recording disabled, we are just running
-    d->cam.set(cv::CAP_PROP_SATURATION, 0x0000);
+    d->source->setRecordingState(false);
 
     // ensure the command queue isn't full with old packets that flood the
     // DAQ board immediately after it is connected
-    d->commandQueue.clear();
+    {
+        std::lock_guard<std::mutex> lock(d->cmdMutex);
+        d->commandQueue.clear();
+    }
 
     // reset all packet parts to zero
-    scopeDAQSendBytes(&d->cam, 0x00, 0x00 ,0x00);
+    d->source->sendControlBytes(0x00, 0x00 ,0x00);
 
     // We need to make sure the MODE of the SERDES is correct
     // This needs to be done before any other commands are sent over SERDES
     // Currently this is for the 913/914 TI SERES
-    qCDebug(logMScope).noquote() << "Pixel Clock is" << d->pixelClock;
-    if (d->pixelClock > 0) {
+    const auto pixelClock = d->device->pixelClock;
+    qCDebug(logMScope).noquote() << "Pixel Clock is" << pixelClock;
+    if (pixelClock > 0) {
         std::vector<quint8> packet;
 
-        if (d->pixelClock <= 50) {
+        if (pixelClock <= 50) {
             // Set to 12bit low frequency in this case
 
             // DES
@@ -683,36 +740,13 @@ bool Miniscope::openCamera()
         }
     }
 
-    // prepare all commands to initialize the Miniscope hardware
-    const auto initCommands = msconfParseSendCommand(d->deviceConfig["initialize"].toArray());
-    for (const auto &command : initCommands) {
-        std::vector<quint8> packet;
-
-        if (command["protocol"] == PROTOCOL_I2C) {
-            int preambleKey = 0;
-
-            packet.push_back(command["addressW"]);
-            preambleKey = (preambleKey << 8) | packet.back();
-
-            for (int i = 0; i < command["regLength"]; i++) {
-                packet.push_back(command["reg" + QString::number(i)]);
-                preambleKey = (preambleKey << 8) | packet.back();
-            }
-            for (int i = 0; i < command["dataLength"]; i++) {
-                int tempValue = command["data" + QString::number(i)];
-                packet.push_back(tempValue);
-                preambleKey = (preambleKey<<8) | packet.back();
-            }
-
-            enqueueI2CCommand(preambleKey, packet);
-        } else {
-            qCDebug(logMScope) << command["protocol"] << " initialization protocol not yet supported";
-        }
-    }
+    // queue all commands to initialize the Miniscope hardware
+    for (const auto &command : d->device->initCommands)
+        enqueueI2CCommand(command.preambleKey, command.packet);
 
     // reset all controls to default values, or last values
     // if we have cached any
-    for (const auto &ctl : d->controls) {
+    for (const auto &ctl : d->device->controls) {
         if (d->controlValueCache.contains(ctl.id))
             setControlValue(ctl.id, d->controlValueCache[ctl.id]);
         else
@@ -741,7 +775,7 @@ bool Miniscope::connect()
         }
     }
 
-    if (d->deviceConfig.isEmpty() || d->deviceType.isEmpty()) {
+    if (!d->device) {
         fail("Unable to connect to Miniscope: No device type to connect to was selected.");
         return false;
     }
@@ -750,7 +784,10 @@ bool Miniscope::connect()
     d->controlValueCache.clear();
 
     if (!openCamera()) {
-        fail("Unable to connect to Miniscope camera. Is the DAQ board connected?");
+        if (d->sourceKind == FrameSourceKind::Device)
+            fail("Unable to connect to Miniscope camera. Is the DAQ board connected?");
+        else
+            fail(QStringLiteral("Unable to open frame source: %1").arg(lastError()));
         return false;
     }
 
@@ -764,7 +801,8 @@ bool Miniscope::connect()
 void Miniscope::disconnect()
 {
     stop();
-    d->cam.release();
+    if (d->source)
+        d->source->release();
     if (d->connected)
         statusMessage(QStringLiteral("Disconnected camera %1").arg(d->scopeCamId));
     d->connected = false;
@@ -772,17 +810,19 @@ void Miniscope::disconnect()
 
 std::vector<ControlDefinition> Miniscope::controls() const
 {
-    return d->controls;
+    if (!d->device)
+        return std::vector<ControlDefinition>();
+    return d->device->controls;
 }
 
 double Miniscope::controlValue(const QString &id)
 {
-    if (!d->controlRules.contains(id)) {
+    if (!d->device || !d->device->controlRules.contains(id)) {
         qCWarning(logMScope).noquote() << QStringLiteral("Unable to get value for nonexisting control %1").arg(id);
         return -1;
     }
 
-    for (const auto &ctl : d->controls) {
+    for (const auto &ctl : d->device->controls) {
         if (ctl.id == id)
             return ctl.valueStart;
     }
@@ -791,7 +831,7 @@ double Miniscope::controlValue(const QString &id)
 
 void Miniscope::setControlValue(const QString &id, double value)
 {
-    if (!d->controlRules.contains(id)) {
+    if (!d->device || !d->device->controlRules.contains(id)) {
         qCWarning(logMScope).noquote() << QStringLiteral("Unable to set nonexisting control %1 to %2").arg(id).arg(value);
         return;
     }
@@ -800,7 +840,7 @@ void Miniscope::setControlValue(const QString &id, double value)
     d->controlValueCache[id] = value;
 
     // convert API value to device-specific command
-    const auto rule = d->controlRules[id];
+    const auto &rule = d->device->controlRules.constFind(id).value();
     double devValue = value;
     if (!rule.valueMap.empty()) {
         // sanity check, the fetch the real value
@@ -808,58 +848,15 @@ void Miniscope::setControlValue(const QString &id, double value)
             devValue = rule.valueMap[value];
     }
 
-    double i2cValue = qRound(devValue * rule.valueScale - rule.valueOffset) << rule.valueBitshift;
-    double i2cValue2 = 0;
-
-    // TODO: Handle int values greater than 8 bits
-    for (size_t i = 0; i < rule.commands.size(); i++) {
-        const auto command = rule.commands[i];
-        std::vector<quint8> packet;
-        long preambleKey; // Holds a value that represents the address and reg
-
-        if (command["protocol"] == PROTOCOL_I2C) {
-            preambleKey = 0;
-
-            packet.push_back(command["addressW"]);
-            preambleKey = (preambleKey << 8) | packet.back();
-
-            for (int j = 0; j < command["regLength"]; j++) {
-                packet.push_back(command["reg" + QString::number(j)]);
-                preambleKey = (preambleKey << 8) | packet.back();
-            }
+    const auto i2cValue = static_cast<quint32>(qRound(devValue * rule.valueScale - rule.valueOffset) << rule.valueBitshift);
+    const quint32 i2cValue2 = 0;
 
-            for (int j = 0; j < command["dataLength"]; j++) {
-                const auto tempValue = command["data" + QString::number(j)];
+    for (const auto &command : rule.commands) {
+        auto packet = command.packet;
+        for (const auto &slot : command.valueSlots)
+            packet[slot.offset] = static_cast<quint8>(((slot.secondValue? i2cValue2 : i2cValue) >> slot.shift) & 0xFF);
 
-                // TODO: Handle value1 through value3
-                if (tempValue == SEND_COMMAND_VALUE_H24) {
-                    packet.push_back((static_cast<quint32>(i2cValue) >> 24) & 0xFF);
-                }
-                else if (tempValue == SEND_COMMAND_VALUE_H16) {
-                    packet.push_back((static_cast<quint32>(i2cValue) >> 16) & 0xFF);
-                }
-                else if (tempValue == SEND_COMMAND_VALUE_H) {
-                    packet.push_back((static_cast<quint32>(i2cValue) >> 8) & 0xFF);
-                }
-                else if (tempValue == SEND_COMMAND_VALUE_L) {
-                    packet.push_back(static_cast<quint32>(i2cValue) & 0xFF);
-                }
-                else if (tempValue == SEND_COMMAND_VALUE2_H) {
-                    packet.push_back((static_cast<quint32>(i2cValue2) >> 8) & 0xFF);
-                }
-                else if (tempValue == SEND_COMMAND_VALUE2_L) {
-                    packet.push_back(static_cast<quint32>(i2cValue2) & 0xFF);
-                }
-                else {
-                    packet.push_back(tempValue);
-                    preambleKey = (preambleKey << 8) | packet.back();
-                }
-            }
-
-            enqueueI2CCommand(preambleKey, packet);
-        } else {
-            qCDebug(logMScope) << command["protocol"] << " protocol for " << id << " not yet supported";
-        }
+        enqueueI2CCommand(command.preambleKey, std::move(packet), true);
     }
 
     // get a human-readable value
@@ -999,12 +996,58 @@ void Miniscope::setOnDisplayFrame(DisplayFrameCallback callback, void *udata)
 
 cv::Mat Miniscope::currentDisplayFrame()
 {
-    std::lock_guard<std::mutex> lock(d->frameMutex);
-    cv::Mat frame;
-    const auto queueSize = d->displayQueue.size();
-    if (queueSize == 0)
-        return frame;
-    return d->displayQueue.dequeue();
+    const std::lock_guard<std::mutex> lock(d->displayReadMutex);
+    d->lastDisplayRequestNsec = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    const auto &latest = d->displayBuffer.read();
+    if (latest.sequence == d->lastReadDisplaySequence)
+        return cv::Mat();
+    d->lastReadDisplaySequence = latest.sequence;
+    return latest.frame;
+}
+
+DisplayFrame Miniscope::latestDisplayFrame()
+{
+    const std::lock_guard<std::mutex> lock(d->displayReadMutex);
+    d->lastDisplayRequestNsec = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    return d->displayBuffer.read();
+}
+
+bool Miniscope::headless() const
+{
+    return d->headless;
+}
+
+void Miniscope::setHeadless(bool headless)
+{
+    d->headless = headless;
+}
+
+double Miniscope::displayRateLimit() const
+{
+    return d->displayRateLimit;
+}
+
+void Miniscope::setDisplayRateLimit(double hz)
+{
+    d->displayRateLimit = (hz > 0)? hz : 0;
+}
+
+void Miniscope::setDisplayHistoryLength(uint length)
+{
+    d->displayHistoryLength = length;
+}
+
+uint Miniscope::displayHistoryLength() const
+{
+    return d->displayHistoryLength;
+}
+
+bool Miniscope::takeDisplayHistoryFrame(DisplayFrame &frame)
+{
+    const std::lock_guard<std::mutex> lock(d->displayReadMutex);
+    if (!d->displayHistory)
+        return false;
+    return d->displayHistory->pop(frame);
 }
 
 uint Miniscope::currentFps() const
@@ -1014,7 +1057,27 @@ uint Miniscope::currentFps() const
 
 size_t Miniscope::droppedFramesCount() const
 {
-    return d->droppedFramesCount;
+    return d->droppedFramesCount + d->deviceDroppedFramesCount;
+}
+
+QString Miniscope::traceFilename() const
+{
+    return d->traceFname;
+}
+
+void Miniscope::setTraceFilename(const QString &fname)
+{
+    d->traceFname = fname;
+}
+
+std::vector<StageStatistics> Miniscope::pipelineStatistics() const
+{
+    return d->stats.snapshot();
+}
+
+void Miniscope::resetPipelineStatistics()
+{
+    d->stats.reset();
 }
 
 double Miniscope::fps() const
@@ -1033,6 +1096,12 @@ void Miniscope::setCaptureStartTime(const std::chrono::time_point<std::chrono::s
     d->captureStartTimeInitialized = false; // reinitialize frame time with new start time, in case we are already running
 }
 
+void Miniscope::setRecordingStartTime(const std::chrono::time_point<std::chrono::steady_clock> &startTime)
+{
+    const std::lock_guard<std::mutex> lock(d->timeMutex);
+    d->recordingStartTimepoint = startTime;
+}
+
 bool Miniscope::useUnixTimestamps() const
 {
     return d->useUnixTime;
@@ -1105,6 +1174,56 @@ void Miniscope::setRecordLossless(bool lossless)
     d->recordLossless = lossless;
 }
 
+int Miniscope::videoEncoderThreads() const
+{
+    return d->videoEncoderThreads;
+}
+
+void Miniscope::setVideoEncoderThreads(int count)
+{
+    d->videoEncoderThreads = count;
+}
+
+int Miniscope::concurrentRecordings() const
+{
+    return d->concurrentRecordings;
+}
+
+void Miniscope::setConcurrentRecordings(int count)
+{
+    d->concurrentRecordings = count;
+}
+
+EncoderThreading Miniscope::videoEncoderThreading() const
+{
+    return d->videoEncoderThreading;
+}
+
+void Miniscope::setVideoEncoderThreading(EncoderThreading threading)
+{
+    d->videoEncoderThreading = threading;
+}
+
+int Miniscope::videoFfv1Slices() const
+{
+    return d->videoFfv1Slices;
+}
+
+void Miniscope::setVideoFfv1Slices(int slices)
+{
+    d->videoFfv1Slices = slices;
+}
+
+bool Miniscope::videoFfv1SliceCrc() const
+{
+    return d->videoFfv1SliceCrc;
+}
+
+void Miniscope::setVideoFfv1SliceCrc(bool enabled)
+{
+    d->videoFfv1SliceCrc = enabled;
+}
+
 int Miniscope::minFluorDisplay() const
 {
     return d->minFluorDisplay;
@@ -1135,6 +1254,42 @@ int Miniscope::maxFluor() const
     return d->maxFluor;
 }
 
+bool Miniscope::autoContrast() const
+{
+    return d->autoContrast;
+}
+
+void Miniscope::setAutoContrast(bool enabled)
+{
+    d->autoContrast = enabled;
+}
+
+double Miniscope::autoContrastLowPercentile() const
+{
+    return d->autoContrastLow;
+}
+
+double Miniscope::autoContrastHighPercentile() const
+{
+    return d->autoContrastHigh;
+}
+
+void Miniscope::setAutoContrastPercentiles(double low, double high)
+{
+    low = std::min(std::max(low, 0.0), 100.0);
+    high = std::min(std::max(high, 0.0), 100.0);
+    if (low > high)
+        std::swap(low, high);
+    d->autoContrastLow = low;
+    d->autoContrastHigh = high;
+}
+
+std::vector<int> Miniscope::displayHistogram() const
+{
+    const std::lock_guard<std::mutex> lock(d->histogramMutex);
+    return d->displayHistogram;
+}
+
 MScope::DisplayMode Miniscope::displayMode() const
 {
     return d->displayMode;
@@ -1157,6 +1312,156 @@ void Miniscope::setBgAccumulateAlpha(double value)
     d->bgAccumulateAlpha = value;
 }
 
+BackgroundModelPrecision Miniscope::backgroundModelPrecision() const
+{
+    return d->bgModelPrecision;
+}
+
+void Miniscope::setBackgroundModelPrecision(BackgroundModelPrecision precision)
+{
+    d->bgModelPrecision = precision;
+}
+
+bool Miniscope::motionCorrection() const
+{
+    return d->motionCorrection;
+}
+
+void Miniscope::setMotionCorrection(bool enabled)
+{
+    d->motionCorrection = enabled;
+    if (!enabled) {
+        const std::lock_guard<std::mutex> lock(d->motionMutex);
+        d->motionShift = cv::Point2d();
+    }
+}
+
+bool Miniscope::motionCorrectDisplay() const
+{
+    return d->motionCorrectDisplay;
+}
+
+void Miniscope::setMotionCorrectDisplay(bool enabled)
+{
+    d->motionCorrectDisplay = enabled;
+}
+
+bool Miniscope::motionCorrectRecording() const
+{
+    return d->motionCorrectRecording;
+}
+
+void Miniscope::setMotionCorrectRecording(bool enabled)
+{
+    d->motionCorrectRecording = enabled;
+}
+
+int Miniscope::motionCorrectionDownsample() const
+{
+    return d->motionDownsample;
+}
+
+void Miniscope::setMotionCorrectionDownsample(int factor)
+{
+    d->motionDownsample = (factor < 1)? 1 : factor;
+}
+
+cv::Rect Miniscope::motionCorrectionRegion() const
+{
+    const std::lock_guard<std::mutex> lock(d->motionMutex);
+    return d->motionRegion;
+}
+
+void Miniscope::setMotionCorrectionRegion(const cv::Rect &region)
+{
+    const std::lock_guard<std::mutex> lock(d->motionMutex);
+    d->motionRegion = region;
+}
+
+cv::Point2d Miniscope::motionShift() const
+{
+    const std::lock_guard<std::mutex> lock(d->motionMutex);
+    return d->motionShift;
+}
+
+int Miniscope::addRoi(const cv::Mat &mask)
+{
+    RoiDefinition roi;
+    roi.mask = mask.clone();
+
+    const std::lock_guard<std::mutex> lock(d->roiMutex);
+    d->rois.push_back(roi);
+    d->roiGeneration++;
+    return static_cast<int>(d->rois.size()) - 1;
+}
+
+int Miniscope::addRoiPolygon(const std::vector<cv::Point> &polygon)
+{
+    RoiDefinition roi;
+    roi.polygon = polygon;
+
+    const std::lock_guard<std::mutex> lock(d->roiMutex);
+    d->rois.push_back(roi);
+    d->roiGeneration++;
+    return static_cast<int>(d->rois.size()) - 1;
+}
+
+void Miniscope::clearRois()
+{
+    const std::lock_guard<std::mutex> lock(d->roiMutex);
+    d->rois.clear();
+    d->roiGeneration++;
+}
+
+int Miniscope::roiCount() const
+{
+    const std::lock_guard<std::mutex> lock(d->roiMutex);
+    return static_cast<int>(d->rois.size());
+}
+
+bool Miniscope::roiNeuropilSubtraction() const
+{
+    return d->roiNeuropil;
+}
+
+void Miniscope::setRoiNeuropilSubtraction(bool enabled)
+{
+    d->roiNeuropil = enabled;
+}
+
+double Miniscope::roiNeuropilFactor() const
+{
+    return d->roiNeuropilFactor;
+}
+
+void Miniscope::setRoiNeuropilFactor(double factor)
+{
+    d->roiNeuropilFactor = factor;
+}
+
+void Miniscope::setOnRoiTrace(RoiTraceCallback callback, void *udata)
+{
+    d->roiTraceCallback = std::make_pair(callback, udata);
+}
+
+void Miniscope::setRoiTraceHistoryLength(uint length)
+{
+    d->roiTraceHistoryLength = length;
+}
+
+uint Miniscope::roiTraceHistoryLength() const
+{
+    return d->roiTraceHistoryLength;
+}
+
+bool Miniscope::takeRoiTrace(RoiTrace &trace)
+{
+    const std::lock_guard<std::mutex> lock(d->roiReadMutex);
+    if (!d->roiTraceHistory)
+        return false;
+    return d->roiTraceHistory->popCopy(trace);
+}
+
 uint Miniscope::recordingSliceInterval() const
 {
     return d->recordingSliceInterval;
@@ -1167,6 +1472,37 @@ void Miniscope::setRecordingSliceInterval(uint minutes)
     d->recordingSliceInterval = minutes;
 }
 
+void Miniscope::setEncoderQueueWatermarks(uint high, uint low)
+{
+    d->encoderQueueHighWatermark = (high < 1)? 1 : high;
+    d->encoderQueueLowWatermark = (low < high)? low : d->encoderQueueHighWatermark - 1;
+}
+
+uint Miniscope::encoderQueueHighWatermark() const
+{
+    return d->encoderQueueHighWatermark;
+}
+
+uint Miniscope::encoderQueueLowWatermark() const
+{
+    return d->encoderQueueLowWatermark;
+}
+
+size_t Miniscope::encoderQueueDepth() const
+{
+    return d->encoderQueueDepth;
+}
+
+size_t Miniscope::encoderQueuePeakDepth() const
+{
+    return d->encoderQueuePeakDepth;
+}
+
+size_t Miniscope::encoderBackpressureCount() const
+{
+    return d->encoderBackpressureCount;
+}
+
 void Miniscope::setPrintExtraDebug(bool enabled)
 {
     d->printExtraDebug = enabled;
@@ -1174,6 +1510,7 @@ void Miniscope::setPrintExtraDebug(bool enabled)
 
 QString Miniscope::lastError() const
 {
+    const std::lock_guard<std::mutex> lock(d->errorMutex);
     return d->lastError;
 }
 
@@ -1189,29 +1526,29 @@ void Miniscope::addDisplayFrameToBuffer(const cv::Mat &frame, const milliseconds
     if (displayFrameCB != nullptr)
         displayFrameCB(frame, timestamp, d->displayFrameCallback.second);
 
-    // the display frame queue is protected
-    std::lock_guard<std::mutex> lock(d->frameMutex);
-
-    // drop frames if we are displaying too slowly, otherwise add new stuff to queue
-    if (d->displayQueue.size() < 28)
-        d->displayQueue.enqueue(frame);
+    // only the display thread ever calls this, so it is the only writer
+    DisplayFrame dframe;
+    dframe.frame = frame;
+    dframe.sequence = ++d->displaySequence;
+    dframe.timestamp = timestamp;
+    if (d->displayHistory)
+        d->displayHistory->push(dframe);
+    d->displayBuffer.write(dframe);
 }
 
 inline milliseconds_t Miniscope::getCurrentFrameTimestamp()
 {
     if (d->emulateTimestamps)
         return milliseconds_t(QDateTime().currentMSecsSinceEpoch());
-    return milliseconds_t(static_cast<long>(d->cam.get(cv::CAP_PROP_POS_MSEC)));
+    return d->source->frameTimestamp();
 }
 
-void Miniscope::captureThread(void* msPtr)
+void Miniscope::displayThread(void *msPtr)
 {
     const auto self = static_cast<Miniscope*> (msPtr);
     const auto d = self->d.get();
-
-    // unpack raw frame callback pair
-    const auto frameCB = d->frameCallback.first;
-    auto frameCB_udata = d->frameCallback.second;
+    self->applySchedulingForRole(ThreadRole::Display);
+    const auto trace = d->trace.registerThread(QStringLiteral("display"));
 
     // make a dummy "dropped frame" matrix to display when we drop frames
     cv::Mat droppedFrameImage(cv::Size(752, 480), CV_8UC3);
@@ -1223,21 +1560,381 @@ void Miniscope::captureThread(void* msPtr)
                 1.5,
                 cv::Scalar(255,255,255));
 
+    // Buffers for all intermediate images, reused for every frame. The frames we pass on
+    // for display come from a pool, as other threads may still hold on to them.
+    FramePool displayPool(4, 64);
+    cv::Mat accumulatedMat;
+    cv::Mat frameF32;
+    cv::Mat bgMat;
+    cv::Mat diffMat;
+
+    // single-pass display processing, for the common case of 8-bit gray frames
+    DisplayKernel kernel;
+    qCDebug(logMScope).noquote() << "Using" << kernel.isaName() << "display kernel";
+
+    // display window picked by auto-contrast, smoothed over time so the image doesn't flicker
+    double autoLow = -1;
+    double autoHigh = -1;
+
+    // number of frames since the background model was last updated
+    uint skippedBgFrames = 0;
+    auto lastDisplayTime = std::chrono::steady_clock::time_point::min();
+
+    DisplayPacket packet;
+    while (true) {
+        if (!d->displayRing.pop(packet)) {
+            if (d->acquisitionDone)
+                break;
+            std::unique_lock<std::mutex> lock(d->stageMutex);
+            d->displayCond.wait(lock, [&] { return !d->displayRing.empty() || d->acquisitionDone; });
+            continue;
+        }
+
+        // only produce display frames if anybody is going to look at them: a display frame callback,
+        // the display history, or a reader that asked for a frame recently
+        const auto now = std::chrono::steady_clock::now();
+        const auto lastRequestAge = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count() - d->lastDisplayRequestNsec;
+        const bool wanted = d->displayFrameCallback.first != nullptr
+                                || d->displayHistory
+                                || lastRequestAge < std::chrono::nanoseconds(std::chrono::seconds(1)).count();
+        if (!wanted) {
+            skippedBgFrames++;
+            continue;
+        }
+        if (packet.dropped) {
+            self->addDisplayFrameToBuffer(droppedFrameImage, packet.timestamp);
+            continue;
+        }
+
+        const auto rateLimit = d->displayRateLimit.load();
+        if (rateLimit > 0 && now - lastDisplayTime < std::chrono::duration<double>(1.0 / rateLimit)) {
+            skippedBgFrames++;
+            continue;
+        }
+        lastDisplayTime = now;
+
+        const auto &frame = packet.frame;
+        auto stageTime = PipelineStats::clock::now();
+
+        // "frame" is the frame that we record to disk, so we must never modify it
+        cv::Mat srcFrame = frame;
+        cv::Mat displayFrame;
+
+        // The per-pixel running state (background, maximum, variance) is only needed by the display modes
+        // that show it. If we skipped frames since its last update, we weight the current frame as much as all
+        // the skipped ones would have been weighted together, so the state follows the data at the same speed
+        // as if every frame was processed.
+        const auto displayMode = d->displayMode.load();
+        const bool backgroundDiff = displayMode == DisplayMode::BackgroundDiff;
+        const double alpha = d->bgAccumulateAlpha;
+        const auto effectiveAlpha = 1.0 - std::pow(1.0 - alpha, skippedBgFrames + 1);
+        skippedBgFrames = displayMode != DisplayMode::RawFrames? 0 : skippedBgFrames + 1;
+
+        if (DisplayKernel::supported(frame)) {
+            kernel.setPrecision(d->bgModelPrecision);
+            // the kernel does background model, subtraction, min/max and contrast window in one pass,
+            // so its time is accounted to the background model stage entirely
+            if (d->useColor) {
+                kernel.process(frame, diffMat, displayMode, effectiveAlpha, 0, 255);
+                srcFrame = diffMat;
+            } else {
+                displayFrame = displayPool.acquire(frame.size(), CV_8UC1);
+                kernel.process(frame, displayFrame, displayMode, effectiveAlpha,
+                               d->minFluorDisplay, d->maxFluorDisplay);
+                d->minFluor = kernel.minValue();
+                d->maxFluor = kernel.maxValue();
+            }
+
+            {
+                const auto &histogram = kernel.histogram();
+                const std::lock_guard<std::mutex> lock(d->histogramMutex);
+                std::copy(histogram.begin(), histogram.end(), d->displayHistogram.begin());
+            }
+
+            // auto-contrast drives the display window for the next frames
+            if (d->autoContrast) {
+                const double low = DisplayKernel::histogramPercentile(kernel.histogram(), d->autoContrastLow);
+                const double high = DisplayKernel::histogramPercentile(kernel.histogram(), d->autoContrastHigh);
+                if (autoLow < 0) {
+                    autoLow = low;
+                    autoHigh = high;
+                } else {
+                    autoLow += 0.1 * (low - autoLow);
+                    autoHigh += 0.1 * (high - autoHigh);
+                }
+                const auto minDisplay = static_cast<int>(std::round(autoLow));
+                d->minFluorDisplay = minDisplay;
+                d->maxFluorDisplay = std::max(static_cast<int>(std::round(autoHigh)), minDisplay + 1);
+            } else {
+                autoLow = -1;
+            }
+        } else if (backgroundDiff) {
+            // frames the kernel can't handle only get background subtraction, the other modes show them unchanged
+            frame.convertTo(frameF32, CV_32F, 1.0 / 255.0);
+            if (accumulatedMat.size() != frameF32.size() || accumulatedMat.type() != frameF32.type())
+                frameF32.copyTo(accumulatedMat);
+            else
+                cv::accumulateWeighted(frameF32, accumulatedMat, effectiveAlpha);
+
+            accumulatedMat.convertTo(bgMat, CV_8UC1, 255.0);
+            cv::subtract(frame, bgMat, diffMat);
+            srcFrame = diffMat;
+        }
+        stageTime = d->stats.record(PipelineStage::BackgroundModel, stageTime, trace);
+
+        if (d->useColor) {
+            displayFrame = displayPool.acquire(srcFrame.size(), CV_8UC3);
+            cv::cvtColor(srcFrame, displayFrame, cv::COLOR_GRAY2BGR);
+
+            // we want a colored image, mask out the channels we don't want to see
+            const bool anyChannel = d->showRed || d->showGreen || d->showBlue;
+            const bool allChannels = d->showRed && d->showGreen && d->showBlue;
+            if (anyChannel && !allChannels)
+                cv::multiply(displayFrame,
+                             cv::Scalar(d->showBlue? 1 : 0, d->showGreen? 1 : 0, d->showRed? 1 : 0),
+                             displayFrame);
+         } else if (displayFrame.empty()) {
+            // grayscale image
+            double minF, maxF;
+            cv::minMaxLoc(srcFrame, &minF, &maxF);
+            d->minFluor = static_cast<int>(minF);
+            d->maxFluor = static_cast<int>(maxF);
+
+            displayFrame = displayPool.acquire(srcFrame.size(), CV_8UC1);
+            srcFrame.convertTo(displayFrame, CV_8U, 255.0 / (d->maxFluorDisplay - d->minFluorDisplay), -d->minFluorDisplay * 255.0 / (d->maxFluorDisplay - d->minFluorDisplay));
+        }
+
+        d->stats.record(PipelineStage::DisplayMapping, stageTime, trace);
+
+        self->addDisplayFrameToBuffer(displayFrame, packet.timestamp);
+    }
+}
+
+void Miniscope::recordThread(void *msPtr)
+{
+    const auto self = static_cast<Miniscope*> (msPtr);
+    const auto d = self->d.get();
+    self->applySchedulingForRole(ThreadRole::Recording);
+    const auto trace = d->trace.registerThread(QStringLiteral("recording"));
+
+    std::unique_ptr<VideoWriter> vwriter(new VideoWriter());
+
+    // once recording failed, remaining frames are dropped silently until the next start request
+    auto recordFailed = false;
+
+    RecordPacket packet;
+    while (true) {
+        if (!d->recordRing.pop(packet)) {
+            if (d->acquisitionDone)
+                break;
+            std::unique_lock<std::mutex> lock(d->stageMutex);
+            d->recordCond.wait(lock, [&] { return !d->recordRing.empty() || d->acquisitionDone; });
+            continue;
+        }
+
+        switch (packet.action) {
+        case RecordAction::Start:
+            msgInfo("Recording enabled.");
+            recordFailed = false;
+
+            // we want to record, but are not initialized yet
+            vwriter->setFileSliceInterval(d->recordingSliceInterval);
+            vwriter->setCodec(d->videoCodec);
+            vwriter->setContainer(d->videoContainer);
+            vwriter->setLossless(d->recordLossless);
+            vwriter->setEncoderThreads(d->videoEncoderThreads);
+            vwriter->setConcurrentWriters(d->concurrentRecordings);
+            vwriter->setEncoderThreading(d->videoEncoderThreading);
+            vwriter->setFfv1Slices(d->videoFfv1Slices);
+            vwriter->setFfv1SliceCrc(d->videoFfv1SliceCrc);
+            vwriter->setThreadScheduling(self->threadScheduling(ThreadRole::Encoder));
+            vwriter->setPipelineStats(&d->stats);
+            vwriter->setTraceRecorder(&d->trace);
+            vwriter->setSaveMotionShifts(d->motionCorrection);
+            vwriter->setQueueWatermarks(d->encoderQueueHighWatermark, d->encoderQueueLowWatermark);
+            d->encoderQueueDepth = 0;
+            d->encoderQueuePeakDepth = 0;
+            d->encoderBackpressureCount = 0;
+            if (trace != nullptr)
+                trace->instant("recording start");
+
+            try {
+                vwriter->initialize(d->videoFname,
+                                    packet.frame.cols,
+                                    packet.frame.rows,
+                                    static_cast<int>(d->fps),
+                                    packet.frame.channels() == 3);
+            } catch (const std::runtime_error& e) {
+                self->fail(QStringLiteral("Unable to initialize recording: %1").arg(e.what()));
+                recordFailed = true;
+                break;
+            }
+            vwriter->setCaptureStartTimestamp(packet.timestamp);
+            msgInfo("Initialized video recording.");
+            break;
+
+        case RecordAction::Stop:
+            if (!vwriter->initialized())
+                break;
+
+            // we were recording previously, so finalize the movie and
+            // reset the video writer for a clean start
+            vwriter->finalize();
+            vwriter.reset(new VideoWriter());
+            d->lastRecordedFrameTime = std::chrono::milliseconds(0);
+            d->encoderQueueDepth = 0;
+            if (trace != nullptr)
+                trace->instant("recording stop");
+            msgInfo("Recording finalized.");
+            break;
+
+        default:
+            if (recordFailed || !vwriter->initialized())
+                break;
+            const auto stageTime = PipelineStats::clock::now();
+            if (!vwriter->pushFrame(packet.frame, packet.timestamp, packet.motionShift)) {
+                self->fail(QStringLiteral("Unable to send frames to encoder: %1").arg(vwriter->lastError()));
+                recordFailed = true;
+                break;
+            }
+            d->stats.record(PipelineStage::RecordHandoff, stageTime, trace);
+            d->lastRecordedFrameTime = packet.timestamp;
+            d->encoderQueueDepth = vwriter->queueDepth();
+            d->encoderQueuePeakDepth = vwriter->queuePeakDepth();
+            d->encoderBackpressureCount = vwriter->backpressureCount();
+        }
+    }
+
+    // finalize recording (if there was any still ongoing)
+    vwriter->finalize();
+    d->lastRecordedFrameTime = std::chrono::milliseconds(0);
+}
+
+void Miniscope::controlThread(void *msPtr)
+{
+    const auto self = static_cast<Miniscope*> (msPtr);
+    const auto d = self->d.get();
+    self->applySchedulingForRole(ThreadRole::Control);
+    const auto trace = d->trace.registerThread(QStringLiteral("control"));
+
+    bool daqRecordingState = false;
+    while (!d->acquisitionDone) {
+        bool haveCommands;
+        {
+            // wait for new commands, a recording state change or shutdown - we check
+            // periodically as well, as the latter two don't hold the command lock
+            std::unique_lock<std::mutex> lock(d->cmdMutex);
+            d->cmdCond.wait_for(lock, milliseconds_t(5), [&] {
+                return !d->commandQueue.isEmpty()
+                        || d->daqRecordingState != daqRecordingState
+                        || d->acquisitionDone;
+            });
+            haveCommands = !d->commandQueue.isEmpty();
+        }
+
+        // tell DAQ hardware whether we are recording (enables sync trigger output)
+        if (d->daqRecordingState != daqRecordingState) {
+            const std::lock_guard<std::mutex> lock(d->sourceMutex);
+            daqRecordingState = d->daqRecordingState;
+            d->source->setRecordingState(daqRecordingState);
+        }
+
+        // apply all settings changes we have queued
+        if (haveCommands) {
+            const std::lock_guard<std::mutex> lock(d->sourceMutex);
+            const auto sendStartTime = std::chrono::steady_clock::now();
+            self->sendCommandsToDevice();
+            if (trace != nullptr)
+                trace->complete("send commands", sendStartTime, std::chrono::steady_clock::now());
+        }
+    }
+}
+
+void Miniscope::captureThread(void* msPtr)
+{
+    const auto self = static_cast<Miniscope*> (msPtr);
+    const auto d = self->d.get();
+    self->applySchedulingForRole(ThreadRole::Acquisition);
+
+    // unpack raw frame callback pair
+    const auto frameCB = d->frameCallback.first;
+    auto frameCB_udata = d->frameCallback.second;
+    const auto roiTraceCB = d->roiTraceCallback.first;
+    auto roiTraceCB_udata = d->roiTraceCallback.second;
+
     d->droppedFramesCount = 0;
+    d->deviceDroppedFramesCount = 0;
+    d->displaySkippedCount = 0;
     d->currentFPS = static_cast<uint>(d->fps);
+    d->stats.reset();
+    qint64 lastFrameSequence = -1;
+    cv::Size lastFrameSize;
+    int lastFrameType = -1;
+    MotionCorrector motionCorrector;
+    auto motionCorrectionActive = false;
+    RoiEngine roiEngine;
+    RoiTrace roiTrace;
+    uint64_t roiGeneration = 0;
 
     // reset errors
     d->failed = false;
-    d->lastError.clear();
-
-    // prepare accumulator image for running average (for dF/F)
-    cv::Mat accumulatedMat;
+    d->setLastError(QString());
 
     // prepare for recording
-    d->cam.set(cv::CAP_PROP_FPS, d->fps);
-    std::unique_ptr<VideoWriter> vwriter(new VideoWriter());
+    d->source->setFps(d->fps);
     auto recordFrames = false;
 
+    // start the processing stages, this thread only acquires frames and passes them on
+    d->displayRing.reset();
+    d->recordRing.reset();
+    {
+        // the display thread is not running yet, so only readers may access the history
+        const std::lock_guard<std::mutex> lock(d->displayReadMutex);
+        if (d->displayHistoryLength > 0)
+            d->displayHistory.reset(new SPSCRing<DisplayFrame>(d->displayHistoryLength));
+        else
+            d->displayHistory.reset();
+    }
+    {
+        const std::lock_guard<std::mutex> lock(d->roiMutex);
+        roiEngine.setRois(d->rois);
+        roiGeneration = d->roiGeneration;
+        roiTrace.values.resize(d->rois.size());
+    }
+    {
+        // the history slots are sized for the current ROIs and keep their memory when read,
+        // so handing traces over does not allocate in the acquisition loop
+        const std::lock_guard<std::mutex> lock(d->roiReadMutex);
+        if (d->roiTraceHistoryLength > 0)
+            d->roiTraceHistory.reset(new SPSCRing<RoiTrace>(d->roiTraceHistoryLength, roiTrace));
+        else
+            d->roiTraceHistory.reset();
+    }
+    d->daqRecordingState = false;
+    d->acquisitionDone = false;
+
+    // start recording a trace of all stages, if requested
+    if (!d->traceFname.isEmpty()) {
+        QString traceError;
+        if (!d->trace.start(d->traceFname, &traceError))
+            qCWarning(logMScope).noquote() << traceError;
+    }
+    const auto trace = d->trace.registerThread(QStringLiteral("acquisition"));
+
+    // the display thread is only started once there is something to display, so it
+    // never exists in headless mode
+    std::unique_ptr<std::thread> displayWorker;
+    const auto pushDisplayPacket = [&](const DisplayPacket &packet) {
+        if (!displayWorker)
+            displayWorker.reset(new std::thread(displayThread, self));
+        if (!d->displayRing.push(packet))
+            return false;
+        d->wakeStage(d->displayCond);
+        return true;
+    };
+    std::thread recordWorker(recordThread, self);
+    std::thread controlWorker(controlThread, self);
+
     // use custom timepoint as start time, in case we have one set - use current time otherwise
     auto threadStartTime = std::chrono::steady_clock::now();
     auto driverStartTimestamp = milliseconds_t(0);
@@ -1275,10 +1972,28 @@ void Miniscope::captureThread(void* msPtr)
         // acquire a timestamp when we received the frame on our clock, as well as retrieving the driver/device
         // timestamp in milliseconds
         const auto __stime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - threadStartTime);
-        auto status = d->cam.grab();
+        auto stageTime = PipelineStats::clock::now();
+        auto status = d->source->grab();
         auto masterRecvTimestamp = std::chrono::round<milliseconds_t>((__stime + std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - threadStartTime)) / 2.0);
+        stageTime = d->stats.record(PipelineStage::GrabWait, stageTime, trace);
+
+        // prefer the actual capture time over our estimate, if the source knows it
+        std::chrono::time_point<std::chrono::steady_clock> frameCaptureTime;
+        if (status && d->source->frameCaptureTime(frameCaptureTime))
+            masterRecvTimestamp = std::chrono::round<milliseconds_t>(frameCaptureTime - threadStartTime);
+
+        // detect frames lost before they reached us, if the source provides sequence numbers
+        const auto frameSequence = d->source->frameSequence();
+        if (status && frameSequence >= 0) {
+            if (lastFrameSequence >= 0 && frameSequence > lastFrameSequence + 1) {
+                const auto lostCount = frameSequence - lastFrameSequence - 1;
+                d->deviceDroppedFramesCount += static_cast<size_t>(lostCount);
+                msgInfo(QStringLiteral("Device dropped %1 frame(s) before frame %2.").arg(lostCount).arg(frameSequence));
+            }
+            lastFrameSequence = frameSequence;
+        }
 #ifdef Q_OS_LINUX
-        const auto driverFrameTimestamp = milliseconds_t(static_cast<long>(d->cam.get(cv::CAP_PROP_POS_MSEC)));
+        const auto driverFrameTimestamp = d->source->frameTimestamp();
 #else
         const auto driverFrameTimestamp = self->getCurrentFrameTimestamp();
 #endif
@@ -1328,39 +2043,63 @@ void Miniscope::captureThread(void* msPtr)
         const auto frameDeviceTimestamp = driverFrameTimestamp - driverStartTimestamp;
 
         if (!status) {
-            self->fail("Failed to grab frame.");
+            const auto sourceError = d->source->lastError();
+            self->fail(sourceError.isEmpty()? QStringLiteral("Failed to grab frame.") : sourceError);
             break;
         }
 
         try {
-            status = d->cam.retrieve(frame);
-            cv::cvtColor(frame, frame, cv::COLOR_BGR2GRAY);
+            // retrieve into a recycled buffer, sources write into it directly if size and type match
+            if (lastFrameType >= 0)
+                frame = d->framePool.acquire(lastFrameSize, lastFrameType);
+            status = d->source->retrieve(frame);
+            stageTime = d->stats.record(PipelineStage::Retrieve, stageTime, trace);
+
+            // all of our sources should deliver gray frames already, this is just a safeguard
+            if (status && frame.channels() == 3)
+                cv::cvtColor(frame, frame, cv::COLOR_BGR2GRAY);
+            stageTime = d->stats.record(PipelineStage::Conversion, stageTime, trace);
         } catch (const cv::Exception& e) {
             status = false;
             std::cerr << "Caught OpenCV exception:" << e.what() << std::endl;
         }
-        if (!status)
+        if (status) {
+            lastFrameSize = frame.size();
+            lastFrameType = frame.type();
+        } else {
             frame = cv::Mat();
+        }
 
         // call frame callback, so the callee can also adjust the frame
         // timestamp (if it wants to) before we save any data to disk or
         // process it further.
         auto frameTimestamp = frameDeviceTimestamp;
-        if (frameCB != nullptr)
+        if (frameCB != nullptr) {
+            stageTime = PipelineStats::clock::now();
             frameCB(frame, frameTimestamp, masterRecvTimestamp, frameDeviceTimestamp, frameCB_udata);
+            d->stats.record(PipelineStage::FrameCallback, stageTime, trace);
+        }
 
         if (!status) {
             // terminate recording
             d->recording = false;
 
             msgInfo("Dropped frame.");
-            self->addDisplayFrameToBuffer(droppedFrameImage, frameTimestamp);
+            if (trace != nullptr)
+                trace->instant("dropped frame");
+            if (!d->headless) {
+                DisplayPacket droppedPacket;
+                droppedPacket.timestamp = frameTimestamp;
+                droppedPacket.dropped = true;
+                pushDisplayPacket(droppedPacket);
+            }
             if (d->droppedFramesCount > 0) {
                 // reconnect in case we run into multiple failures when trying
                 // to acquire a timestamp
                 // NOTE: This behaviour was copied from the original Miniscope DAQ software
                 msgInfo("Reconnecting Miniscope...");
-                d->cam.release();
+                const std::lock_guard<std::mutex> lock(d->sourceMutex);
+                d->source->release();
                 d->connected = false;
                 std::this_thread::sleep_for(milliseconds_t(1000));
                 if (self->openCamera()) {
@@ -1377,130 +2116,180 @@ void Miniscope::captureThread(void* msPtr)
             continue;
         }
 
-        // prepare video recording if it was enabled while we were running
-        if (self->isRecording()) {
-            if (!vwriter->initialized()) {
-                msgInfo("Recording enabled.");
-
-                // we want to record, but are not initialized yet
-                vwriter->setFileSliceInterval(d->recordingSliceInterval);
-                vwriter->setCodec(d->videoCodec);
-                vwriter->setContainer(d->videoContainer);
-                vwriter->setLossless(d->recordLossless);
-
-                try {
-                    vwriter->initialize(d->videoFname,
-                                        frame.cols,
-                                        frame.rows,
-                                        static_cast<int>(d->fps),
-                                        frame.channels() == 3);
-                } catch (const std::runtime_error& e) {
-                    self->fail(QStringLiteral("Unable to initialize recording: %1").arg(e.what()));
-                    break;
+        // pick up changed ROI definitions
+        if (roiGeneration != d->roiGeneration) {
+            const std::lock_guard<std::mutex> lock(d->roiMutex);
+            roiEngine.setRois(d->rois);
+            roiGeneration = d->roiGeneration;
+        }
+        const bool extractTraces = roiEngine.roiCount() > 0;
+
+        // estimate how far the frame moved, and correct the motion for the stages that want it
+        const bool correctDisplay = d->motionCorrectDisplay && !d->headless;
+        const bool correctRecording = d->motionCorrectRecording;
+        cv::Point2d motionShift;
+        auto correctedFrame = frame;
+        if (d->motionCorrection) {
+            stageTime = PipelineStats::clock::now();
+            if (!motionCorrectionActive) {
+                // start with a fresh template whenever motion correction is enabled
+                motionCorrector.reset();
+                motionCorrectionActive = true;
+            }
+            motionCorrector.setDownsampleFactor(d->motionDownsample);
+            {
+                const std::lock_guard<std::mutex> lock(d->motionMutex);
+                motionCorrector.setRegion(d->motionRegion);
+            }
+
+            try {
+                motionShift = motionCorrector.estimate(frame);
+                if (correctDisplay || correctRecording || extractTraces) {
+                    correctedFrame = d->framePool.acquire(lastFrameSize, lastFrameType);
+                    MotionCorrector::apply(frame, correctedFrame, motionShift);
                 }
+            } catch (const cv::Exception& e) {
+                qCWarning(logMScope).noquote() << "Motion correction failed:" << e.what();
+                motionCorrector.reset();
+                correctedFrame = frame;
+            }
 
-                // we are set for recording and initialized the video writer,
-                // so we allow recording frames now
-                recordFrames = true;
-                msgInfo("Initialized video recording.");
+            {
+                const std::lock_guard<std::mutex> lock(d->motionMutex);
+                d->motionShift = motionShift;
+            }
+            d->stats.record(PipelineStage::MotionCorrection, stageTime, trace);
+        } else {
+            motionCorrectionActive = false;
+        }
+
+        // start or stop video recording if that was requested while we were running
+        if (self->isRecording()) {
+            if (!recordFrames) {
+                std::chrono::time_point<std::chrono::steady_clock> recordingStartTime;
+                {
+                    const std::lock_guard<std::mutex> lock(d->timeMutex);
+                    recordingStartTime = d->recordingStartTimepoint;
+                }
 
-                // first frame happens at 0 time elapsed, so we cheat here and manipulate the current frame timestamp,
-                // as the current frame will already be added to the recording.
-                if (d->useUnixTime) {
-                    const auto currentUnixTS = std::chrono::duration_cast<milliseconds_t>(std::chrono::system_clock::now().time_since_epoch());
-                    driverStartTimestamp = driverFrameTimestamp - currentUnixTS;
+                auto recordingOrigin = frameTimestamp;
+                if (recordingStartTime > std::chrono::time_point<std::chrono::steady_clock>::min()) {
+                    // we are aligned with other recordings, so keep our time base and place the recording
+                    // origin at the shared start time, which has passed just a moment ago
+                    recordingOrigin = frameTimestamp - std::chrono::duration_cast<milliseconds_t>(std::chrono::steady_clock::now() - recordingStartTime);
                 } else {
-                    driverStartTimestamp = driverFrameTimestamp;
+                    // first frame happens at 0 time elapsed, so we cheat here and manipulate the current frame timestamp,
+                    // as the current frame will already be added to the recording.
+                    if (d->useUnixTime) {
+                        const auto currentUnixTS = std::chrono::duration_cast<milliseconds_t>(std::chrono::system_clock::now().time_since_epoch());
+                        driverStartTimestamp = driverFrameTimestamp - currentUnixTS;
+                    } else {
+                        driverStartTimestamp = driverFrameTimestamp;
+                    }
+                    frameTimestamp = driverFrameTimestamp - driverStartTimestamp;
+                    recordingOrigin = frameTimestamp;
                 }
-                frameTimestamp = driverFrameTimestamp - driverStartTimestamp;
-                vwriter->setCaptureStartTimestamp(frameTimestamp);
 
-                // tell DAQ hardware that we are recording now (enables sync trigger output)
-                d->cam.set(cv::CAP_PROP_SATURATION, 0x0001);
+                // the recording thread initializes the video writer with the properties of this frame
+                RecordPacket startPacket;
+                startPacket.action = RecordAction::Start;
+                startPacket.frame = frame;
+                startPacket.timestamp = recordingOrigin;
+                if (!d->recordRing.push(startPacket)) {
+                    self->fail("Unable to start recording: Recording queue is full.");
+                    break;
+                }
+                d->wakeStage(d->recordCond);
+                recordFrames = true;
+                d->daqRecordingState = true;
+                d->cmdCond.notify_one();
             }
-        } else {
-            // we are not recording or stopped recording
-            if (recordFrames) {
-                // we were recording previously, so finalize the movie and stop adding
-                // new frames to the video.
-                // Also reset the video writer for a clean start
-                vwriter->finalize();
-                vwriter.reset(new VideoWriter());
-                recordFrames = false;
-                msgInfo("Recording finalized.");
-                d->lastRecordedFrameTime = std::chrono::milliseconds(0);
-
-                // let DAQ board know that we aren#t recording (anymore)
-                d->cam.set(cv::CAP_PROP_SATURATION, 0x0000);
+        } else if (recordFrames) {
+            // we were recording previously, so have the recording thread finalize the movie
+            RecordPacket stopPacket;
+            stopPacket.action = RecordAction::Stop;
+            if (!d->recordRing.push(stopPacket)) {
+                self->fail("Unable to stop recording: Recording queue is full.");
+                break;
             }
+            d->wakeStage(d->recordCond);
+            recordFrames = false;
+            d->daqRecordingState = false;
+            d->cmdCond.notify_one();
         }
 
-        // "frame" is the frame that we record to disk, while the "displayFrame"
-        // is the one that we may also record as a video file
-        cv::Mat displayFrame;
-        frame.copyTo(displayFrame);
-
-        // calculate various background differences, if selected
-        if (accumulatedMat.rows == 0)
-            accumulatedMat = cv::Mat::zeros(frame.rows, frame.cols, CV_32FC(frame.channels()));
-
-        cv::Mat displayF32;
-        displayFrame.convertTo(displayF32, CV_32F, 1.0 / 255.0);
-        cv::accumulateWeighted(displayF32, accumulatedMat, d->bgAccumulateAlpha);
-        if (d->displayMode == DisplayMode::BackgroundDiff) {
-            cv::Mat tmpBgMat;
-            accumulatedMat.convertTo(tmpBgMat, CV_8UC1, 255.0);
-            cv::subtract(displayFrame, tmpBgMat, displayFrame);
+        // extract the ROI traces, as early as possible so closed-loop experiments can react quickly
+        roiTrace.sequence++;
+        if (extractTraces) {
+            stageTime = PipelineStats::clock::now();
+            roiEngine.setNeuropil(d->roiNeuropil, d->roiNeuropilFactor);
+            roiEngine.process(correctedFrame, roiTrace.values);
+            roiTrace.timestamp = frameTimestamp;
+            if (roiTraceCB != nullptr)
+                roiTraceCB(roiTrace.values, roiTrace.timestamp, roiTraceCB_udata);
+            if (d->roiTraceHistory)
+                d->roiTraceHistory->push(roiTrace);
+            d->stats.record(PipelineStage::RoiTraces, stageTime, trace);
         }
 
-        if (d->useColor) {
-            cv::cvtColor(displayFrame, displayFrame, cv::COLOR_GRAY2BGR);
-
-            // we want a colored image
-            if (d->showRed || d->showGreen || d->showBlue) {
-                cv::Mat bgrChannels[3];
-                cv::split(displayFrame, bgrChannels);
-
-                if (!d->showBlue)
-                    bgrChannels[0] = cv::Mat::zeros(displayFrame.rows, displayFrame.cols, CV_8UC1);
-                if (!d->showGreen)
-                    bgrChannels[1] = cv::Mat::zeros(displayFrame.rows, displayFrame.cols, CV_8UC1);
-                if (!d->showRed)
-                    bgrChannels[2] = cv::Mat::zeros(displayFrame.rows, displayFrame.cols, CV_8UC1);
-
-                cv::merge(bgrChannels, 3, displayFrame);
+        // pass the frame on to the display and recording stages
+        stageTime = PipelineStats::clock::now();
+        if (!d->headless) {
+            DisplayPacket displayPacket;
+            displayPacket.frame = correctDisplay? correctedFrame : frame;
+            displayPacket.timestamp = frameTimestamp;
+            if (!pushDisplayPacket(displayPacket)) {
+                d->displaySkippedCount++;
+                if (trace != nullptr)
+                    trace->instant("display skipped");
             }
-         } else {
-            // grayscale image
-            double minF, maxF;
-            cv::minMaxLoc(displayFrame, &minF, &maxF);
-            d->minFluor = static_cast<int>(minF);
-            d->maxFluor = static_cast<int>(maxF);
-
-            displayFrame.convertTo(displayFrame, CV_8U, 255.0 / (d->maxFluorDisplay - d->minFluorDisplay), -d->minFluorDisplay * 255.0 / (d->maxFluorDisplay - d->minFluorDisplay));
         }
 
-        // add display frame to ringbuffer, and record the raw
-        // frame to disk if we want to record it.
-        self->addDisplayFrameToBuffer(displayFrame, frameTimestamp);
         if (recordFrames) {
-            if (!vwriter->pushFrame(frame, frameTimestamp))
-                self->fail(QStringLiteral("Unable to send frames to encoder: %1").arg(vwriter->lastError()));
-            d->lastRecordedFrameTime = frameTimestamp;
+            RecordPacket recPacket;
+            recPacket.frame = correctRecording? correctedFrame : frame;
+            recPacket.timestamp = frameTimestamp;
+            recPacket.motionShift = motionShift;
+            if (d->recordRing.push(recPacket))
+                d->wakeStage(d->recordCond);
+            else
+                self->fail("Recording can not keep up with the incoming frames. Is the storage medium too slow?");
+        }
+        d->stats.record(PipelineStage::Handoff, stageTime, trace);
+        d->stats.record(PipelineStage::Cycle, cycleStartTime, trace);
+        if (trace != nullptr) {
+            trace->counter("display queue", static_cast<int64_t>(d->displayRing.size()));
+            trace->counter("record queue", static_cast<int64_t>(d->recordRing.size()));
         }
-
-        // apply all settings changes we have queued
-        if (!d->commandQueue.isEmpty())
-            self->sendCommandsToDevice();
 
         const auto totalTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - cycleStartTime);
         d->currentFPS = static_cast<uint>(1 / (totalTime.count() / static_cast<double>(1000)));
     }
 
-    // finalize recording (if there was any still ongoing)
-    vwriter->finalize();
-    d->lastRecordedFrameTime = std::chrono::milliseconds(0);
+    // finalize recording (if there was any still ongoing) - at this point we are shutting down,
+    // so waiting for the recording thread to make some room is fine
+    if (recordFrames) {
+        RecordPacket stopPacket;
+        stopPacket.action = RecordAction::Stop;
+        while (!d->recordRing.push(stopPacket))
+            std::this_thread::sleep_for(milliseconds_t(1));
+    }
+
+    // let all stages finish the work they have queued
+    d->acquisitionDone = true;
+    d->wakeStage(d->displayCond);
+    d->wakeStage(d->recordCond);
+    d->cmdCond.notify_one();
+    if (displayWorker)
+        displayWorker->join();
+    recordWorker.join();
+    controlWorker.join();
+    d->framePool.clear();
+    d->trace.stop();
+
+    if (d->displaySkippedCount > 0)
+        msgInfo(QStringLiteral("Skipped %1 frame(s) for display, as displaying was too slow.").arg(d->displaySkippedCount));
 
     // any recording is finished at this point, let DAQ hardware know about that
-    d->cam.set(cv::CAP_PROP_SATURATION, 0x0000);
+    d->source->setRecordingState(false);
 }
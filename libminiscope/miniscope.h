@@ -25,12 +25,8 @@
 #include <opencv2/core.hpp>
 
 #include "mediatypes.h"
-
-#ifdef Q_OS_WIN
-#define MS_LIB_EXPORT __declspec(dllexport)
-#else
-#define MS_LIB_EXPORT __attribute__((visibility("default")))
-#endif
+#include "threadsched.h"
+#include "msexport.h"
 
 namespace MScope
 {
@@ -50,13 +46,26 @@ using StatusMessageCallback = std::function<void(const QString&, void *)>;
 using ControlChangeCallback = std::function<void(const QString&, double, double, void *)>;
 using RawFrameCallback = std::function<void(const cv::Mat &, milliseconds_t &, const milliseconds_t &, const milliseconds_t &, void *)>;
 using DisplayFrameCallback = std::function<void(const cv::Mat &, const milliseconds_t &, void *)>;
+using RoiTraceCallback = std::function<void(const std::vector<float> &, const milliseconds_t &, void *)>;
 
 enum class DisplayMode {
-    RawFrames,
-    BackgroundDiff
+    RawFrames,      /// frames as they are acquired
+    BackgroundDiff, /// frame minus the running average background
+    DeltaFOverF,    /// change relative to the running average background, one gray level per percent
+    MaxProjection,  /// running maximum of each pixel, decaying towards the current frame
+    StdDeviation    /// running standard deviation of each pixel, in gray levels
 };
 Q_ENUM_NS(DisplayMode)
 
+/**
+ * @brief Numeric precision of the background model used for background subtraction
+ */
+enum class BackgroundModelPrecision {
+    Float,     /// 32-bit floating point
+    FixedPoint /// 16-bit fixed point, needs only half the memory bandwidth
+};
+Q_ENUM_NS(BackgroundModelPrecision)
+
 /**
  * @brief Set which type of control is needed
  */
@@ -67,6 +76,40 @@ enum class ControlKind {
 };
 Q_ENUM_NS(ControlKind)
 
+/**
+ * @brief Where frames are acquired from
+ */
+enum class FrameSourceKind {
+    Device,    /// a physical Miniscope DAQ board
+    Synthetic, /// generated frames, for testing without any hardware
+    Replay,    /// frames replayed from a previous recording
+    DeviceV4L2 /// a physical Miniscope DAQ board, accessed directly via Video4Linux2 (Linux only)
+};
+Q_ENUM_NS(FrameSourceKind)
+
+/**
+ * @brief Processing stages of the acquisition pipeline
+ */
+enum class PipelineStage {
+    GrabWait,         /// waiting for the device to deliver a frame
+    Retrieve,         /// fetching the frame data from the device
+    Conversion,       /// any further format conversion of the retrieved frame
+    MotionCorrection, /// estimating and correcting the frame motion
+    RoiTraces,        /// extracting the fluorescence traces of all ROIs
+    FrameCallback,    /// the raw frame callback
+    Handoff,          /// passing the frame on to the display and recording stages
+    Cycle,            /// one complete acquisition cycle
+    BackgroundModel,  /// updating the background model for display
+    DisplayMapping,   /// mapping frames to display colors and value ranges
+    RecordHandoff,    /// passing the frame on to the encoder queue
+    EncoderQueue,     /// time frames spend waiting in the encoder queue
+    Encode,           /// encoding the frame
+    Mux,              /// writing encoded packets to the video file
+    TimestampWrite,   /// writing the frame timestamp to the timestamp file
+    Last
+};
+Q_ENUM_NS(PipelineStage)
+
 class ControlDefinition
 {
 public:
@@ -88,6 +131,102 @@ public:
     std::vector<double> values;
 };
 
+/**
+ * @brief Settings for the synthetic frame generator
+ *
+ * The frame size is taken from the selected device configuration, the
+ * framerate from the device's framerate control.
+ */
+class SyntheticSourceSettings
+{
+public:
+    explicit SyntheticSourceSettings()
+        : baseFluorescence(60),
+          noiseLevel(4),
+          cellCount(80),
+          activityRate(0.5),
+          dropRate(0),
+          timestampGlitchRate(0),
+          realtime(true),
+          seed(0)
+    {}
+
+    double baseFluorescence;    /// mean background brightness, in pixel values
+    double noiseLevel;          /// standard deviation of the sensor noise, in pixel values
+    int cellCount;              /// number of simulated active cells
+    double activityRate;        /// average number of calcium transients per cell and second
+    double dropRate;            /// probability that a frame is dropped
+    double timestampGlitchRate; /// probability that a frame has a bogus timestamp
+    bool realtime;              /// deliver frames at the selected framerate, instead of as fast as possible
+    uint seed;                  /// seed for the random generator, 0 to pick one randomly
+};
+
+/**
+ * @brief Latency statistics of a single pipeline stage
+ *
+ * All times are in microseconds. Percentiles are accurate to about 3%.
+ */
+class StageStatistics
+{
+public:
+    explicit StageStatistics()
+        : stage(PipelineStage::Last),
+          count(0),
+          minUsec(0),
+          meanUsec(0),
+          maxUsec(0),
+          p50Usec(0),
+          p90Usec(0),
+          p99Usec(0),
+          p999Usec(0),
+          rate(0)
+    {}
+
+    PipelineStage stage;
+    QString name;
+    uint64_t count;  /// number of measurements since the statistics were last reset
+    double minUsec;
+    double meanUsec;
+    double maxUsec;
+    double p50Usec;
+    double p90Usec;
+    double p99Usec;
+    double p999Usec;
+    double rate;     /// measurements per second, over the last few seconds
+};
+
+/**
+ * @brief A frame prepared for display
+ */
+class DisplayFrame
+{
+public:
+    explicit DisplayFrame()
+        : sequence(0),
+          timestamp(0)
+    {}
+
+    cv::Mat frame;
+    uint64_t sequence;        /// increases by one with every display frame, 0 if there was no frame yet
+    milliseconds_t timestamp;
+};
+
+/**
+ * @brief Fluorescence of all ROIs in one frame
+ */
+class RoiTrace
+{
+public:
+    explicit RoiTrace()
+        : sequence(0),
+          timestamp(0)
+    {}
+
+    std::vector<float> values; /// fluorescence of every ROI, in the order they were added
+    uint64_t sequence;         /// number of the frame since acquisition was started
+    milliseconds_t timestamp;
+};
+
 class MS_LIB_EXPORT Miniscope
 {
 public:
@@ -96,11 +235,48 @@ public:
 
     QStringList availableDeviceTypes() const;
     bool loadDeviceConfig(const QString &deviceType);
+
+    /**
+     * @brief Load additional device definitions from a JSON file
+     *
+     * The file must use the same format as the built-in definitions, which are
+     * replaced by definitions with the same name. Definitions are shared by all
+     * Miniscope instances of this process.
+     */
+    bool loadDeviceDefinitions(const QString &fname);
     QString deviceType() const;
 
     void setScopeCamId(int id);
     int scopeCamId() const;
 
+    FrameSourceKind frameSourceKind() const;
+    void setFrameSourceKind(FrameSourceKind kind);
+
+    SyntheticSourceSettings syntheticSourceSettings() const;
+    void setSyntheticSourceSettings(const SyntheticSourceSettings &settings);
+
+    QString replayFilename() const;
+    void setReplayFilename(const QString &fname);
+
+    double replaySpeed() const;
+    void setReplaySpeed(double factor);
+
+    bool replayLoop() const;
+    void setReplayLoop(bool loop);
+
+    uint captureBufferCount() const;
+    void setCaptureBufferCount(uint count);
+
+    /**
+     * @brief Set scheduling policy, nice level and CPU affinity for a thread role
+     *
+     * The settings take effect the next time acquisition (or, for the encoder,
+     * a recording) is started. Settings which can not be applied, usually due to
+     * missing permissions, are reported as warnings and otherwise ignored.
+     */
+    void setThreadScheduling(ThreadRole role, const ThreadScheduling &sched);
+    ThreadScheduling threadScheduling(ThreadRole role) const;
+
     bool connect();
     void disconnect();
 
@@ -163,13 +339,92 @@ public:
      */
     void setOnDisplayFrame(DisplayFrameCallback callback, void *udata = nullptr);
 
+    /**
+     * @brief Get the latest display frame, if there is a new one
+     *
+     * Returns an empty matrix if no frame was produced since the last call.
+     * Frames which were produced while nobody asked for them are skipped, so the
+     * returned frame is always the most recent one.
+     */
     cv::Mat currentDisplayFrame();
+
+    /**
+     * @brief Get the latest display frame, whether it was seen before or not
+     *
+     * Use the frame sequence number to find out whether anything new arrived.
+     */
+    DisplayFrame latestDisplayFrame();
+
+    /**
+     * @brief Keep a history of display frames, for consumers that want every frame
+     *
+     * If the length is not zero, every display frame is also added to a bounded
+     * history, which can be read with takeDisplayHistoryFrame(). If the history is
+     * full, new frames are not added to it.
+     * Takes effect the next time acquisition is started.
+     */
+    void setDisplayHistoryLength(uint length);
+    uint displayHistoryLength() const;
+    bool takeDisplayHistoryFrame(DisplayFrame &frame);
+
+    /**
+     * @brief Do not produce any display frames
+     *
+     * Use this when only recording, to save the CPU time needed for display processing.
+     * No display frames are produced and the display frame callback is not called.
+     * Even when not headless, display frames are only produced while anybody
+     * requested one within the last second, registered a display frame callback
+     * or enabled the display history.
+     */
+    bool headless() const;
+    void setHeadless(bool headless);
+
+    /**
+     * @brief Maximum rate at which display frames are produced, in Hz
+     *
+     * Set to 0 to produce a display frame for every acquired frame.
+     */
+    double displayRateLimit() const;
+    void setDisplayRateLimit(double hz);
     uint currentFps() const;
     size_t droppedFramesCount() const;
 
+    /**
+     * @brief Get latency statistics for every stage of the acquisition pipeline
+     *
+     * Statistics are collected continuously while acquiring, at very low cost.
+     * Compare the stage latencies with the frame interval to find out which
+     * stage is at risk of causing dropped frames.
+     */
+    std::vector<StageStatistics> pipelineStatistics() const;
+    void resetPipelineStatistics();
+
+    /**
+     * @brief Record a trace of the acquisition pipeline
+     *
+     * If set, a trace of all pipeline stages, control command transmissions, encoder
+     * activity and queue depths is written to this file while acquisition is running.
+     * The file uses the Chrome trace event format and can be opened in Perfetto
+     * or chrome://tracing. It is overwritten every time acquisition is started.
+     * Set an empty filename to disable tracing.
+     */
+    QString traceFilename() const;
+    void setTraceFilename(const QString &fname);
+
     double fps() const;
 
     void setCaptureStartTime(const std::chrono::time_point<std::chrono::steady_clock> &startTime);
+
+    /**
+     * @brief Align recordings to a fixed start time
+     *
+     * By default, frame timestamps are reset to zero when a recording starts. If a recording
+     * start time is set, timestamps continue in the capture time base instead, and the recording
+     * (including the boundaries of its file slices) starts at the given time.
+     * This is used to align the recordings of multiple Miniscopes. Set it to the minimum
+     * time point value to restore the default behavior.
+     */
+    void setRecordingStartTime(const std::chrono::time_point<std::chrono::steady_clock> &startTime);
     bool useUnixTimestamps() const;
     void setUseUnixTimestamps(bool useUnixTime);
     milliseconds_t unixCaptureStartTime() const;
@@ -189,6 +444,37 @@ public:
     bool recordLossless() const;
     void setRecordLossless(bool lossless);
 
+    /**
+     * @brief Number of video encoder threads, 0 to pick automatically
+     *
+     * The automatic choice divides the CPU cores by the number of Miniscopes
+     * recording at the same time, see setConcurrentRecordings().
+     */
+    int videoEncoderThreads() const;
+    void setVideoEncoderThreads(int count);
+
+    /**
+     * @brief Number of Miniscopes in this process which record at the same time, 0 if unknown
+     *
+     * Used to share the CPU cores evenly between their video encoders. If unknown, only
+     * the recordings already running when a video file is started are counted.
+     * MiniscopeGroup sets this for all of its Miniscopes.
+     */
+    int concurrentRecordings() const;
+    void setConcurrentRecordings(int count);
+
+    EncoderThreading videoEncoderThreading() const;
+    void setVideoEncoderThreading(EncoderThreading threading);
+
+    /**
+     * @brief Number of slices per FFV1 frame (4, 6, 9, 12, 16, 24 or 30), 0 to pick automatically
+     */
+    int videoFfv1Slices() const;
+    void setVideoFfv1Slices(int slices);
+
+    bool videoFfv1SliceCrc() const;
+    void setVideoFfv1SliceCrc(bool enabled);
+
     int minFluorDisplay() const;
     void setMinFluorDisplay(int value);
 
@@ -198,15 +484,146 @@ public:
     int minFluor() const;
     int maxFluor() const;
 
+    /**
+     * @brief Pick the display window automatically
+     *
+     * When enabled, the display min/max values follow the given percentiles of the
+     * pixel values (after background subtraction), smoothed over time so the image
+     * does not flicker. Unlike the plain minimum and maximum, the percentiles are
+     * not thrown off by single hot pixels. Disabling auto-contrast keeps the last
+     * automatic window.
+     */
+    bool autoContrast() const;
+    void setAutoContrast(bool enabled);
+    double autoContrastLowPercentile() const;
+    double autoContrastHighPercentile() const;
+    void setAutoContrastPercentiles(double low, double high);
+
+    /**
+     * @brief 256-bin histogram of the pixel values of the last display frame, before the display window is applied
+     */
+    std::vector<int> displayHistogram() const;
+
     DisplayMode displayMode() const;
     void setDisplayMode(DisplayMode mode);
 
+    /**
+     * @brief Update speed of the per-pixel running state of the display modes
+     *
+     * This is the weight of each new frame in the running background average, in the
+     * running variance, and the rate at which the maximum projection decays.
+     */
     double bgAccumulateAlpha() const;
     void setBgAccumulateAlpha(double value);
 
+    BackgroundModelPrecision backgroundModelPrecision() const;
+    void setBackgroundModelPrecision(BackgroundModelPrecision precision);
+
+    /**
+     * @brief Online rigid motion correction
+     *
+     * When enabled, the translation of every frame against a slowly updated template is
+     * estimated right after acquisition. The shifts are saved alongside the timestamps of a
+     * recording, in a "_motion.csv" file, and can optionally be corrected in the displayed
+     * and/or the recorded frames. Enabling motion correction again starts a new template.
+     */
+    bool motionCorrection() const;
+    void setMotionCorrection(bool enabled);
+
+    bool motionCorrectDisplay() const;
+    void setMotionCorrectDisplay(bool enabled);
+
+    bool motionCorrectRecording() const;
+    void setMotionCorrectRecording(bool enabled);
+
+    /**
+     * @brief Factor by which frames are shrunk before estimating their motion
+     */
+    int motionCorrectionDownsample() const;
+    void setMotionCorrectionDownsample(int factor);
+
+    /**
+     * @brief Part of the frame the motion is estimated from, an empty rectangle for the whole frame
+     */
+    cv::Rect motionCorrectionRegion() const;
+    void setMotionCorrectionRegion(const cv::Rect &region);
+
+    /**
+     * @brief Estimated shift of the last frame against the motion template, in pixels
+     */
+    cv::Point2d motionShift() const;
+
+    /**
+     * @brief Add a region of interest to extract a fluorescence trace from
+     *
+     * The mask must have the size of the frames, every non-zero pixel belongs to the ROI
+     * and is weighted by its value. The polygon is given in frame coordinates.
+     * On every frame, the weighted mean of all ROI pixels is calculated, from the motion
+     * corrected frame if motion correction is enabled.
+     * Returns the index of the new ROI in the trace values.
+     */
+    int addRoi(const cv::Mat &mask);
+    int addRoiPolygon(const std::vector<cv::Point> &polygon);
+    void clearRois();
+    int roiCount() const;
+
+    /**
+     * @brief Subtract the surrounding neuropil from the ROI traces
+     *
+     * The neuropil of a ROI is a ring around it, excluding all pixels of any ROI.
+     * Its mean is multiplied by the neuropil factor and subtracted from the ROI mean.
+     */
+    bool roiNeuropilSubtraction() const;
+    void setRoiNeuropilSubtraction(bool enabled);
+    double roiNeuropilFactor() const;
+    void setRoiNeuropilFactor(double factor);
+
+    /**
+     * @brief Called *in the DAQ thread* with the ROI traces of every frame
+     *
+     * Keep this callback short, as it directly delays the acquisition of the next frame.
+     */
+    void setOnRoiTrace(RoiTraceCallback callback, void *udata = nullptr);
+
+    /**
+     * @brief Keep a history of ROI traces
+     *
+     * Works like the display history: if the length is not zero, the traces of every
+     * frame are added to a bounded history that can be read with takeRoiTrace().
+     * If the history is full, new traces are not added to it.
+     * Takes effect the next time acquisition is started.
+     */
+    void setRoiTraceHistoryLength(uint length);
+    uint roiTraceHistoryLength() const;
+    bool takeRoiTrace(RoiTrace &trace);
+
     uint recordingSliceInterval() const;
     void setRecordingSliceInterval(uint minutes);
 
+    /**
+     * @brief Limits of the queue of frames waiting to be encoded
+     *
+     * Once the encoder queue holds as many frames as the high watermark, the recording
+     * stage waits until the encoder has brought it down to the low watermark. Meanwhile,
+     * frames are buffered in the recording queue, and recording fails only if that
+     * overflows as well.
+     * Takes effect the next time a recording is started.
+     */
+    void setEncoderQueueWatermarks(uint high, uint low);
+    uint encoderQueueHighWatermark() const;
+    uint encoderQueueLowWatermark() const;
+
+    /**
+     * @brief Number of frames waiting to be encoded, now and at most during the current recording
+     */
+    size_t encoderQueueDepth() const;
+    size_t encoderQueuePeakDepth() const;
+
+    /**
+     * @brief Number of times the encoder queue reached its high watermark during the current recording
+     */
+    size_t encoderBackpressureCount() const;
+
     void setPrintExtraDebug(bool enabled);
 
     QString lastError() const;
@@ -219,12 +636,16 @@ private:
     std::unique_ptr<Private> d;
 
     bool openCamera();
-    void enqueueI2CCommand(long preambleKey, std::vector<quint8> packet);
+    void enqueueI2CCommand(long preambleKey, std::vector<quint8> packet, bool coalesce = false);
     void sendCommandsToDevice();
     void addDisplayFrameToBuffer(const cv::Mat& frame, const milliseconds_t &timestamp);
     static void captureThread(void *msPtr);
+    static void displayThread(void *msPtr);
+    static void recordThread(void *msPtr);
+    static void controlThread(void *msPtr);
     void startCaptureThread();
     void finishCaptureThread();
+    void applySchedulingForRole(ThreadRole role);
     milliseconds_t getCurrentFrameTimestamp();
     void statusMessage(const QString &msg);
     void fail(const QString &msg);
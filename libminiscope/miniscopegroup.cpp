@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "miniscopegroup.h"
+
+#include <thread>
+#include <QDebug>
+
+using namespace MScope;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+class MiniscopeGroup::Private
+{
+public:
+    Private()
+        : running(false),
+          recording(false)
+    {
+        startTime = std::chrono::time_point<std::chrono::steady_clock>::min();
+    }
+
+    void resetRecordingSettings()
+    {
+        // don't leave the group's settings behind for recordings started on a single scope later
+        for (auto &scope : scopes) {
+            scope->setRecordingStartTime(std::chrono::time_point<std::chrono::steady_clock>::min());
+            scope->setConcurrentRecordings(0);
+        }
+    }
+
+    std::vector<std::unique_ptr<Miniscope>> scopes;
+    std::chrono::time_point<std::chrono::steady_clock> startTime;
+
+    bool running;
+    bool recording;
+    QString lastError;
+};
+#pragma GCC diagnostic pop
+
+MiniscopeGroup::MiniscopeGroup()
+    : d(new MiniscopeGroup::Private())
+{
+}
+
+MiniscopeGroup::~MiniscopeGroup()
+{
+    disconnect();
+}
+
+Miniscope *MiniscopeGroup::addScope()
+{
+    d->scopes.push_back(std::unique_ptr<Miniscope>(new Miniscope()));
+    return d->scopes.back().get();
+}
+
+std::vector<Miniscope *> MiniscopeGroup::scopes() const
+{
+    std::vector<Miniscope*> list;
+    for (const auto &scope : d->scopes)
+        list.push_back(scope.get());
+    return list;
+}
+
+size_t MiniscopeGroup::count() const
+{
+    return d->scopes.size();
+}
+
+bool MiniscopeGroup::connect()
+{
+    if (d->scopes.empty()) {
+        d->lastError = QStringLiteral("No Miniscopes were added to the group.");
+        return false;
+    }
+
+    // Connecting a Miniscope takes a while, as we have to wait for the DAQ board to process
+    // our initialization commands. The scopes are independent, so we connect them all at once.
+    std::vector<std::thread> threads;
+    std::vector<char> results(d->scopes.size(), 0);
+    for (size_t i = 0; i < d->scopes.size(); i++) {
+        threads.emplace_back([this, i, &results] {
+            results[i] = d->scopes[i]->connect()? 1 : 0;
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+
+    for (size_t i = 0; i < d->scopes.size(); i++) {
+        if (results[i] == 0) {
+            d->lastError = QStringLiteral("Unable to connect Miniscope %1: %2").arg(i).arg(d->scopes[i]->lastError());
+            disconnect();
+            return false;
+        }
+    }
+
+    d->lastError.clear();
+    return true;
+}
+
+void MiniscopeGroup::disconnect()
+{
+    stop();
+    for (auto &scope : d->scopes)
+        scope->disconnect();
+}
+
+bool MiniscopeGroup::run()
+{
+    if (d->running)
+        return true;
+
+    // all scopes measure time relative to the same start time
+    d->startTime = std::chrono::steady_clock::now();
+    for (auto &scope : d->scopes)
+        scope->setCaptureStartTime(d->startTime);
+
+    for (size_t i = 0; i < d->scopes.size(); i++) {
+        if (!d->scopes[i]->run()) {
+            d->lastError = QStringLiteral("Unable to start Miniscope %1: %2").arg(i).arg(d->scopes[i]->lastError());
+            stop();
+            return false;
+        }
+    }
+
+    d->running = true;
+    return true;
+}
+
+void MiniscopeGroup::stop()
+{
+    stopRecording();
+    for (auto &scope : d->scopes)
+        scope->stop();
+    d->running = false;
+}
+
+bool MiniscopeGroup::startRecording()
+{
+    if (!d->running) {
+        if (!run())
+            return false;
+    }
+
+    // every scope starts its recording at the same point in time, no matter when
+    // its acquisition thread picks up the request
+    // the scopes start their encoders one after another, so tell them up front how many will
+    // be recording, to have them share the CPU cores evenly
+    const auto recordingStartTime = std::chrono::steady_clock::now();
+    for (auto &scope : d->scopes) {
+        scope->setConcurrentRecordings(static_cast<int>(d->scopes.size()));
+        scope->setRecordingStartTime(recordingStartTime);
+    }
+
+    for (size_t i = 0; i < d->scopes.size(); i++) {
+        if (!d->scopes[i]->startRecording()) {
+            d->lastError = QStringLiteral("Unable to start recording on Miniscope %1: %2").arg(i).arg(d->scopes[i]->lastError());
+            for (size_t j = 0; j < i; j++)
+                d->scopes[j]->stopRecording();
+            d->resetRecordingSettings();
+            return false;
+        }
+    }
+
+    d->recording = true;
+    return true;
+}
+
+void MiniscopeGroup::stopRecording()
+{
+    if (!d->recording)
+        return;
+    for (auto &scope : d->scopes)
+        scope->stopRecording();
+    d->resetRecordingSettings();
+    d->recording = false;
+}
+
+bool MiniscopeGroup::isRunning() const
+{
+    return d->running;
+}
+
+bool MiniscopeGroup::isRecording() const
+{
+    return d->recording;
+}
+
+std::chrono::time_point<std::chrono::steady_clock> MiniscopeGroup::captureStartTime() const
+{
+    return d->startTime;
+}
+
+std::vector<ScopeHealth> MiniscopeGroup::health() const
+{
+    std::vector<ScopeHealth> result;
+    for (const auto &scope : d->scopes) {
+        ScopeHealth h;
+        h.deviceType = scope->deviceType();
+        h.scopeCamId = scope->scopeCamId();
+        h.connected = scope->isConnected();
+        h.running = scope->isRunning();
+        h.recording = scope->isRecording();
+        h.currentFps = scope->currentFps();
+        h.droppedFrames = scope->droppedFramesCount();
+        h.lastRecordedFrameTime = scope->lastRecordedFrameTime();
+        h.lastError = scope->lastError();
+        result.push_back(h);
+    }
+
+    return result;
+}
+
+bool MiniscopeGroup::healthy() const
+{
+    for (const auto &scope : d->scopes) {
+        if (!scope->isRunning() || !scope->lastError().isEmpty())
+            return false;
+        if (d->recording && !scope->isRecording())
+            return false;
+    }
+
+    return !d->scopes.empty();
+}
+
+size_t MiniscopeGroup::droppedFramesCount() const
+{
+    size_t count = 0;
+    for (const auto &scope : d->scopes)
+        count += scope->droppedFramesCount();
+    return count;
+}
+
+milliseconds_t MiniscopeGroup::recordingTimeSpread() const
+{
+    bool first = true;
+    milliseconds_t minTime(0);
+    milliseconds_t maxTime(0);
+    for (const auto &scope : d->scopes) {
+        if (!scope->isRecording())
+            continue;
+        const auto t = scope->lastRecordedFrameTime();
+        if (first || t < minTime)
+            minTime = t;
+        if (first || t > maxTime)
+            maxTime = t;
+        first = false;
+    }
+
+    return maxTime - minTime;
+}
+
+QString MiniscopeGroup::lastError() const
+{
+    return d->lastError;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MINISCOPEGROUP_H
+#define MINISCOPEGROUP_H
+
+#include <memory>
+#include <vector>
+#include "miniscope.h"
+
+namespace MScope
+{
+
+/**
+ * @brief Health of a single Miniscope in a MiniscopeGroup
+ */
+class ScopeHealth
+{
+public:
+    explicit ScopeHealth()
+        : scopeCamId(-1),
+          connected(false),
+          running(false),
+          recording(false),
+          currentFps(0),
+          droppedFrames(0),
+          lastRecordedFrameTime(0)
+    {}
+
+    QString deviceType;
+    int scopeCamId;
+    bool connected;
+    bool running;
+    bool recording;
+    uint currentFps;
+    size_t droppedFrames;
+    milliseconds_t lastRecordedFrameTime;
+    QString lastError;
+};
+
+/**
+ * @brief Acquire from multiple Miniscopes together
+ *
+ * All Miniscopes of a group share one capture start time, so their frame
+ * timestamps are directly comparable. Recordings of all scopes start at the
+ * same time and their file slices have the same boundaries.
+ *
+ * The group owns its Miniscope instances. They are set up individually
+ * (device type, camera ID, video filename, ...) and are then connected,
+ * started and recorded through the group.
+ * Status and frame callbacks of the individual scopes may be called from
+ * multiple threads concurrently.
+ */
+class MS_LIB_EXPORT MiniscopeGroup
+{
+public:
+    explicit MiniscopeGroup();
+    ~MiniscopeGroup();
+
+    Miniscope *addScope();
+    std::vector<Miniscope*> scopes() const;
+    size_t count() const;
+
+    bool connect();
+    void disconnect();
+
+    bool run();
+    void stop();
+    bool startRecording();
+    void stopRecording();
+
+    bool isRunning() const;
+    bool isRecording() const;
+
+    std::chrono::time_point<std::chrono::steady_clock> captureStartTime() const;
+
+    std::vector<ScopeHealth> health() const;
+
+    /**
+     * @brief True if all scopes are running, and none of them has failed
+     */
+    bool healthy() const;
+
+    size_t droppedFramesCount() const;
+
+    /**
+     * @brief Largest difference between the last recorded frame times of all recording scopes
+     *
+     * This should stay within about one frame interval, larger values indicate that
+     * some Miniscope can not keep up.
+     */
+    milliseconds_t recordingTimeSpread() const;
+
+    QString lastError() const;
+
+private:
+    class Private;
+    Q_DISABLE_COPY(MiniscopeGroup)
+    std::unique_ptr<Private> d;
+};
+
+} // end of MiniScope namespace
+
+#endif // MINISCOPEGROUP_H
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "motioncorrection.h"
+
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
+
+using namespace MScope;
+
+MotionCorrector::MotionCorrector()
+    : m_downsample(2),
+      m_templateAlpha(0.05)
+{
+}
+
+void MotionCorrector::reset()
+{
+    m_template.release();
+}
+
+int MotionCorrector::downsampleFactor() const
+{
+    return m_downsample;
+}
+
+void MotionCorrector::setDownsampleFactor(int factor)
+{
+    if (factor < 1)
+        factor = 1;
+    if (factor != m_downsample)
+        reset();
+    m_downsample = factor;
+}
+
+cv::Rect MotionCorrector::region() const
+{
+    return m_region;
+}
+
+void MotionCorrector::setRegion(const cv::Rect &region)
+{
+    m_region = region;
+}
+
+double MotionCorrector::templateAlpha() const
+{
+    return m_templateAlpha;
+}
+
+void MotionCorrector::setTemplateAlpha(double alpha)
+{
+    m_templateAlpha = std::min(std::max(alpha, 0.0), 1.0);
+}
+
+cv::Point2d MotionCorrector::estimate(const cv::Mat &frame, double *response)
+{
+    auto region = cv::Rect(0, 0, frame.cols, frame.rows);
+    if (!m_region.empty() && !(m_region & region).empty())
+        region = m_region & region;
+    if (region != m_activeRegion) {
+        m_activeRegion = region;
+        reset();
+    }
+
+    // phase correlation only needs the coarse image structure, so shrink the frame
+    // first - this makes the FFTs a lot cheaper. Tiny regions are not shrunk as much.
+    const auto factor = std::max(1, std::min(m_downsample, std::min(region.width, region.height) / 16));
+    if (factor > 1)
+        cv::resize(frame(region), m_small, cv::Size(), 1.0 / factor, 1.0 / factor, cv::INTER_AREA);
+    else
+        m_small = frame(region);
+    m_small.convertTo(m_smallFloat, CV_32F);
+
+    if (m_template.empty() || m_template.size() != m_smallFloat.size()) {
+        // the first frame defines the reference position
+        m_smallFloat.copyTo(m_template);
+        cv::createHanningWindow(m_window, m_smallFloat.size(), CV_32F);
+        if (response != nullptr)
+            *response = 1;
+        return cv::Point2d(0, 0);
+    }
+
+    double peak = 0;
+    const auto shift = cv::phaseCorrelate(m_template, m_smallFloat, m_window, &peak);
+    if (response != nullptr)
+        *response = peak;
+
+    // move the frame back onto the template before blending it in, so the template
+    // stays sharp and at the reference position
+    const cv::Mat transform = (cv::Mat_<double>(2, 3) << 1, 0, -shift.x, 0, 1, -shift.y);
+    cv::warpAffine(m_smallFloat, m_registered, transform, m_smallFloat.size(),
+                   cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+    cv::accumulateWeighted(m_registered, m_template, m_templateAlpha);
+
+    return shift * static_cast<double>(factor);
+}
+
+void MotionCorrector::apply(const cv::Mat &src, cv::Mat &dst, const cv::Point2d &shift)
+{
+    const cv::Mat transform = (cv::Mat_<double>(2, 3) << 1, 0, -shift.x, 0, 1, -shift.y);
+    cv::warpAffine(src, dst, transform, src.size(), cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(0));
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef MOTIONCORRECTION_H
+#define MOTIONCORRECTION_H
+
+#include <opencv2/core.hpp>
+
+namespace MScope
+{
+
+/**
+ * @brief Online rigid motion correction
+ *
+ * Estimates the translation of each frame against a template image using FFT
+ * phase correlation. The template is initialized from the first frame and then
+ * slowly follows the registered frames, so it adapts to gradual changes in
+ * brightness and focus without drifting along with the motion.
+ *
+ * To keep the estimation fast enough for live use, it runs on a downsampled
+ * and optionally cropped copy of the frame. Phase correlation still finds
+ * shifts with sub-pixel precision, so downsampling by a factor of two costs
+ * very little accuracy on Miniscope images.
+ *
+ * The corrector is not thread-safe and must only be used by one thread.
+ */
+class MotionCorrector
+{
+public:
+    explicit MotionCorrector();
+
+    /**
+     * @brief Estimate the shift of a frame against the template, and update the template
+     *
+     * @param frame Single channel input frame.
+     * @param response Set to the height of the correlation peak, a measure of confidence between 0 and 1.
+     * @return The translation of the frame relative to the template, in full resolution pixels.
+     */
+    cv::Point2d estimate(const cv::Mat &frame, double *response = nullptr);
+
+    /**
+     * @brief Shift a frame back by a previously estimated translation
+     *
+     * @p dst is only reallocated if its size or type does not match @p src.
+     * Areas without image data are filled with black.
+     */
+    static void apply(const cv::Mat &src, cv::Mat &dst, const cv::Point2d &shift);
+
+    /**
+     * @brief Discard the template, the next frame starts a new one
+     */
+    void reset();
+
+    int downsampleFactor() const;
+    void setDownsampleFactor(int factor);
+
+    /**
+     * @brief Region of the full resolution frame used for estimation, empty for the whole frame
+     */
+    cv::Rect region() const;
+    void setRegion(const cv::Rect &region);
+
+    /**
+     * @brief Weight of each registered frame in the template
+     */
+    double templateAlpha() const;
+    void setTemplateAlpha(double alpha);
+
+private:
+    int m_downsample;
+    cv::Rect m_region;
+    double m_templateAlpha;
+
+    cv::Rect m_activeRegion;
+    cv::Mat m_small;
+    cv::Mat m_smallFloat;
+    cv::Mat m_registered;
+    cv::Mat m_template;
+    cv::Mat m_window;
+};
+
+} // end of MiniScope namespace
+
+#endif // MOTIONCORRECTION_H
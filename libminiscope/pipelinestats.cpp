@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pipelinestats.h"
+
+#include <cmath>
+#include <limits>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace MScope;
+
+static inline int highestBit(uint64_t value)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return static_cast<int>(index);
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+size_t LatencyHistogram::bucketIndex(uint64_t valueNsec)
+{
+    const uint64_t subBucketCount = 1 << SUB_BUCKET_BITS;
+    if (valueNsec < subBucketCount)
+        return static_cast<size_t>(valueNsec);
+
+    // clamp everything beyond our range into the last bucket
+    const uint64_t maxValue = (static_cast<uint64_t>(1) << (MAX_MAGNITUDE + 1)) - 1;
+    if (valueNsec > maxValue)
+        valueNsec = maxValue;
+
+    // the highest bit selects the power of two, the bits after it the linear sub-bucket
+    const auto magnitude = highestBit(valueNsec);
+    const auto subBucket = (valueNsec >> (magnitude - SUB_BUCKET_BITS)) & (subBucketCount - 1);
+    return (static_cast<size_t>(magnitude - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) + static_cast<size_t>(subBucket);
+}
+
+uint64_t LatencyHistogram::bucketValue(size_t index)
+{
+    const size_t subBucketCount = 1 << SUB_BUCKET_BITS;
+    if (index < subBucketCount)
+        return index;
+
+    // return the middle of the bucket's value range
+    const auto shift = static_cast<int>(index >> SUB_BUCKET_BITS) - 1;
+    const auto lowerBound = static_cast<uint64_t>(subBucketCount + (index & (subBucketCount - 1))) << shift;
+    return lowerBound + ((static_cast<uint64_t>(1) << shift) >> 1);
+}
+
+void LatencyHistogram::record(uint64_t valueNsec, uint64_t nowSec)
+{
+    // relaxed ordering is enough, readers only need each value to be consistent by itself
+    m_buckets[bucketIndex(valueNsec)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sumNsec.fetch_add(valueNsec, std::memory_order_relaxed);
+
+    // there is only one writer, so we don't need a CAS loop for the extremes
+    if (valueNsec < m_minNsec.load(std::memory_order_relaxed))
+        m_minNsec.store(valueNsec, std::memory_order_relaxed);
+    if (valueNsec > m_maxNsec.load(std::memory_order_relaxed))
+        m_maxNsec.store(valueNsec, std::memory_order_relaxed);
+
+    const auto slot = nowSec % RATE_SLOTS;
+    if (m_rateSec[slot].load(std::memory_order_relaxed) != nowSec) {
+        m_rateCount[slot].store(0, std::memory_order_relaxed);
+        m_rateSec[slot].store(nowSec, std::memory_order_relaxed);
+    }
+    m_rateCount[slot].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::reset()
+{
+    for (auto &bucket : m_buckets)
+        bucket.store(0, std::memory_order_relaxed);
+    m_count.store(0, std::memory_order_relaxed);
+    m_sumNsec.store(0, std::memory_order_relaxed);
+    m_minNsec.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+    m_maxNsec.store(0, std::memory_order_relaxed);
+    for (size_t i = 0; i < RATE_SLOTS; i++) {
+        m_rateSec[i].store(0, std::memory_order_relaxed);
+        m_rateCount[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+StageStatistics LatencyHistogram::snapshot(uint64_t nowSec) const
+{
+    StageStatistics stats;
+
+    std::vector<uint64_t> counts(BUCKET_COUNT);
+    uint64_t total = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; i++) {
+        counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0)
+        return stats;
+
+    const auto count = m_count.load(std::memory_order_relaxed);
+    stats.count = total;
+    stats.minUsec = m_minNsec.load(std::memory_order_relaxed) / 1000.0;
+    stats.maxUsec = m_maxNsec.load(std::memory_order_relaxed) / 1000.0;
+    stats.meanUsec = static_cast<double>(m_sumNsec.load(std::memory_order_relaxed)) / (count > 0? count : total) / 1000.0;
+
+    // walk the buckets once to find all percentiles
+    const std::array<double, 4> quantiles = {{0.5, 0.9, 0.99, 0.999}};
+    const std::array<double*, 4> results = {{&stats.p50Usec, &stats.p90Usec, &stats.p99Usec, &stats.p999Usec}};
+    size_t q = 0;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKET_COUNT && q < quantiles.size(); i++) {
+        seen += counts[i];
+        while (q < quantiles.size() && seen >= static_cast<uint64_t>(std::ceil(quantiles[q] * total))) {
+            *results[q] = bucketValue(i) / 1000.0;
+            q++;
+        }
+    }
+
+    // only use complete seconds for the rate, the current one is still being counted
+    uint64_t rateCount = 0;
+    for (size_t i = 0; i < RATE_SLOTS; i++) {
+        const auto sec = m_rateSec[i].load(std::memory_order_relaxed);
+        if (sec < nowSec && sec + RATE_WINDOW_SEC >= nowSec)
+            rateCount += m_rateCount[i].load(std::memory_order_relaxed);
+    }
+    stats.rate = static_cast<double>(rateCount) / RATE_WINDOW_SEC;
+
+    return stats;
+}
+
+PipelineStats::PipelineStats()
+{
+}
+
+QString PipelineStats::stageName(PipelineStage stage)
+{
+    switch (stage) {
+    case PipelineStage::GrabWait:
+        return QStringLiteral("Grab wait");
+    case PipelineStage::Retrieve:
+        return QStringLiteral("Retrieve");
+    case PipelineStage::Conversion:
+        return QStringLiteral("Conversion");
+    case PipelineStage::MotionCorrection:
+        return QStringLiteral("Motion correction");
+    case PipelineStage::RoiTraces:
+        return QStringLiteral("ROI traces");
+    case PipelineStage::FrameCallback:
+        return QStringLiteral("Frame callback");
+    case PipelineStage::Handoff:
+        return QStringLiteral("Queue hand-off");
+    case PipelineStage::Cycle:
+        return QStringLiteral("Acquisition cycle");
+    case PipelineStage::BackgroundModel:
+        return QStringLiteral("Background model");
+    case PipelineStage::DisplayMapping:
+        return QStringLiteral("Display mapping");
+    case PipelineStage::RecordHandoff:
+        return QStringLiteral("Encoder hand-off");
+    case PipelineStage::EncoderQueue:
+        return QStringLiteral("Encoder queue wait");
+    case PipelineStage::Encode:
+        return QStringLiteral("Encode");
+    case PipelineStage::Mux:
+        return QStringLiteral("Mux");
+    case PipelineStage::TimestampWrite:
+        return QStringLiteral("Timestamp write");
+    default:
+        return QStringLiteral("Unknown");
+    }
+}
+
+const char *PipelineStats::traceName(PipelineStage stage)
+{
+    switch (stage) {
+    case PipelineStage::GrabWait:
+        return "grab";
+    case PipelineStage::Retrieve:
+        return "retrieve";
+    case PipelineStage::Conversion:
+        return "conversion";
+    case PipelineStage::MotionCorrection:
+        return "motion correction";
+    case PipelineStage::RoiTraces:
+        return "roi traces";
+    case PipelineStage::FrameCallback:
+        return "frame callback";
+    case PipelineStage::Handoff:
+        return "hand-off";
+    case PipelineStage::Cycle:
+        return "acquisition cycle";
+    case PipelineStage::BackgroundModel:
+        return "background model";
+    case PipelineStage::DisplayMapping:
+        return "display mapping";
+    case PipelineStage::RecordHandoff:
+        return "encoder hand-off";
+    case PipelineStage::EncoderQueue:
+        return "encoder queue wait";
+    case PipelineStage::Encode:
+        return "encoder send";
+    case PipelineStage::Mux:
+        return "encoder receive";
+    case PipelineStage::TimestampWrite:
+        return "timestamp write";
+    default:
+        return "unknown";
+    }
+}
+
+std::vector<StageStatistics> PipelineStats::snapshot() const
+{
+    const auto nowSec = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(clock::now().time_since_epoch()).count());
+
+    std::vector<StageStatistics> result;
+    result.reserve(m_histograms.size());
+    for (size_t i = 0; i < m_histograms.size(); i++) {
+        auto stats = m_histograms[i].snapshot(nowSec);
+        stats.stage = static_cast<PipelineStage>(i);
+        stats.name = stageName(stats.stage);
+        result.push_back(stats);
+    }
+
+    return result;
+}
+
+void PipelineStats::reset()
+{
+    for (auto &histogram : m_histograms)
+        histogram.reset();
+}
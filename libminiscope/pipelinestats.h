@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef PIPELINESTATS_H
+#define PIPELINESTATS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "miniscope.h"
+#include "tracerecorder.h"
+
+namespace MScope
+{
+
+/**
+ * @brief Lock-free log-linear latency histogram
+ *
+ * Values are sorted into 32 linear sub-buckets per power of two, which keeps the
+ * relative error of any reported value below about 3% for the whole range
+ * from one nanosecond to about two minutes, while needing only a fixed, small
+ * amount of memory.
+ *
+ * One thread may record values while any other thread reads snapshots.
+ * Snapshots taken while values are recorded may be slightly inconsistent,
+ * which is fine for statistics.
+ */
+class LatencyHistogram
+{
+public:
+    explicit LatencyHistogram();
+
+    void record(uint64_t valueNsec, uint64_t nowSec);
+    void reset();
+    StageStatistics snapshot(uint64_t nowSec) const;
+
+    static size_t bucketIndex(uint64_t valueNsec);
+    static uint64_t bucketValue(size_t index);
+
+    static const int SUB_BUCKET_BITS = 5;
+    static const int MAX_MAGNITUDE = 36;
+    static const size_t BUCKET_COUNT = (MAX_MAGNITUDE - SUB_BUCKET_BITS + 2) << SUB_BUCKET_BITS;
+
+private:
+    // counts per second for the last few seconds, to calculate the current rate
+    static const size_t RATE_SLOTS = 8;
+    static const size_t RATE_WINDOW_SEC = 4;
+
+    std::array<std::atomic<uint64_t>, BUCKET_COUNT> m_buckets;
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sumNsec;
+    std::atomic<uint64_t> m_minNsec;
+    std::atomic<uint64_t> m_maxNsec;
+
+    std::array<std::atomic<uint64_t>, RATE_SLOTS> m_rateSec;
+    std::array<std::atomic<uint64_t>, RATE_SLOTS> m_rateCount;
+};
+
+/**
+ * @brief Latency statistics for all stages of the acquisition pipeline
+ *
+ * Every stage must only be recorded by a single thread.
+ */
+class PipelineStats
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit PipelineStats();
+
+    /**
+     * @brief Record the time a stage took, from @p start until now
+     *
+     * Returns the current time, so the next stage can be timed from there.
+     * If a trace buffer is given, the stage is added to the trace as well.
+     */
+    inline clock::time_point record(PipelineStage stage, const clock::time_point &start, TraceBuffer *trace = nullptr)
+    {
+        const auto now = clock::now();
+        const auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count();
+        const auto sec = std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
+        m_histograms[static_cast<size_t>(stage)].record(nsec > 0? static_cast<uint64_t>(nsec) : 0,
+                                                        static_cast<uint64_t>(sec));
+        if (trace != nullptr)
+            trace->complete(traceName(stage), start, now);
+        return now;
+    }
+
+    std::vector<StageStatistics> snapshot() const;
+    void reset();
+
+    static QString stageName(PipelineStage stage);
+    static const char *traceName(PipelineStage stage);
+
+private:
+    Q_DISABLE_COPY(PipelineStats)
+    std::array<LatencyHistogram, static_cast<size_t>(PipelineStage::Last)> m_histograms;
+};
+
+} // end of MiniScope namespace
+
+#endif // PIPELINESTATS_H
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "replaysource.h"
+
+#include <thread>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QTextStream>
+#include <QDebug>
+#include <opencv2/imgproc.hpp>
+
+#include "miniscope.h"
+
+using namespace MScope;
+
+ReplayFrameSource::ReplayFrameSource(const QString &fname, double speed, bool loop)
+    : m_fname(fname),
+      m_speed(speed),
+      m_loop(loop),
+      m_fps(30),
+      m_frameIndex(-1)
+{
+}
+
+ReplayFrameSource::~ReplayFrameSource()
+{
+    release();
+}
+
+QString ReplayFrameSource::name() const
+{
+    return QStringLiteral("Replay (%1)").arg(QFileInfo(m_fname).fileName());
+}
+
+bool ReplayFrameSource::loadTimestamps()
+{
+    m_timestamps.clear();
+
+    // VideoWriter stores timestamps next to the video, with the video's suffix
+    // replaced by "_timestamps.csv"
+    QFileInfo fi(m_fname);
+    const auto tsFname = fi.dir().filePath(fi.completeBaseName() + "_timestamps.csv");
+    QFile tsFile(tsFname);
+    if (!tsFile.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+
+    QTextStream in(&tsFile);
+    while (!in.atEnd()) {
+        const auto parts = in.readLine().split(';');
+        if (parts.size() < 2)
+            continue;
+        bool ok;
+        const auto ts = parts[1].trimmed().toLongLong(&ok);
+        if (!ok)
+            continue; // header or broken line
+        m_timestamps.push_back(ts);
+    }
+
+    return !m_timestamps.empty();
+}
+
+bool ReplayFrameSource::open(int, const cv::Size &)
+{
+    m_lastError.clear();
+    if (m_fname.isEmpty()) {
+        m_lastError = QStringLiteral("No video file to replay was set.");
+        return false;
+    }
+
+    if (!m_video.open(m_fname.toStdString())) {
+        m_lastError = QStringLiteral("Unable to open video file '%1' for replay.").arg(m_fname);
+        return false;
+    }
+
+    if (!loadTimestamps()) {
+        const auto videoFps = m_video.get(cv::CAP_PROP_FPS);
+        if (videoFps > 0)
+            m_fps = videoFps;
+        qCWarning(logMScope).noquote() << "No timestamps found for replay of" << m_fname
+                                       << "- assuming constant framerate of" << m_fps << "fps";
+    }
+
+    m_frameIndex = -1;
+    m_loopOffset = std::chrono::milliseconds(0);
+    m_timestamp = std::chrono::milliseconds(0);
+    m_startTime = std::chrono::steady_clock::now();
+    return true;
+}
+
+void ReplayFrameSource::release()
+{
+    m_video.release();
+}
+
+bool ReplayFrameSource::isOpened() const
+{
+    return m_video.isOpened();
+}
+
+void ReplayFrameSource::setFps(double)
+{
+    // we always replay with the recorded framerate
+}
+
+std::chrono::milliseconds ReplayFrameSource::recordedTimestamp(qint64 index) const
+{
+    if (m_timestamps.empty())
+        return std::chrono::milliseconds(static_cast<long>(index * 1000.0 / m_fps));
+
+    if (index < static_cast<qint64>(m_timestamps.size()))
+        return std::chrono::milliseconds(m_timestamps[index] - m_timestamps.front());
+
+    // we have more frames than timestamps, extrapolate
+    const auto lastIdx = static_cast<qint64>(m_timestamps.size()) - 1;
+    return std::chrono::milliseconds(m_timestamps.back() - m_timestamps.front())
+            + std::chrono::milliseconds(static_cast<long>((index - lastIdx) * 1000.0 / m_fps));
+}
+
+bool ReplayFrameSource::grab()
+{
+    if (!m_video.isOpened()) {
+        m_lastError = QStringLiteral("Replay video is not open.");
+        return false;
+    }
+
+    if (!m_video.grab()) {
+        if (!m_loop || m_frameIndex < 0) {
+            m_lastError = QStringLiteral("End of replayed video reached.");
+            return false;
+        }
+
+        // start over, continuing the timestamps where the last run ended
+        m_loopOffset += recordedTimestamp(m_frameIndex) + std::chrono::milliseconds(static_cast<long>(1000.0 / m_fps));
+        m_frameIndex = -1;
+        m_video.release();
+        if (!m_video.open(m_fname.toStdString()) || !m_video.grab()) {
+            m_lastError = QStringLiteral("Unable to restart replay of '%1'.").arg(m_fname);
+            return false;
+        }
+    }
+    m_frameIndex++;
+
+    const auto offset = m_loopOffset + recordedTimestamp(m_frameIndex);
+    if (m_speed > 0)
+        std::this_thread::sleep_until(m_startTime + std::chrono::microseconds(static_cast<long>(offset.count() * 1000.0 / m_speed)));
+
+    // driver timestamps must be positive, so we start at an arbitrary positive offset
+    m_timestamp = std::chrono::milliseconds(1000) + offset;
+    return true;
+}
+
+bool ReplayFrameSource::retrieve(cv::Mat &frame)
+{
+    if (!m_video.retrieve(m_rawFrame))
+        return false;
+
+    // our recordings are grayscale, so FFmpeg's BGR output has three identical
+    // channels and we can just take the first one instead of converting
+    if (m_rawFrame.channels() > 1)
+        cv::extractChannel(m_rawFrame, frame, 0);
+    else
+        m_rawFrame.copyTo(frame);
+    return true;
+}
+
+std::chrono::milliseconds ReplayFrameSource::frameTimestamp()
+{
+    return m_timestamp;
+}
+
+qint64 ReplayFrameSource::frameSequence()
+{
+    // position of the frame in the replayed file, which starts over when looping
+    return m_frameIndex;
+}
+
+bool ReplayFrameSource::sendControlBytes(double, double, double)
+{
+    return true;
+}
+
+bool ReplayFrameSource::setRecordingState(bool)
+{
+    return true;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REPLAYSOURCE_H
+#define REPLAYSOURCE_H
+
+#include <vector>
+#include "framesource.h"
+
+namespace MScope
+{
+
+/**
+ * @brief Replays a previously recorded Miniscope video
+ *
+ * Frames are read from a video file written by VideoWriter, and their
+ * timestamps from the accompanying "_timestamps.csv" file. Frames are
+ * delivered with their original spacing, optionally sped up by a constant
+ * factor. A speed of 0 delivers frames as fast as they can be decoded.
+ */
+class ReplayFrameSource : public FrameSource
+{
+public:
+    explicit ReplayFrameSource(const QString &fname, double speed, bool loop);
+    ~ReplayFrameSource() override;
+
+    QString name() const override;
+
+    bool open(int camId, const cv::Size &resolution) override;
+    void release() override;
+    bool isOpened() const override;
+
+    void setFps(double fps) override;
+
+    bool grab() override;
+    bool retrieve(cv::Mat &frame) override;
+    std::chrono::milliseconds frameTimestamp() override;
+    qint64 frameSequence() override;
+
+    bool sendControlBytes(double head, double middle, double tail) override;
+    bool setRecordingState(bool recording) override;
+
+private:
+    QString m_fname;
+    double m_speed;
+    bool m_loop;
+    double m_fps;
+
+    cv::VideoCapture m_video;
+    cv::Mat m_rawFrame;
+    std::vector<qint64> m_timestamps;
+    qint64 m_frameIndex;
+    std::chrono::milliseconds m_loopOffset;
+    std::chrono::milliseconds m_timestamp;
+    std::chrono::time_point<std::chrono::steady_clock> m_startTime;
+
+    bool loadTimestamps();
+    std::chrono::milliseconds recordedTimestamp(qint64 index) const;
+};
+
+} // end of MiniScope namespace
+
+#endif // REPLAYSOURCE_H
@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "roiengine.h"
+
+#include <algorithm>
+#include <limits>
+#include <QDebug>
+#include <opencv2/imgproc.hpp>
+
+#include "miniscope.h"
+
+using namespace MScope;
+
+// the neuropil ring of a ROI starts this many pixels outside of it, so light scattered
+// from the cell itself does not count as neuropil
+static const int NEUROPIL_INNER_RADIUS = 2;
+static const int NEUROPIL_OUTER_RADIUS = 12;
+
+RoiEngine::RoiEngine()
+    : m_neuropil(false),
+      m_neuropilFactor(0.7),
+      m_dirty(true),
+      m_stride(0)
+{
+}
+
+void RoiEngine::setRois(const std::vector<RoiDefinition> &rois)
+{
+    m_rois = rois;
+    m_dirty = true;
+}
+
+int RoiEngine::roiCount() const
+{
+    return static_cast<int>(m_rois.size());
+}
+
+void RoiEngine::setNeuropil(bool enabled, double factor)
+{
+    if (enabled == m_neuropil && factor == m_neuropilFactor)
+        return;
+    m_neuropil = enabled;
+    m_neuropilFactor = factor;
+    m_dirty = true;
+}
+
+cv::Rect RoiEngine::roiMask(const RoiDefinition &roi, const cv::Rect &frameRect, cv::Mat &weights) const
+{
+    if (!roi.polygon.empty()) {
+        if (roi.polygon.size() < 3)
+            return cv::Rect();
+        const auto box = cv::boundingRect(roi.polygon) & frameRect;
+        if (box.empty())
+            return cv::Rect();
+
+        std::vector<cv::Point> points;
+        points.reserve(roi.polygon.size());
+        for (const auto &p : roi.polygon)
+            points.push_back(p - box.tl());
+        cv::Mat filled = cv::Mat::zeros(box.size(), CV_8UC1);
+        cv::fillPoly(filled, std::vector<std::vector<cv::Point>>{points}, cv::Scalar(1));
+        filled.convertTo(weights, CV_32F);
+        return box;
+    }
+
+    if (roi.mask.size() != frameRect.size() || roi.mask.channels() != 1)
+        return cv::Rect();
+    const auto box = cv::boundingRect(roi.mask != 0);
+    if (box.empty())
+        return cv::Rect();
+    roi.mask(box).convertTo(weights, CV_32F);
+    return box;
+}
+
+void RoiEngine::compile(const cv::Mat &frame)
+{
+    m_size = frame.size();
+    m_stride = frame.step1();
+    m_dirty = false;
+    m_offsets.clear();
+    m_indices.clear();
+    m_weights.clear();
+
+    const auto frameRect = cv::Rect(cv::Point(0, 0), m_size);
+    std::vector<cv::Mat> weights(m_rois.size());
+    std::vector<cv::Rect> boxes(m_rois.size());
+    for (size_t i = 0; i < m_rois.size(); i++) {
+        boxes[i] = roiMask(m_rois[i], frameRect, weights[i]);
+        if (boxes[i].empty())
+            qCWarning(logMScope).noquote() << "ROI" << i << "does not contain any pixels of the frame, its trace will be empty.";
+    }
+
+    // neuropil must not include any pixels that belong to a ROI
+    cv::Mat roiPixels;
+    if (m_neuropil) {
+        roiPixels = cv::Mat::zeros(m_size, CV_8UC1);
+        for (size_t i = 0; i < m_rois.size(); i++) {
+            if (!boxes[i].empty())
+                roiPixels(boxes[i]).setTo(255, weights[i] != 0);
+        }
+    }
+    const auto innerKernel = cv::getStructuringElement(cv::MORPH_ELLIPSE,
+                                                       cv::Size(2 * NEUROPIL_INNER_RADIUS + 1, 2 * NEUROPIL_INNER_RADIUS + 1));
+    const auto outerKernel = cv::getStructuringElement(cv::MORPH_ELLIPSE,
+                                                       cv::Size(2 * NEUROPIL_OUTER_RADIUS + 1, 2 * NEUROPIL_OUTER_RADIUS + 1));
+
+    for (size_t i = 0; i < m_rois.size(); i++) {
+        const auto start = m_weights.size();
+        m_offsets.push_back(static_cast<uint32_t>(start));
+        const auto &box = boxes[i];
+        if (box.empty())
+            continue;
+
+        double weightSum = 0;
+        for (int y = 0; y < box.height; y++) {
+            const auto row = weights[i].ptr<float>(y);
+            for (int x = 0; x < box.width; x++) {
+                if (row[x] == 0)
+                    continue;
+                m_indices.push_back(static_cast<uint32_t>(static_cast<size_t>(box.y + y) * m_stride + static_cast<size_t>(box.x + x)));
+                m_weights.push_back(row[x]);
+                weightSum += static_cast<double>(row[x]);
+            }
+        }
+        if (weightSum == 0) {
+            m_indices.resize(start);
+            m_weights.resize(start);
+            continue;
+        }
+
+        // normalize, so the weighted sum is the weighted mean
+        for (auto j = start; j < m_weights.size(); j++)
+            m_weights[j] = static_cast<float>(m_weights[j] / weightSum);
+
+        if (!m_neuropil)
+            continue;
+
+        const auto area = cv::Rect(box.x - NEUROPIL_OUTER_RADIUS,
+                                   box.y - NEUROPIL_OUTER_RADIUS,
+                                   box.width + 2 * NEUROPIL_OUTER_RADIUS,
+                                   box.height + 2 * NEUROPIL_OUTER_RADIUS) & frameRect;
+        cv::Mat member = cv::Mat::zeros(area.size(), CV_8UC1);
+        member(box - area.tl()).setTo(255, weights[i] != 0);
+
+        cv::Mat outer, inner;
+        cv::dilate(member, outer, outerKernel);
+        cv::dilate(member, inner, innerKernel);
+        const cv::Mat ring = outer & ~inner & ~roiPixels(area);
+        const auto ringCount = cv::countNonZero(ring);
+        if (ringCount == 0)
+            continue;
+
+        const auto ringWeight = static_cast<float>(-m_neuropilFactor / ringCount);
+        for (int y = 0; y < area.height; y++) {
+            const auto row = ring.ptr<uchar>(y);
+            for (int x = 0; x < area.width; x++) {
+                if (row[x] == 0)
+                    continue;
+                m_indices.push_back(static_cast<uint32_t>(static_cast<size_t>(area.y + y) * m_stride + static_cast<size_t>(area.x + x)));
+                m_weights.push_back(ringWeight);
+            }
+        }
+    }
+    m_offsets.push_back(static_cast<uint32_t>(m_weights.size()));
+}
+
+template<typename T>
+static void extractTraces(const T *data, const uint32_t *offsets, const uint32_t *indices, const float *weights,
+                          size_t roiCount, float *values)
+{
+    for (size_t i = 0; i < roiCount; i++) {
+        auto j = offsets[i];
+        const auto end = offsets[i + 1];
+        if (j == end) {
+            values[i] = std::numeric_limits<float>::quiet_NaN();
+            continue;
+        }
+
+        // independent partial sums, so the additions do not have to wait for each other
+        float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        for (; j + 4 <= end; j += 4) {
+            s0 += weights[j] * data[indices[j]];
+            s1 += weights[j + 1] * data[indices[j + 1]];
+            s2 += weights[j + 2] * data[indices[j + 2]];
+            s3 += weights[j + 3] * data[indices[j + 3]];
+        }
+        for (; j < end; j++)
+            s0 += weights[j] * data[indices[j]];
+        values[i] = (s0 + s1) + (s2 + s3);
+    }
+}
+
+void RoiEngine::process(const cv::Mat &frame, std::vector<float> &values)
+{
+    values.resize(m_rois.size());
+    if (m_rois.empty())
+        return;
+    if (frame.empty() || frame.channels() != 1 || (frame.depth() != CV_8U && frame.depth() != CV_16U)) {
+        std::fill(values.begin(), values.end(), std::numeric_limits<float>::quiet_NaN());
+        return;
+    }
+
+    if (m_dirty || frame.size() != m_size || frame.step1() != m_stride)
+        compile(frame);
+
+    if (frame.depth() == CV_8U)
+        extractTraces(frame.ptr<uint8_t>(), m_offsets.data(), m_indices.data(), m_weights.data(), m_rois.size(), values.data());
+    else
+        extractTraces(frame.ptr<uint16_t>(), m_offsets.data(), m_indices.data(), m_weights.data(), m_rois.size(), values.data());
+}
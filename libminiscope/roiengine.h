@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef ROIENGINE_H
+#define ROIENGINE_H
+
+#include <vector>
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+namespace MScope
+{
+
+/**
+ * @brief A region of interest, as registered by the user
+ *
+ * Either a weight mask with the size of the frame (any non-zero pixel belongs to
+ * the ROI), or a polygon in frame coordinates.
+ */
+struct RoiDefinition
+{
+    cv::Mat mask;
+    std::vector<cv::Point> polygon;
+};
+
+/**
+ * @brief Extracts the mean fluorescence of many ROIs from every frame
+ *
+ * The ROIs are compiled into one flat list of pixel offsets and weights
+ * per ROI, with the weights already normalized to the ROI size. Extracting
+ * all traces is then a single sweep over these lists, which only touches
+ * the pixels that belong to any ROI.
+ *
+ * With neuropil subtraction, every ROI also gets a ring of surrounding pixels
+ * that do not belong to any ROI. Their mean, multiplied by the neuropil
+ * factor, is subtracted from the ROI mean. The ring pixels simply get negative
+ * weights in the same list, so this costs no extra pass.
+ *
+ * The ROIs are compiled for the size and row stride of the frames they are used
+ * with, and recompiled automatically when either changes.
+ * The engine is not thread-safe and must only be used by one thread.
+ */
+class RoiEngine
+{
+public:
+    explicit RoiEngine();
+
+    void setRois(const std::vector<RoiDefinition> &rois);
+    int roiCount() const;
+
+    void setNeuropil(bool enabled, double factor);
+
+    /**
+     * @brief Calculate the fluorescence of all ROIs in a frame
+     *
+     * @p values is resized to the number of ROIs. ROIs without any pixels
+     * in the frame get a value of NaN.
+     */
+    void process(const cv::Mat &frame, std::vector<float> &values);
+
+private:
+    std::vector<RoiDefinition> m_rois;
+    bool m_neuropil;
+    double m_neuropilFactor;
+    bool m_dirty;
+
+    cv::Size m_size;
+    size_t m_stride;
+    std::vector<uint32_t> m_offsets;
+    std::vector<uint32_t> m_indices;
+    std::vector<float> m_weights;
+
+    void compile(const cv::Mat &frame);
+    cv::Rect roiMask(const RoiDefinition &roi, const cv::Rect &frameRect, cv::Mat &weights) const;
+};
+
+} // end of MiniScope namespace
+
+#endif // ROIENGINE_H
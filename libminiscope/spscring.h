@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+namespace MScope
+{
+
+/**
+ * @brief Bounded lock-free single-producer/single-consumer ring buffer
+ *
+ * Exactly one thread may call push(), and exactly one (other) thread may call pop().
+ * Neither of them ever blocks: push() fails if the ring is full and pop() fails if
+ * it is empty, and the caller decides what to do about that (drop, retry, fail...).
+ * The capacity is rounded up to the next power of two.
+ */
+template<typename T>
+class SPSCRing
+{
+public:
+    /**
+     * @brief Create a ring, with every slot initialized as a copy of prototype
+     *
+     * A prototype owning preallocated memory (e.g. a sized vector) together with
+     * popCopy() lets push() reuse that memory instead of allocating.
+     */
+    explicit SPSCRing(size_t capacity, const T &prototype = T())
+        : m_head(0),
+          m_tail(0)
+    {
+        size_t realCapacity = 2;
+        while (realCapacity < capacity)
+            realCapacity <<= 1;
+        m_buffer.resize(realCapacity, prototype);
+        m_mask = realCapacity - 1;
+    }
+
+    /**
+     * @brief Add an element to the ring (producer thread only)
+     * @return false if the ring was full and the element was not added.
+     */
+    bool push(const T &item)
+    {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) > m_mask)
+            return false;
+
+        m_buffer[head & m_mask] = item;
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Take the oldest element from the ring (consumer thread only)
+     * @return false if the ring was empty.
+     */
+    bool pop(T &item)
+    {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire))
+            return false;
+
+        auto &slot = m_buffer[tail & m_mask];
+        item = std::move(slot);
+        slot = T(); // don't keep references to shared data (e.g. frame buffers) alive in the ring
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Copy the oldest element out of the ring and drop it (consumer thread only)
+     *
+     * Unlike pop(), the slot keeps its contents, so memory owned by the element stays
+     * allocated for the next push(). Only use this for elements which don't reference
+     * shared data.
+     * @return false if the ring was empty.
+     */
+    bool popCopy(T &item)
+    {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire))
+            return false;
+
+        item = m_buffer[tail & m_mask];
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const
+    {
+        return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+    /**
+     * @brief Drop all elements, must only be called while no producer or consumer is active
+     */
+    void reset()
+    {
+        for (auto &slot : m_buffer)
+            slot = T();
+        m_head = 0;
+        m_tail = 0;
+    }
+
+private:
+    std::vector<T> m_buffer;
+    size_t m_mask;
+
+    // keep producer and consumer indices on separate cache lines
+    alignas(64) std::atomic<size_t> m_head;
+    alignas(64) std::atomic<size_t> m_tail;
+};
+
+} // end of MiniScope namespace
+
+#endif // SPSCRING_H
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "syntheticsource.h"
+
+#include <cmath>
+#include <thread>
+#include <opencv2/imgproc.hpp>
+
+using namespace MScope;
+
+SyntheticFrameSource::SyntheticFrameSource(const SyntheticSourceSettings &settings)
+    : m_settings(settings),
+      m_opened(false),
+      m_fps(30),
+      m_frameIndex(0)
+{
+}
+
+QString SyntheticFrameSource::name() const
+{
+    return QStringLiteral("Synthetic");
+}
+
+bool SyntheticFrameSource::open(int, const cv::Size &resolution)
+{
+    m_size = resolution;
+    if (m_size.width <= 0 || m_size.height <= 0)
+        m_size = cv::Size(752, 480);
+
+    auto seed = m_settings.seed;
+    if (seed == 0)
+        seed = std::random_device()();
+    m_gen.seed(seed);
+    m_rng = cv::RNG(seed);
+
+    // background with a vignette, similar to what the GRIN lens produces
+    m_background.create(m_size, CV_32FC1);
+    const auto cx = m_size.width / 2.0;
+    const auto cy = m_size.height / 2.0;
+    const auto maxDist2 = cx * cx + cy * cy;
+    for (int y = 0; y < m_size.height; y++) {
+        auto row = m_background.ptr<float>(y);
+        for (int x = 0; x < m_size.width; x++) {
+            const auto dist2 = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+            row[x] = static_cast<float>(m_settings.baseFluorescence * (1.0 - 0.6 * dist2 / maxDist2));
+        }
+    }
+
+    // place cells with a gaussian footprint at random positions
+    m_cells.clear();
+    std::uniform_int_distribution<int> radiusDist(4, 9);
+    for (int i = 0; i < m_settings.cellCount; i++) {
+        const auto radius = radiusDist(m_gen);
+        const auto diameter = radius * 2 + 1;
+        if (m_size.width <= diameter || m_size.height <= diameter)
+            break;
+        std::uniform_int_distribution<int> xDist(0, m_size.width - diameter - 1);
+        std::uniform_int_distribution<int> yDist(0, m_size.height - diameter - 1);
+
+        SimCell cell;
+        cell.rect = cv::Rect(xDist(m_gen), yDist(m_gen), diameter, diameter);
+        cell.activity = 0;
+
+        const auto kernel = cv::getGaussianKernel(diameter, radius / 2.0, CV_32F);
+        cell.footprint = kernel * kernel.t();
+        cell.footprint /= cell.footprint.at<float>(radius, radius);
+        m_cells.push_back(cell);
+    }
+
+    m_canvas.create(m_size, CV_32FC1);
+    m_noise.create(m_size, CV_32FC1);
+
+    m_frameIndex = -1;
+    m_startTime = std::chrono::steady_clock::now();
+    // driver timestamps must be positive, so we start at an arbitrary positive offset
+    m_startTimestamp = std::chrono::milliseconds(1000);
+    m_timestamp = m_startTimestamp;
+
+    m_lastError.clear();
+    m_opened = true;
+    return true;
+}
+
+void SyntheticFrameSource::release()
+{
+    m_opened = false;
+    m_cells.clear();
+}
+
+bool SyntheticFrameSource::isOpened() const
+{
+    return m_opened;
+}
+
+void SyntheticFrameSource::setFps(double fps)
+{
+    if (fps > 0)
+        m_fps = fps;
+}
+
+bool SyntheticFrameSource::grab()
+{
+    if (!m_opened) {
+        m_lastError = QStringLiteral("Synthetic frame source is not open.");
+        return false;
+    }
+
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+
+    m_frameIndex++;
+    // an injected drop means the frame never reaches us, so the next
+    // frame arrives one frame period later
+    if (m_settings.dropRate > 0 && chance(m_gen) < m_settings.dropRate)
+        m_frameIndex++;
+
+    const auto framePeriodUs = 1000.0 * 1000.0 / m_fps;
+    const auto frameTimeUs = static_cast<long>(m_frameIndex * framePeriodUs);
+    if (m_settings.realtime)
+        std::this_thread::sleep_until(m_startTime + std::chrono::microseconds(frameTimeUs));
+
+    m_timestamp = m_startTimestamp + std::chrono::milliseconds(frameTimeUs / 1000);
+    if (m_settings.timestampGlitchRate > 0 && chance(m_gen) < m_settings.timestampGlitchRate) {
+        // shift the timestamp by up to three frame periods in either direction
+        std::uniform_real_distribution<double> glitch(-3.0, 3.0);
+        m_timestamp += std::chrono::milliseconds(static_cast<long>(glitch(m_gen) * framePeriodUs / 1000.0));
+    }
+
+    return true;
+}
+
+bool SyntheticFrameSource::retrieve(cv::Mat &frame)
+{
+    if (!m_opened)
+        return false;
+
+    const auto dt = 1.0 / m_fps;
+    const auto decay = std::exp(-dt / 0.4); // GCaMP-like decay time
+    const auto spikeChance = m_settings.activityRate * dt;
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+
+    m_background.copyTo(m_canvas);
+    for (auto &cell : m_cells) {
+        cell.activity *= decay;
+        if (chance(m_gen) < spikeChance)
+            cell.activity += 1.0;
+        if (cell.activity < 0.01)
+            continue;
+
+        auto roi = m_canvas(cell.rect);
+        cv::scaleAdd(cell.footprint, cell.activity * m_settings.baseFluorescence, roi, roi);
+    }
+
+    if (m_settings.noiseLevel > 0) {
+        m_rng.fill(m_noise, cv::RNG::NORMAL, 0, m_settings.noiseLevel);
+        m_canvas += m_noise;
+    }
+
+    m_canvas.convertTo(frame, CV_8U);
+    return true;
+}
+
+std::chrono::milliseconds SyntheticFrameSource::frameTimestamp()
+{
+    return m_timestamp;
+}
+
+qint64 SyntheticFrameSource::frameSequence()
+{
+    // injected drops skip an index, so they show up as gaps just like real device drops
+    return m_frameIndex;
+}
+
+bool SyntheticFrameSource::sendControlBytes(double, double, double)
+{
+    return m_opened;
+}
+
+bool SyntheticFrameSource::setRecordingState(bool)
+{
+    return m_opened;
+}
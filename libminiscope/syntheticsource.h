@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYNTHETICSOURCE_H
+#define SYNTHETICSOURCE_H
+
+#include <vector>
+#include <random>
+#include "framesource.h"
+#include "miniscope.h"
+
+namespace MScope
+{
+
+/**
+ * @brief Generates artificial Miniscope frames
+ *
+ * Frames consist of a vignetted background with a set of simulated
+ * cells that exhibit calcium transients, plus gaussian sensor noise.
+ * Dropped frames and timestamp glitches can be injected at a configurable
+ * rate. All randomness is derived from a single seed, so runs with the
+ * same seed produce the same frames and the same timestamp sequence.
+ */
+class SyntheticFrameSource : public FrameSource
+{
+public:
+    explicit SyntheticFrameSource(const SyntheticSourceSettings &settings);
+
+    QString name() const override;
+
+    bool open(int camId, const cv::Size &resolution) override;
+    void release() override;
+    bool isOpened() const override;
+
+    void setFps(double fps) override;
+
+    bool grab() override;
+    bool retrieve(cv::Mat &frame) override;
+    std::chrono::milliseconds frameTimestamp() override;
+    qint64 frameSequence() override;
+
+    bool sendControlBytes(double head, double middle, double tail) override;
+    bool setRecordingState(bool recording) override;
+
+private:
+    struct SimCell {
+        cv::Rect rect;
+        cv::Mat footprint;
+        double activity;
+    };
+
+    SyntheticSourceSettings m_settings;
+    bool m_opened;
+    cv::Size m_size;
+    double m_fps;
+
+    std::mt19937 m_gen;
+    cv::RNG m_rng;
+
+    cv::Mat m_background;
+    cv::Mat m_canvas;
+    cv::Mat m_noise;
+    std::vector<SimCell> m_cells;
+
+    qint64 m_frameIndex;
+    std::chrono::milliseconds m_startTimestamp;
+    std::chrono::time_point<std::chrono::steady_clock> m_startTime;
+    std::chrono::milliseconds m_timestamp;
+};
+
+} // end of MiniScope namespace
+
+#endif // SYNTHETICSOURCE_H
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "threadsched.h"
+
+#include <QString>
+#include <QStringList>
+#include <algorithm>
+#include <cstring>
+
+#ifdef Q_OS_LINUX
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+namespace MScope
+{
+
+std::string threadRoleToString(ThreadRole role)
+{
+    switch (role) {
+    case ThreadRole::Acquisition:
+        return "acquisition";
+    case ThreadRole::Display:
+        return "display";
+    case ThreadRole::Recording:
+        return "recording";
+    case ThreadRole::Control:
+        return "control";
+    case ThreadRole::Encoder:
+        return "encoder";
+    default:
+        return "unknown";
+    }
+}
+
+#ifdef Q_OS_LINUX
+bool applyThreadScheduling(const ThreadScheduling &sched, QString *error)
+{
+    QStringList errors;
+
+    if (sched.policy != SchedulingPolicy::Default) {
+        const int policy = (sched.policy == SchedulingPolicy::Fifo)? SCHED_FIFO : SCHED_RR;
+        sched_param param;
+        std::memset(&param, 0, sizeof(param));
+        param.sched_priority = std::max(sched_get_priority_min(policy),
+                                        std::min(sched.priority, sched_get_priority_max(policy)));
+        const auto ret = pthread_setschedparam(pthread_self(), policy, &param);
+        if (ret != 0)
+            errors.append(QStringLiteral("Unable to set real-time priority %1: %2").arg(param.sched_priority).arg(std::strerror(ret)));
+    }
+
+    if (sched.niceLevel != 0) {
+        // on Linux, the nice level is a per-thread attribute
+        const auto tid = static_cast<id_t>(syscall(SYS_gettid));
+        if (setpriority(PRIO_PROCESS, tid, sched.niceLevel) != 0)
+            errors.append(QStringLiteral("Unable to set nice level %1: %2").arg(sched.niceLevel).arg(std::strerror(errno)));
+    }
+
+    if (!sched.cpus.empty()) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        for (const auto cpu : sched.cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE)
+                CPU_SET(static_cast<size_t>(cpu), &cpuSet);
+        }
+        const auto ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if (ret != 0)
+            errors.append(QStringLiteral("Unable to set CPU affinity: %1").arg(std::strerror(ret)));
+    }
+
+    if (errors.isEmpty())
+        return true;
+    if (error != nullptr)
+        *error = errors.join(QStringLiteral("; "));
+    return false;
+}
+#elif defined(Q_OS_WIN)
+bool applyThreadScheduling(const ThreadScheduling &sched, QString *error)
+{
+    QStringList errors;
+    const auto thread = GetCurrentThread();
+
+    // Windows has no equivalent of the POSIX policies, so we map our settings
+    // to the closest thread priority
+    int winPriority = THREAD_PRIORITY_NORMAL;
+    if (sched.policy != SchedulingPolicy::Default)
+        winPriority = (sched.priority >= 50)? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_HIGHEST;
+    else if (sched.niceLevel < 0)
+        winPriority = THREAD_PRIORITY_ABOVE_NORMAL;
+    else if (sched.niceLevel > 0)
+        winPriority = THREAD_PRIORITY_BELOW_NORMAL;
+    if (winPriority != THREAD_PRIORITY_NORMAL) {
+        if (!SetThreadPriority(thread, winPriority))
+            errors.append(QStringLiteral("Unable to set thread priority (error %1)").arg(GetLastError()));
+    }
+
+    if (!sched.cpus.empty()) {
+        DWORD_PTR mask = 0;
+        for (const auto cpu : sched.cpus) {
+            if (cpu >= 0 && cpu < static_cast<int>(sizeof(DWORD_PTR) * 8))
+                mask |= static_cast<DWORD_PTR>(1) << cpu;
+        }
+        if (SetThreadAffinityMask(thread, mask) == 0)
+            errors.append(QStringLiteral("Unable to set CPU affinity (error %1)").arg(GetLastError()));
+    }
+
+    if (errors.isEmpty())
+        return true;
+    if (error != nullptr)
+        *error = errors.join(QStringLiteral("; "));
+    return false;
+}
+#else
+bool applyThreadScheduling(const ThreadScheduling &sched, QString *error)
+{
+    if (sched.isDefault())
+        return true;
+    if (error != nullptr)
+        *error = QStringLiteral("Thread scheduling settings are not supported on this platform.");
+    return false;
+}
+#endif
+
+} // end of MiniScope namespace
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef THREADSCHED_H
+#define THREADSCHED_H
+
+#include <string>
+#include <vector>
+
+#include "msexport.h"
+
+class QString;
+
+namespace MScope
+{
+
+/**
+ * @brief The threads a Miniscope uses
+ */
+enum class ThreadRole {
+    Acquisition, /// grabs frames from the device
+    Display,     /// processes frames for display
+    Recording,   /// passes frames on to the video writer
+    Control,     /// sends control commands to the device
+    Encoder,     /// encodes and writes video files
+    Last
+};
+
+MS_LIB_EXPORT std::string threadRoleToString(ThreadRole role);
+
+/**
+ * @brief Scheduling policy for a thread
+ */
+enum class SchedulingPolicy {
+    Default,   /// the regular time-sharing scheduler
+    Fifo,      /// real-time, first in first out (SCHED_FIFO)
+    RoundRobin /// real-time, round-robin (SCHED_RR)
+};
+
+/**
+ * @brief Scheduling settings for a thread
+ *
+ * Real-time policies and negative nice levels usually need extra privileges
+ * (CAP_SYS_NICE or a matching RLIMIT_RTPRIO / RLIMIT_NICE on Linux). If a setting
+ * can not be applied, the thread keeps running with its default for that setting.
+ */
+class ThreadScheduling
+{
+public:
+    explicit ThreadScheduling()
+        : policy(SchedulingPolicy::Default),
+          priority(0),
+          niceLevel(0)
+    {}
+
+    SchedulingPolicy policy;
+    int priority;         /// real-time priority, only used with real-time policies
+    int niceLevel;        /// nice level, only used with the default policy
+    std::vector<int> cpus; /// CPUs the thread may run on, empty for all
+
+    bool isDefault() const
+    {
+        return policy == SchedulingPolicy::Default && niceLevel == 0 && cpus.empty();
+    }
+};
+
+/**
+ * @brief Apply scheduling settings to the calling thread
+ *
+ * All settings are applied independently, so a failure to set e.g. a real-time
+ * policy does not prevent the CPU affinity from being set.
+ * Returns false and sets an error message if any setting could not be applied.
+ */
+MS_LIB_EXPORT bool applyThreadScheduling(const ThreadScheduling &sched, QString *error);
+
+} // end of MiniScope namespace
+
+#endif // THREADSCHED_H
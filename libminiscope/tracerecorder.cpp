@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "tracerecorder.h"
+
+#include <cstdio>
+#include <iostream>
+
+using namespace MScope;
+
+// how often buffered events are written out
+static const auto TRACE_WRITE_INTERVAL = std::chrono::milliseconds(100);
+
+// events each thread may buffer between writes
+static const size_t TRACE_BUFFER_CAPACITY = 16384;
+
+TraceBuffer::TraceBuffer(const QString &threadName, int tid, size_t capacity)
+    : m_threadName(threadName),
+      m_tid(tid),
+      m_ring(capacity),
+      m_droppedCount(0)
+{
+}
+
+QString TraceBuffer::threadName() const
+{
+    return m_threadName;
+}
+
+int TraceBuffer::tid() const
+{
+    return m_tid;
+}
+
+size_t TraceBuffer::droppedCount() const
+{
+    return m_droppedCount.load(std::memory_order_relaxed);
+}
+
+TraceRecorder::TraceRecorder()
+    : m_firstEvent(true),
+      m_originNsec(0),
+      m_active(false)
+{
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    stop();
+}
+
+bool TraceRecorder::start(const QString &fname, QString *error)
+{
+    stop();
+
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    m_buffers.clear();
+    m_file.clear();
+    m_file.open(fname.toStdString(), std::ios::out | std::ios::trunc);
+    if (!m_file.is_open()) {
+        if (error != nullptr)
+            *error = QStringLiteral("Unable to open trace file '%1' for writing.").arg(fname);
+        return false;
+    }
+
+    // the JSON array format doesn't require the closing bracket, so the trace
+    // is still readable if we are killed while recording
+    m_file << "[\n";
+    m_firstEvent = true;
+    m_originNsec = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    m_active = true;
+    m_thread.reset(new std::thread(writerThread, this));
+    return true;
+}
+
+void TraceRecorder::stop()
+{
+    if (!m_active)
+        return;
+    m_active = false;
+    if (m_thread) {
+        m_thread->join();
+        m_thread.reset();
+    }
+
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    writeEvents();
+    for (const auto &buffer : m_buffers) {
+        if (buffer->droppedCount() > 0)
+            std::cerr << "Trace buffer of " << buffer->threadName().toStdString() << " thread overflowed, "
+                      << buffer->droppedCount() << " events were lost." << std::endl;
+    }
+    m_file << "\n]\n";
+    m_file.close();
+}
+
+bool TraceRecorder::isActive() const
+{
+    return m_active;
+}
+
+TraceBuffer *TraceRecorder::registerThread(const QString &name)
+{
+    if (!m_active)
+        return nullptr;
+
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    const auto tid = static_cast<int>(m_buffers.size()) + 1;
+    m_buffers.push_back(std::unique_ptr<TraceBuffer>(new TraceBuffer(name, tid, TRACE_BUFFER_CAPACITY)));
+
+    // name the thread in the trace viewer
+    auto threadName = name;
+    threadName.replace(QLatin1Char('"'), QLatin1Char('\''));
+    writeEntry(QStringLiteral("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%1,\"args\":{\"name\":\"%2\"}}")
+               .arg(tid).arg(threadName).toStdString());
+
+    return m_buffers.back().get();
+}
+
+void TraceRecorder::writerThread(TraceRecorder *self)
+{
+    while (self->m_active) {
+        std::this_thread::sleep_for(TRACE_WRITE_INTERVAL);
+        const std::lock_guard<std::mutex> lock(self->m_mutex);
+        self->writeEvents();
+    }
+}
+
+void TraceRecorder::writeEntry(const std::string &json)
+{
+    if (!m_firstEvent)
+        m_file << ",\n";
+    m_file << json;
+    m_firstEvent = false;
+}
+
+void TraceRecorder::writeEvents()
+{
+    char line[256];
+    TraceEvent ev;
+    for (const auto &buffer : m_buffers) {
+        while (buffer->m_ring.pop(ev)) {
+            const auto tsUsec = (ev.timeNsec - m_originNsec) / 1000.0;
+            switch (ev.phase) {
+            case 'X':
+                std::snprintf(line, sizeof(line),
+                              "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+                              ev.name, tsUsec, ev.value / 1000.0, buffer->m_tid);
+                break;
+            case 'C':
+                std::snprintf(line, sizeof(line),
+                              "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"value\":%lld}}",
+                              ev.name, tsUsec, buffer->m_tid, static_cast<long long>(ev.value));
+                break;
+            default:
+                std::snprintf(line, sizeof(line),
+                              "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+                              ev.name, tsUsec, buffer->m_tid);
+            }
+            writeEntry(line);
+        }
+    }
+    m_file.flush();
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TRACERECORDER_H
+#define TRACERECORDER_H
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <QString>
+
+#include "spscring.h"
+
+namespace MScope
+{
+
+/**
+ * @brief A single trace event, as it is stored until it is written out
+ */
+struct TraceEvent
+{
+    const char *name;  /// must be a string literal, we only store the pointer
+    char phase;        /// 'X' for complete events, 'C' for counters and 'i' for instant events
+    int64_t timeNsec;  /// steady clock time
+    int64_t value;     /// duration in nanoseconds for complete events, the value for counters
+};
+
+/**
+ * @brief Trace events of a single thread
+ *
+ * Adding events never blocks and never allocates memory. If the buffer is full
+ * because the events were not written out quickly enough, new events are dropped.
+ */
+class TraceBuffer
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit TraceBuffer(const QString &threadName, int tid, size_t capacity);
+
+    inline void complete(const char *name, const clock::time_point &start, const clock::time_point &end)
+    {
+        add({name, 'X', toNsec(start), std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()});
+    }
+
+    inline void counter(const char *name, int64_t value)
+    {
+        add({name, 'C', toNsec(clock::now()), value});
+    }
+
+    inline void instant(const char *name)
+    {
+        add({name, 'i', toNsec(clock::now()), 0});
+    }
+
+    QString threadName() const;
+    int tid() const;
+    size_t droppedCount() const;
+
+private:
+    friend class TraceRecorder;
+
+    QString m_threadName;
+    int m_tid;
+    SPSCRing<TraceEvent> m_ring;
+    std::atomic<size_t> m_droppedCount;
+
+    static inline int64_t toNsec(const clock::time_point &time)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    }
+
+    inline void add(const TraceEvent &event)
+    {
+        if (!m_ring.push(event))
+            m_droppedCount.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+/**
+ * @brief Records events of the acquisition pipeline in the Chrome trace event format
+ *
+ * Every thread registers its own buffer, which is drained by a separate writer
+ * thread every few milliseconds, so recording events is cheap enough to keep
+ * tracing enabled during real experiments.
+ * The resulting file can be loaded in chrome://tracing or Perfetto.
+ */
+class TraceRecorder
+{
+public:
+    explicit TraceRecorder();
+    ~TraceRecorder();
+
+    bool start(const QString &fname, QString *error);
+    void stop();
+    bool isActive() const;
+
+    /**
+     * @brief Create an event buffer for the calling thread
+     *
+     * Returns nullptr if tracing is not active. The buffer stays valid until
+     * tracing is started again.
+     */
+    TraceBuffer *registerThread(const QString &name);
+
+private:
+    Q_DISABLE_COPY(TraceRecorder)
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<TraceBuffer>> m_buffers;
+    std::ofstream m_file;
+    bool m_firstEvent;
+    int64_t m_originNsec;
+
+    std::atomic_bool m_active;
+    std::unique_ptr<std::thread> m_thread;
+
+    static void writerThread(TraceRecorder *self);
+    void writeEvents();
+    void writeEntry(const std::string &json);
+};
+
+} // end of MiniScope namespace
+
+#endif // TRACERECORDER_H
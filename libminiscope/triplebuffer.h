@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+
+namespace MScope
+{
+
+/**
+ * @brief Lock-free "latest value" slot for one writer and one reader
+ *
+ * The writer always has a slot of its own to write to, and publishes it by
+ * swapping it with the middle slot. The reader picks up the middle slot the same
+ * way, if anything new was published since it last looked.
+ * Neither side ever blocks or waits for the other, and the reader always gets
+ * the most recently published value, intermediate values are skipped.
+ */
+template<typename T>
+class TripleBuffer
+{
+public:
+    explicit TripleBuffer()
+        : m_middle(1),
+          m_back(0),
+          m_front(2)
+    {}
+
+    /**
+     * @brief Publish a new value (writer thread only)
+     */
+    void write(const T &value)
+    {
+        m_slots[m_back] = value;
+        const auto prev = m_middle.exchange(static_cast<uint8_t>(m_back | FRESH_BIT), std::memory_order_acq_rel);
+        m_back = prev & INDEX_MASK;
+    }
+
+    /**
+     * @brief Get the latest published value (reader thread only)
+     *
+     * The returned reference stays valid until the next call.
+     * @param fresh set to true if the value was published since the last call
+     */
+    const T &read(bool *fresh = nullptr)
+    {
+        const bool haveNew = (m_middle.load(std::memory_order_relaxed) & FRESH_BIT) != 0;
+        if (haveNew) {
+            const auto prev = m_middle.exchange(m_front, std::memory_order_acq_rel);
+            m_front = prev & INDEX_MASK;
+        }
+        if (fresh != nullptr)
+            *fresh = haveNew;
+        return m_slots[m_front];
+    }
+
+private:
+    static const uint8_t INDEX_MASK = 0x3;
+    static const uint8_t FRESH_BIT = 0x4;
+
+    std::array<T, 3> m_slots;
+
+    // index of the middle slot, plus a flag whether it holds an unread value
+    std::atomic<uint8_t> m_middle;
+
+    // only used by the writer and the reader, respectively
+    alignas(64) uint8_t m_back;
+    alignas(64) uint8_t m_front;
+};
+
+} // end of MiniScope namespace
+
+#endif // TRIPLEBUFFER_H
@@ -0,0 +1,467 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "v4l2source.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+#include <QDebug>
+
+#include "miniscope.h"
+
+using namespace MScope;
+
+static int xioctl(int fd, unsigned long request, void *arg)
+{
+    int r;
+    do {
+        r = ioctl(fd, request, arg);
+    } while (r == -1 && errno == EINTR);
+    return r;
+}
+
+V4L2FrameSource::V4L2FrameSource(uint bufferCount)
+    : m_fd(-1),
+      m_bufferCount(bufferCount),
+      m_streaming(false),
+      m_fps(0),
+      m_pollTimeoutMs(2000),
+      m_pixelFormat(0),
+      m_bytesPerLine(0),
+      m_currentBuffer(-1),
+      m_currentBytesUsed(0),
+      m_sequence(-1),
+      m_monotonicTimestamps(false),
+      m_timestamp(0)
+{
+    if (m_bufferCount < 2)
+        m_bufferCount = 2;
+}
+
+V4L2FrameSource::~V4L2FrameSource()
+{
+    release();
+}
+
+QString V4L2FrameSource::name() const
+{
+    return QStringLiteral("V4L2 (%1)").arg(m_devPath);
+}
+
+void V4L2FrameSource::setError(const QString &msg)
+{
+    m_lastError = msg;
+    qCWarning(logMScope).noquote() << msg;
+}
+
+bool V4L2FrameSource::open(int camId, const cv::Size &resolution)
+{
+    release();
+    m_lastError.clear();
+
+    m_devPath = QStringLiteral("/dev/video%1").arg(camId);
+    m_fd = ::open(qPrintable(m_devPath), O_RDWR | O_NONBLOCK);
+    if (m_fd < 0) {
+        setError(QStringLiteral("Unable to open %1: %2").arg(m_devPath).arg(std::strerror(errno)));
+        return false;
+    }
+
+    v4l2_capability cap;
+    std::memset(&cap, 0, sizeof(cap));
+    if (xioctl(m_fd, VIDIOC_QUERYCAP, &cap) < 0) {
+        setError(QStringLiteral("%1 is not a V4L2 device.").arg(m_devPath));
+        release();
+        return false;
+    }
+    const auto caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS)? cap.device_caps : cap.capabilities;
+    if (!(caps & V4L2_CAP_VIDEO_CAPTURE) || !(caps & V4L2_CAP_STREAMING)) {
+        setError(QStringLiteral("%1 does not support streaming video capture.").arg(m_devPath));
+        release();
+        return false;
+    }
+
+    // Every Miniscope sensor is monochrome, so a single-plane 8-bit format is all we need.
+    // Prefer GREY if the device offers it, otherwise use YUYV and only read its luma bytes.
+    uint preferredFormat = V4L2_PIX_FMT_YUYV;
+    v4l2_fmtdesc fmtDesc;
+    std::memset(&fmtDesc, 0, sizeof(fmtDesc));
+    fmtDesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    while (xioctl(m_fd, VIDIOC_ENUM_FMT, &fmtDesc) == 0) {
+        if (fmtDesc.pixelformat == V4L2_PIX_FMT_GREY) {
+            preferredFormat = V4L2_PIX_FMT_GREY;
+            break;
+        }
+        fmtDesc.index++;
+    }
+
+    // negotiate frame size and format
+    v4l2_format fmt;
+    std::memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(m_fd, VIDIOC_G_FMT, &fmt) < 0) {
+        setError(QStringLiteral("Unable to query video format of %1: %2").arg(m_devPath).arg(std::strerror(errno)));
+        release();
+        return false;
+    }
+    if (resolution.width > 0)
+        fmt.fmt.pix.width = static_cast<uint>(resolution.width);
+    if (resolution.height > 0)
+        fmt.fmt.pix.height = static_cast<uint>(resolution.height);
+    fmt.fmt.pix.pixelformat = preferredFormat;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (xioctl(m_fd, VIDIOC_S_FMT, &fmt) < 0) {
+        setError(QStringLiteral("Unable to set video format of %1: %2").arg(m_devPath).arg(std::strerror(errno)));
+        release();
+        return false;
+    }
+
+    m_pixelFormat = fmt.fmt.pix.pixelformat;
+    if ((m_pixelFormat != V4L2_PIX_FMT_YUYV) && (m_pixelFormat != V4L2_PIX_FMT_GREY)) {
+        setError(QStringLiteral("%1 does not support a pixel format we can read.").arg(m_devPath));
+        release();
+        return false;
+    }
+    m_size = cv::Size(static_cast<int>(fmt.fmt.pix.width), static_cast<int>(fmt.fmt.pix.height));
+    m_bytesPerLine = fmt.fmt.pix.bytesperline;
+
+    // UVC devices only accept a new frame interval while they are not streaming
+    applyFps();
+
+    // set up memory-mapped buffers
+    v4l2_requestbuffers req;
+    std::memset(&req, 0, sizeof(req));
+    req.count = m_bufferCount;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(m_fd, VIDIOC_REQBUFS, &req) < 0 || req.count < 2) {
+        setError(QStringLiteral("Unable to allocate capture buffers for %1.").arg(m_devPath));
+        release();
+        return false;
+    }
+
+    for (uint i = 0; i < req.count; i++) {
+        v4l2_buffer buf;
+        std::memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (xioctl(m_fd, VIDIOC_QUERYBUF, &buf) < 0) {
+            setError(QStringLiteral("Unable to query capture buffer %1 of %2.").arg(i).arg(m_devPath));
+            release();
+            return false;
+        }
+
+        MappedBuffer mbuf;
+        mbuf.length = buf.length;
+        mbuf.start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, buf.m.offset);
+        if (mbuf.start == MAP_FAILED) {
+            setError(QStringLiteral("Unable to map capture buffer %1 of %2.").arg(i).arg(m_devPath));
+            release();
+            return false;
+        }
+        m_buffers.push_back(mbuf);
+    }
+
+    if (!queueAllBuffers()) {
+        release();
+        return false;
+    }
+
+    auto type = static_cast<int>(V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    if (xioctl(m_fd, VIDIOC_STREAMON, &type) < 0) {
+        setError(QStringLiteral("Unable to start streaming from %1: %2").arg(m_devPath).arg(std::strerror(errno)));
+        release();
+        return false;
+    }
+    m_streaming = true;
+    m_currentBuffer = -1;
+    m_sequence = -1;
+
+    qCDebug(logMScope).noquote() << "Opened" << m_devPath << "with" << m_buffers.size() << "buffers,"
+                                 << m_size.width << "x" << m_size.height;
+    return true;
+}
+
+void V4L2FrameSource::release()
+{
+    if (m_fd < 0)
+        return;
+
+    if (m_streaming) {
+        auto type = static_cast<int>(V4L2_BUF_TYPE_VIDEO_CAPTURE);
+        xioctl(m_fd, VIDIOC_STREAMOFF, &type);
+        m_streaming = false;
+    }
+
+    for (const auto &buf : m_buffers)
+        munmap(buf.start, buf.length);
+    m_buffers.clear();
+
+    // free the kernel buffers
+    v4l2_requestbuffers req;
+    std::memset(&req, 0, sizeof(req));
+    req.count = 0;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    xioctl(m_fd, VIDIOC_REQBUFS, &req);
+
+    ::close(m_fd);
+    m_fd = -1;
+    m_currentBuffer = -1;
+}
+
+bool V4L2FrameSource::isOpened() const
+{
+    return m_fd >= 0 && m_streaming;
+}
+
+void V4L2FrameSource::setFps(double fps)
+{
+    if (fps <= 0 || fps == m_fps)
+        return;
+    m_fps = fps;
+
+    // wait at least a few frame periods before considering the device stalled
+    m_pollTimeoutMs = std::max(2000, static_cast<int>(4000 / fps));
+
+    if (m_fd < 0)
+        return;
+    if (!m_streaming) {
+        applyFps();
+        return;
+    }
+
+    // the frame interval can not be changed while streaming, so restart the stream.
+    // Stopping it returns all buffers to us, including the one of the last frame.
+    auto type = static_cast<int>(V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    if (xioctl(m_fd, VIDIOC_STREAMOFF, &type) < 0) {
+        qCWarning(logMScope).noquote() << "Unable to stop streaming from" << m_devPath << "to change its framerate:" << std::strerror(errno);
+        return;
+    }
+    m_streaming = false;
+    m_currentBuffer = -1;
+    m_sequence = -1;
+
+    applyFps();
+
+    if (!queueAllBuffers())
+        return;
+    if (xioctl(m_fd, VIDIOC_STREAMON, &type) < 0) {
+        setError(QStringLiteral("Unable to restart streaming from %1: %2").arg(m_devPath).arg(std::strerror(errno)));
+        return;
+    }
+    m_streaming = true;
+}
+
+bool V4L2FrameSource::applyFps()
+{
+    if (m_fps <= 0)
+        return true;
+
+    v4l2_streamparm parm;
+    std::memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe.numerator = 1000;
+    parm.parm.capture.timeperframe.denominator = static_cast<uint>(m_fps * 1000);
+    if (xioctl(m_fd, VIDIOC_S_PARM, &parm) < 0) {
+        qCWarning(logMScope).noquote() << "Unable to set framerate of" << m_devPath << "to" << m_fps << "fps:" << std::strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool V4L2FrameSource::queueAllBuffers()
+{
+    for (uint i = 0; i < m_buffers.size(); i++) {
+        v4l2_buffer buf;
+        std::memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (xioctl(m_fd, VIDIOC_QBUF, &buf) < 0) {
+            setError(QStringLiteral("Unable to queue capture buffer %1 of %2.").arg(i).arg(m_devPath));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool V4L2FrameSource::requeueCurrentBuffer()
+{
+    if (m_currentBuffer < 0)
+        return true;
+
+    v4l2_buffer buf;
+    std::memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = static_cast<uint>(m_currentBuffer);
+    m_currentBuffer = -1;
+    if (xioctl(m_fd, VIDIOC_QBUF, &buf) < 0) {
+        setError(QStringLiteral("Unable to requeue capture buffer: %1").arg(std::strerror(errno)));
+        return false;
+    }
+
+    return true;
+}
+
+bool V4L2FrameSource::grab()
+{
+    if (!isOpened()) {
+        m_lastError = QStringLiteral("V4L2 device is not open.");
+        return false;
+    }
+
+    // hand the buffer of the previous frame back to the driver
+    if (!requeueCurrentBuffer())
+        return false;
+
+    v4l2_buffer buf;
+    while (true) {
+        pollfd pfd;
+        pfd.fd = m_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        const auto r = poll(&pfd, 1, m_pollTimeoutMs);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            setError(QStringLiteral("Unable to wait for frame: %1").arg(std::strerror(errno)));
+            return false;
+        }
+        if (r == 0) {
+            setError(QStringLiteral("Timed out waiting for a frame from %1.").arg(m_devPath));
+            return false;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP)) {
+            setError(QStringLiteral("Device %1 reported an error, it may have been disconnected.").arg(m_devPath));
+            return false;
+        }
+
+        std::memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        if (xioctl(m_fd, VIDIOC_DQBUF, &buf) < 0) {
+            if (errno == EAGAIN)
+                continue;
+            setError(QStringLiteral("Unable to dequeue frame: %1").arg(std::strerror(errno)));
+            return false;
+        }
+        break;
+    }
+
+    m_currentBuffer = static_cast<int>(buf.index);
+    m_currentBytesUsed = buf.bytesused;
+    m_sequence = buf.sequence;
+    m_monotonicTimestamps = (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    m_timestamp = std::chrono::seconds(buf.timestamp.tv_sec) + std::chrono::microseconds(buf.timestamp.tv_usec);
+
+    if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+        // the frame data is corrupted, but the buffer still has a valid sequence number
+        m_currentBytesUsed = 0;
+    }
+
+    return true;
+}
+
+bool V4L2FrameSource::retrieve(cv::Mat &frame)
+{
+    if (m_currentBuffer < 0)
+        return false;
+
+    const auto lineBytes = static_cast<size_t>(m_bytesPerLine);
+    if (m_currentBytesUsed < lineBytes * static_cast<size_t>(m_size.height))
+        return false; // short or corrupted frame
+
+    // wrap the mapped buffer without copying, and copy out only the luma plane
+    const auto data = m_buffers[static_cast<size_t>(m_currentBuffer)].start;
+    if (m_pixelFormat == V4L2_PIX_FMT_GREY) {
+        const cv::Mat raw(m_size, CV_8UC1, data, lineBytes);
+        raw.copyTo(frame);
+    } else {
+        // YUYV: the luma of each pixel is stored in every other byte
+        const cv::Mat raw(m_size, CV_8UC2, data, lineBytes);
+        cv::extractChannel(raw, frame, 0);
+    }
+
+    return true;
+}
+
+std::chrono::milliseconds V4L2FrameSource::frameTimestamp()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(m_timestamp);
+}
+
+qint64 V4L2FrameSource::frameSequence()
+{
+    return m_sequence;
+}
+
+bool V4L2FrameSource::frameCaptureTime(std::chrono::time_point<std::chrono::steady_clock> &time)
+{
+    // steady_clock is CLOCK_MONOTONIC on Linux, so monotonic kernel timestamps share its epoch
+    if (!m_monotonicTimestamps)
+        return false;
+    time = std::chrono::time_point<std::chrono::steady_clock>(std::chrono::duration_cast<std::chrono::steady_clock::duration>(m_timestamp));
+    return true;
+}
+
+bool V4L2FrameSource::setControl(uint id, int value)
+{
+    v4l2_control ctl;
+    std::memset(&ctl, 0, sizeof(ctl));
+    ctl.id = id;
+    ctl.value = value;
+    return xioctl(m_fd, VIDIOC_S_CTRL, &ctl) == 0;
+}
+
+bool V4L2FrameSource::sendControlBytes(double head, double middle, double tail)
+{
+    if (m_fd < 0)
+        return false;
+
+    // the DAQ board needs some time to clear its control endpoint, see CvFrameSource
+    const auto controlReqCooldownTime = std::chrono::microseconds(128);
+
+    bool ret = setControl(V4L2_CID_CONTRAST, static_cast<int>(head));
+    std::this_thread::sleep_for(controlReqCooldownTime);
+    ret = setControl(V4L2_CID_GAMMA, static_cast<int>(middle)) && ret;
+    std::this_thread::sleep_for(controlReqCooldownTime);
+    ret = setControl(V4L2_CID_SHARPNESS, static_cast<int>(tail)) && ret;
+    std::this_thread::sleep_for(controlReqCooldownTime);
+
+    return ret;
+}
+
+bool V4L2FrameSource::setRecordingState(bool recording)
+{
+    if (m_fd < 0)
+        return false;
+    return setControl(V4L2_CID_SATURATION, recording? 0x0001 : 0x0000);
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef V4L2SOURCE_H
+#define V4L2SOURCE_H
+
+#include <vector>
+#include "framesource.h"
+
+namespace MScope
+{
+
+/**
+ * @brief Frames from a Miniscope DAQ board, read directly via Video4Linux2
+ *
+ * Uses memory-mapped streaming I/O with a configurable number of kernel
+ * buffers. Frames are converted straight from the mapped buffer into an
+ * 8-bit grayscale matrix, and the kernel's capture timestamp and
+ * sequence number are passed on to the DAQ thread.
+ */
+class V4L2FrameSource : public FrameSource
+{
+public:
+    explicit V4L2FrameSource(uint bufferCount);
+    ~V4L2FrameSource() override;
+
+    QString name() const override;
+
+    bool open(int camId, const cv::Size &resolution) override;
+    void release() override;
+    bool isOpened() const override;
+
+    void setFps(double fps) override;
+
+    bool grab() override;
+    bool retrieve(cv::Mat &frame) override;
+    std::chrono::milliseconds frameTimestamp() override;
+    qint64 frameSequence() override;
+    bool frameCaptureTime(std::chrono::time_point<std::chrono::steady_clock> &time) override;
+
+    bool sendControlBytes(double head, double middle, double tail) override;
+    bool setRecordingState(bool recording) override;
+
+private:
+    struct MappedBuffer {
+        void *start;
+        size_t length;
+    };
+
+    QString m_devPath;
+    int m_fd;
+    uint m_bufferCount;
+    std::vector<MappedBuffer> m_buffers;
+    bool m_streaming;
+    double m_fps;
+    int m_pollTimeoutMs;
+
+    cv::Size m_size;
+    uint m_pixelFormat;
+    uint m_bytesPerLine;
+
+    int m_currentBuffer;
+    size_t m_currentBytesUsed;
+    qint64 m_sequence;
+    bool m_monotonicTimestamps;
+    std::chrono::microseconds m_timestamp;
+
+    bool setControl(uint id, int value);
+    bool applyFps();
+    bool queueAllBuffers();
+    bool requeueCurrentBuffer();
+    void setError(const QString &msg);
+};
+
+} // end of MiniScope namespace
+
+#endif // V4L2SOURCE_H
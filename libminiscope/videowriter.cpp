@@ -18,14 +18,19 @@
  */
 
 #include "videowriter.h"
+#include "pipelinestats.h"
 
 #include <QString>
+#include <algorithm>
 #include <iostream>
 #include <atomic>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <queue>
 #include <fstream>
+#include <future>
+#include <cstdio>
 #include <opencv2/imgproc/imgproc.hpp>
 extern "C" {
 #include <libavformat/avformat.h>
@@ -38,18 +43,126 @@ extern "C" {
 }
 
 /**
- * @brief FRAME_QUEUE_MAX_COUNT
- * The maximum number of frames we want to hold in the queue in memory
- * before dropping frames.
+ * Default encoder queue watermarks. Once the queue holds as many frames as the high
+ * watermark, pushing new frames blocks until the encoder has worked it down to the
+ * low watermark again.
  */
-static const uint FRAME_QUEUE_MAX_COUNT = 512;
+static const size_t DEFAULT_QUEUE_HIGH_WATERMARK = 512;
+static const size_t DEFAULT_QUEUE_LOW_WATERMARK = 384;
+
+/**
+ * Maximum time pushing a frame may be blocked by a full encoder queue, before
+ * we give up and report an error.
+ */
+static const auto QUEUE_BACKPRESSURE_TIMEOUT = std::chrono::seconds(2);
+
+/**
+ * FFmpeg warns about, and some codecs misbehave with, more threads than this.
+ */
+static const int MAX_ENCODER_THREADS = 16;
+
+/**
+ * With file slicing, the file for the next slice is opened this long before the
+ * current one ends, so it is ready when the encoder thread switches over.
+ */
+static const auto SLICE_PREPARE_LEAD = std::chrono::seconds(10);
+
+// number of video writers currently recording in this process, to share the CPU cores between them
+static std::atomic_int g_activeWriterCount(0);
+
+/**
+ * @brief A frame waiting to be encoded, with its metadata
+ */
+struct VideoWriter::QueuedFrame
+{
+    cv::Mat frame;
+    std::chrono::milliseconds timestamp;
+    cv::Point2d motionShift;
+    std::chrono::steady_clock::time_point queuedTime;
+};
+
+/**
+ * @brief One output file of a recording, with its own muxer and encoder
+ *
+ * When slicing a recording, the segment of the next slice is opened in the background
+ * ahead of time, and the finished one is flushed and closed in the background as well,
+ * so the encoder thread only has to swap them at the slice boundary. The first frame of
+ * every segment is encoded by a fresh encoder, and therefore always a keyframe.
+ */
+struct VideoWriter::Segment
+{
+    Segment()
+        : sliceNo(0),
+          octx(nullptr),
+          vstrm(nullptr),
+          cctx(nullptr),
+          swsctx(nullptr),
+          frame(nullptr),
+          inputFrame(nullptr),
+          packet(nullptr),
+          framePts(0),
+          grayLuma(false),
+          limitedLuma(false),
+          grayChroma(nullptr),
+          lumaBuffer(nullptr)
+    {}
+
+    ~Segment()
+    {
+        // free all FFmpeg resources, the encoder must have been flushed already if the data matters
+        if (frame != nullptr)
+            av_frame_free(&frame);
+        if (inputFrame != nullptr)
+            av_frame_free(&inputFrame);
+        if (packet != nullptr)
+            av_packet_free(&packet);
+        if (grayChroma != nullptr)
+            av_freep(&grayChroma);
+        if (lumaBuffer != nullptr)
+            av_freep(&lumaBuffer);
+        if (swsctx != nullptr)
+            sws_freeContext(swsctx);
+        if (cctx != nullptr)
+            avcodec_free_context(&cctx);
+        if (octx != nullptr) {
+            if (octx->pb != nullptr)
+                avio_close(octx->pb);
+            avformat_free_context(octx);
+        }
+    }
+
+    uint sliceNo;
+    std::string fname;
+    std::string timestampFname;
+    std::string motionFname;
+
+    AVFormatContext *octx;
+    AVStream *vstrm;
+    AVCodecContext *cctx;
+    SwsContext *swsctx;
+    AVFrame *frame;
+    AVFrame *inputFrame;
+    AVPacket *packet;
+    int64_t framePts;
+    bool grayLuma;
+    bool limitedLuma;
+    uint8_t *grayChroma;
+    uint8_t *lumaBuffer;
+    cv::Mat lumaLut;
+
+    std::ofstream timestampFile;
+    std::ofstream motionFile;
+};
 
 #pragma GCC diagnostic ignored "-Wpadded"
 class VideoWriter::Private
 {
 public:
     Private()
-        : thread(nullptr)
+        : thread(nullptr),
+          stats(nullptr),
+          traceRecorder(nullptr),
+          trace(nullptr)
     {
         initialized = false;
         codec = VideoCodec::VP9;
@@ -57,21 +170,37 @@ public:
         fileSliceIntervalMin = 0;  // never slice our recording by default
         captureStartTimestamp = std::chrono::milliseconds(0); //by default we assume the first frame was recorded at timepoint 0
 
-        frame = nullptr;
-        inputFrame = nullptr;
         alignedInput = nullptr;
-
-        octx = nullptr;
-        vstrm = nullptr;
-        cctx = nullptr;
-        swsctx = nullptr;
         lossless = false;
+        saveMotionShifts = false;
+        activeCounted = false;
+        encoderThreads = 0;
+        concurrentWriters = 0;
+        threading = EncoderThreading::Auto;
+        ffv1Slices = 0;
+        ffv1SliceCrc = true;
+
+        queueHighWatermark = DEFAULT_QUEUE_HIGH_WATERMARK;
+        queueLowWatermark = DEFAULT_QUEUE_LOW_WATERMARK;
+        queuePeakDepth = 0;
+        backpressureCount = 0;
     }
 
     QString lastError;
     std::thread *thread;
     std::mutex mutex;
-    std::queue<std::pair<cv::Mat, std::chrono::milliseconds>> frameQueue;
+    std::condition_variable frameAvailableCond;
+    std::condition_variable spaceAvailableCond;
+    std::queue<QueuedFrame> frameQueue;
+    size_t queueHighWatermark;
+    size_t queueLowWatermark;
+    size_t queuePeakDepth;
+    size_t backpressureCount;
+
+    ThreadScheduling threadScheduling;
+    PipelineStats *stats;
+    TraceRecorder *traceRecorder;
+    TraceBuffer *trace;
 
     QString fnameBase;
     uint fileSliceIntervalMin;
@@ -85,23 +214,27 @@ public:
     int height;
     AVRational fps;
     bool lossless;
+    bool activeCounted;
+
+    int encoderThreads;
+    int concurrentWriters;
+    EncoderThreading threading;
+    int ffv1Slices;
+    bool ffv1SliceCrc;
 
     bool saveTimestamps;
-    std::ofstream timestampFile;
+    bool saveMotionShifts;
     std::chrono::milliseconds captureStartTimestamp;
 
-    AVFrame *frame;
-    AVFrame *inputFrame;
-    int64_t framePts;
-    uchar *alignedInput;
+    std::unique_ptr<Segment> segment;
+    std::future<std::unique_ptr<Segment>> nextSegment;
+    std::future<void> closingSegment;
 
-    AVFormatContext *octx;
-    AVStream *vstrm;
-    AVCodecContext *cctx;
-    SwsContext *swsctx;
+    uchar *alignedInput;
+    cv::Mat convertedInput;
     AVPixelFormat inputPixFormat;
 
-    size_t frames_n;
+    std::atomic<size_t> frames_n;
 };
 #pragma GCC diagnostic pop
 
@@ -146,25 +279,25 @@ static AVFrame *vw_alloc_frame(int pix_fmt, int width, int height, bool allocate
     return aframe;
 }
 
-void VideoWriter::initializeInternal()
+std::unique_ptr<VideoWriter::Segment> VideoWriter::openSegment(uint sliceNo)
 {
-    // sanity check. 'Raw' is the only "codec" that we allow to only actually work with one
-    // container, all other codecs have to work with all containers.
-    if ((d->codec == VideoCodec::Raw) && (d->container != VideoContainer::AVI)) {
-        std::cerr << "Video codec was set to 'Raw', but container was not 'AVI'. Assuming 'AVI' as desired container format." << std::endl;
-        d->container = VideoContainer::AVI;
-
-    }
+    // NOTE: With file slicing, this runs in the background while the encoder thread is still
+    // busy with the previous segment, so it must only read the writer's settings.
+    std::unique_ptr<Segment> seg(new Segment);
+    seg->sliceNo = sliceNo;
 
     // if file slicing is used, give our new file the appropriate name
     QString fname;
     if (d->fileSliceIntervalMin > 0)
-        fname = QStringLiteral("%1_%2").arg(d->fnameBase).arg(d->currentSliceNo);
+        fname = QStringLiteral("%1_%2").arg(d->fnameBase).arg(sliceNo);
     else
         fname = d->fnameBase;
 
-    // prepare timestamp filename
-    const auto timestampFname = fname + "_timestamps.csv";
+    // prepare timestamp and motion filenames
+    if (d->saveTimestamps)
+        seg->timestampFname = (fname + "_timestamps.csv").toStdString();
+    if (d->saveMotionShifts)
+        seg->motionFname = (fname + "_motion.csv").toStdString();
 
     // set container format
     switch (d->container) {
@@ -182,17 +315,17 @@ void VideoWriter::initializeInternal()
         break;
     }
 
+    seg->fname = fname.toStdString();
+
     // open output format context
     int ret;
-    d->octx = nullptr;
-    ret = avformat_alloc_output_context2(&d->octx, nullptr, nullptr, qPrintable(fname));
+    ret = avformat_alloc_output_context2(&seg->octx, nullptr, nullptr, qPrintable(fname));
     if (ret < 0)
         throw std::runtime_error(QStringLiteral("Failed to allocate output context: %1").arg(ret).toStdString());
 
     // open output IO context
-    ret = avio_open2(&d->octx->pb, qPrintable(fname), AVIO_FLAG_WRITE, nullptr, nullptr);
+    ret = avio_open2(&seg->octx->pb, qPrintable(fname), AVIO_FLAG_WRITE, nullptr, nullptr);
     if (ret < 0) {
-        finalizeInternal(false);
         throw std::runtime_error(QStringLiteral("Failed to open output I/O context: %1").arg(ret).toStdString());
     }
 
@@ -223,36 +356,52 @@ void VideoWriter::initializeInternal()
 
     // initialize codec and context
     auto vcodec = avcodec_find_encoder(codecId);
-    d->cctx = avcodec_alloc_context3(vcodec);
+    seg->cctx = avcodec_alloc_context3(vcodec);
 
     // create new video stream
-    d->vstrm = avformat_new_stream(d->octx, vcodec);
-    if (!d->vstrm)
+    seg->vstrm = avformat_new_stream(seg->octx, vcodec);
+    if (!seg->vstrm)
         throw std::runtime_error("Failed to create new video stream.");
-    avcodec_parameters_to_context(d->cctx, d->vstrm->codecpar);
+    avcodec_parameters_to_context(seg->cctx, seg->vstrm->codecpar);
 
     // set codec parameters
-    d->cctx->codec_id = codecId;
-    d->cctx->codec_type = AVMEDIA_TYPE_VIDEO;
+    seg->cctx->codec_id = codecId;
+    seg->cctx->codec_type = AVMEDIA_TYPE_VIDEO;
     if (vcodec->pix_fmts != nullptr)
-        d->cctx->pix_fmt = vcodec->pix_fmts[0];
-    d->cctx->time_base = av_inv_q(d->fps);
-    d->cctx->width = d->width;
-    d->cctx->height = d->height;
-    d->cctx->framerate = d->fps;
-    d->cctx->workaround_bugs = FF_BUG_AUTODETECT;
+        seg->cctx->pix_fmt = vcodec->pix_fmts[0];
+    seg->cctx->time_base = av_inv_q(d->fps);
+    seg->cctx->width = d->width;
+    seg->cctx->height = d->height;
+    seg->cctx->framerate = d->fps;
+    seg->cctx->workaround_bugs = FF_BUG_AUTODETECT;
 
     if (d->codec == VideoCodec::Raw)
-        d->cctx->pix_fmt = d->inputPixFormat == AV_PIX_FMT_GRAY8 ||
+        seg->cctx->pix_fmt = d->inputPixFormat == AV_PIX_FMT_GRAY8 ||
                            d->inputPixFormat == AV_PIX_FMT_GRAY16LE ||
                            d->inputPixFormat == AV_PIX_FMT_GRAY16BE ? d->inputPixFormat : AV_PIX_FMT_YUV420P;
 
     // enable experimental mode to encode AV1
     if (d->codec == VideoCodec::AV1)
-        d->cctx->strict_std_compliance = -2;
+        seg->cctx->strict_std_compliance = -2;
+
+    // let the encoder use multiple threads, FFmpeg picks the threading types the codec
+    // actually supports from the ones we allow here
+    const auto threadCount = effectiveEncoderThreads();
+    seg->cctx->thread_count = threadCount;
+    switch (d->threading) {
+    case EncoderThreading::Frame:
+        seg->cctx->thread_type = FF_THREAD_FRAME;
+        break;
+    case EncoderThreading::Slice:
+        seg->cctx->thread_type = FF_THREAD_SLICE;
+        break;
+    default:
+        seg->cctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        break;
+    }
 
-    if (d->octx->oformat->flags & AVFMT_GLOBALHEADER)
-        d->cctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (seg->octx->oformat->flags & AVFMT_GLOBALHEADER)
+        seg->cctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
     AVDictionary *codecopts = nullptr;
     if (d->lossless) {
@@ -274,9 +423,7 @@ void VideoWriter::initializeInternal()
             av_dict_set(&codecopts, "preset", "veryfast", 0);
             break;
         case VideoCodec::MPEG4:
-            // NOTE: MPEG-4 has no lossless option
-            std::cerr << "The MPEG-4 codec has no lossless preset, switching to lossy compression." << std::endl;
-            d->lossless = false;
+            // NOTE: MPEG-4 has no lossless option, initialize() already switched to lossy compression
             break;
         default: break;
         }
@@ -289,7 +436,12 @@ void VideoWriter::initializeInternal()
         av_dict_set(&codecopts, "quality", "realtime", 0);
         av_dict_set(&codecopts, "deadline", "realtime", 0);
         av_dict_set_int(&codecopts, "speed", 6, 0);
-        av_dict_set_int(&codecopts, "tile-columns", 4, 0);
+
+        // tiles are encoded in parallel, but must be at least 256px wide. The option is log2 of the column count.
+        int tileColumnsLog2 = 0;
+        while ((d->width >> (tileColumnsLog2 + 1)) >= 256 && (1 << tileColumnsLog2) < threadCount && tileColumnsLog2 < 6)
+            tileColumnsLog2++;
+        av_dict_set_int(&codecopts, "tile-columns", tileColumnsLog2, 0);
         av_dict_set_int(&codecopts, "frame-parallel", 1, 0);
         av_dict_set_int(&codecopts, "static-thresh", 0, 0);
         av_dict_set_int(&codecopts, "max-intra-rate", 300, 0);
@@ -304,123 +456,250 @@ void VideoWriter::initializeInternal()
     }
 
     if (d->codec == VideoCodec::FFV1) {
-        d->lossless = true; // this codec is always lossless
-        d->cctx->level = 3; // Ensure we use FFV1 v3
-        av_dict_set_int(&codecopts, "slicecrc", 1, 0); // Add CRC information to each slice
+        seg->cctx->level = 3; // Ensure we use FFV1 v3
+        av_dict_set_int(&codecopts, "slicecrc", d->ffv1SliceCrc? 1 : 0, 0);
+
+        // FFV1 can only encode slices in parallel, so have at least one per thread
+        auto slices = d->ffv1Slices;
+        if (slices <= 0) {
+            for (const auto validCount : {4, 6, 9, 12, 16, 24}) {
+                slices = validCount;
+                if (validCount >= threadCount)
+                    break;
+            }
+        }
+        av_dict_set_int(&codecopts, "slices", slices, 0);
         // NOTE: For archival use, GOP-size should be 1, but that also increases the file size quite a bit.
         // Keeping a good balance between recording space/performance/integrity is difficult sometimes.
     }
 
-    // Adjust pixel color formats for selected video codecs
-    switch (d->codec) {
-    case VideoCodec::FFV1:
-        if (d->inputPixFormat == AV_PIX_FMT_GRAY8)
-            d->cctx->pix_fmt = AV_PIX_FMT_GRAY8;
-        break;
-    default: break;
+    // Our frames are usually monochrome, so encode them as such if the encoder supports that.
+    // Otherwise, if the encoder takes planar YUV, the frame can be used as luma plane as-is,
+    // with constant neutral chroma planes, so we don't need to run the scaler on every frame.
+    seg->grayLuma = false;
+    if ((d->inputPixFormat == AV_PIX_FMT_GRAY8) && (d->codec != VideoCodec::Raw) && (vcodec->pix_fmts != nullptr)) {
+        for (auto fmt = vcodec->pix_fmts; *fmt != AV_PIX_FMT_NONE; fmt++) {
+            if (*fmt == AV_PIX_FMT_GRAY8) {
+                seg->cctx->pix_fmt = AV_PIX_FMT_GRAY8;
+                break;
+            }
+        }
+
+        switch (seg->cctx->pix_fmt) {
+        case AV_PIX_FMT_YUV420P:
+        case AV_PIX_FMT_YUVJ420P:
+        case AV_PIX_FMT_YUV422P:
+        case AV_PIX_FMT_YUV444P:
+            seg->grayLuma = true;
+            break;
+        default: break;
+        }
+
+        // Gray values span the full 0-255 range, unlike the luma of limited range YUV. We can only
+        // use them as luma unchanged if the stream can tell decoders so, otherwise players clip
+        // the darkest and brightest values. MPEG-4 Part 2 has no way to signal the range, so for
+        // it we map the values to the limited range instead.
+        const auto canSignalFullRange = (seg->cctx->pix_fmt == AV_PIX_FMT_YUVJ420P)
+                                            || (d->codec == VideoCodec::AV1)
+                                            || (d->codec == VideoCodec::VP9)
+                                            || (d->codec == VideoCodec::HEVC);
+        if (seg->cctx->pix_fmt == AV_PIX_FMT_GRAY8) {
+            seg->cctx->color_range = AVCOL_RANGE_JPEG;
+        } else if (seg->grayLuma) {
+            seg->limitedLuma = !canSignalFullRange;
+            seg->cctx->color_range = seg->limitedLuma? AVCOL_RANGE_MPEG : AVCOL_RANGE_JPEG;
+        }
     }
 
     // open video encoder
-    ret = avcodec_open2(d->cctx, vcodec, &codecopts);
+    ret = avcodec_open2(seg->cctx, vcodec, &codecopts);
     if (ret < 0) {
-        finalizeInternal(false);
         av_dict_free(&codecopts);
         throw std::runtime_error(QStringLiteral("Failed to open video encoder: %1").arg(ret).toStdString());
     }
 
     // stream codec parameters must be set after opening the encoder
-    avcodec_parameters_from_context(d->vstrm->codecpar, d->cctx);
-    d->vstrm->r_frame_rate = d->vstrm->avg_frame_rate = d->fps;
-
-    // initialize sample scaler
-    d->swsctx = sws_getCachedContext(nullptr,
-                                     d->width,
-                                     d->height,
-                                     d->inputPixFormat,
-                                     d->width,
-                                     d->height,
-                                     d->cctx->pix_fmt,
-                                     SWS_BICUBIC,
-                                     nullptr,
-                                     nullptr,
-                                     nullptr);
-
-    if (!d->swsctx) {
-        finalizeInternal(false);
-        throw std::runtime_error("Failed to initialize sample scaler.");
-    }
-
-    // allocate frame buffer for encoding
-    d->frame = vw_alloc_frame(d->cctx->pix_fmt, d->width, d->height, true);
+    avcodec_parameters_from_context(seg->vstrm->codecpar, seg->cctx);
+    seg->vstrm->r_frame_rate = seg->vstrm->avg_frame_rate = d->fps;
+
+    if (seg->grayLuma) {
+        // the frame only references the input as luma plane, chroma is neutral gray. U and V can share
+        // the same buffer, as the encoder never modifies its input.
+        seg->frame = vw_alloc_frame(seg->cctx->pix_fmt, d->width, d->height, false);
+
+        int chromaShiftW, chromaShiftH;
+        av_pix_fmt_get_chroma_sub_sample(seg->cctx->pix_fmt, &chromaShiftW, &chromaShiftH);
+        const auto chromaWidth = AV_CEIL_RSHIFT(d->width, chromaShiftW);
+        const auto chromaHeight = AV_CEIL_RSHIFT(d->height, chromaShiftH);
+        const auto chromaStep = FFALIGN(chromaWidth, 32);
+
+        // pad the buffer a bit, SIMD code may read slightly past the end of the plane
+        const auto chromaSize = static_cast<size_t>(chromaStep * chromaHeight + 64);
+        seg->grayChroma = static_cast<uint8_t*>(av_malloc(chromaSize));
+        if (seg->grayChroma == nullptr)
+            throw std::runtime_error("Failed to allocate chroma planes for grayscale encoding.");
+        memset(seg->grayChroma, 128, chromaSize);
+        seg->frame->data[1] = seg->grayChroma;
+        seg->frame->data[2] = seg->grayChroma;
+        seg->frame->linesize[1] = chromaStep;
+        seg->frame->linesize[2] = chromaStep;
+
+        if (seg->limitedLuma) {
+            // the luma plane is a copy of the frame, with 0-255 mapped to 16-235
+            const auto lumaStep = FFALIGN(d->width, 32);
+            seg->lumaBuffer = static_cast<uint8_t*>(av_malloc(static_cast<size_t>(lumaStep * d->height + 64)));
+            if (seg->lumaBuffer == nullptr)
+                throw std::runtime_error("Failed to allocate luma plane for grayscale encoding.");
+            seg->frame->data[0] = seg->lumaBuffer;
+            seg->frame->linesize[0] = lumaStep;
+
+            seg->lumaLut.create(1, 256, CV_8UC1);
+            for (int i = 0; i < 256; i++)
+                seg->lumaLut.at<uchar>(i) = static_cast<uchar>(16 + (i * 219 + 127) / 255);
+        }
+    } else {
+        if (seg->cctx->pix_fmt != d->inputPixFormat) {
+            // initialize sample scaler
+            seg->swsctx = sws_getCachedContext(nullptr,
+                                             d->width,
+                                             d->height,
+                                             d->inputPixFormat,
+                                             d->width,
+                                             d->height,
+                                             seg->cctx->pix_fmt,
+                                             SWS_BICUBIC,
+                                             nullptr,
+                                             nullptr,
+                                             nullptr);
+
+            if (!seg->swsctx) {
+                throw std::runtime_error("Failed to initialize sample scaler.");
+            }
+        }
+
+        // allocate frame buffer for encoding
+        seg->frame = vw_alloc_frame(seg->cctx->pix_fmt, d->width, d->height, true);
+    }
 
     // allocate input buffer for color conversion
-    d->inputFrame = vw_alloc_frame(d->cctx->pix_fmt, d->width, d->height, false);
+    seg->inputFrame = vw_alloc_frame(seg->cctx->pix_fmt, d->width, d->height, false);
+
+    // packet to receive encoded data in, reused for all packets
+    seg->packet = av_packet_alloc();
 
     // write format header, after this we are ready to encode frames
-    ret = avformat_write_header(d->octx, nullptr);
+    ret = avformat_write_header(seg->octx, nullptr);
     if (ret < 0) {
-        finalizeInternal(false);
         throw std::runtime_error(QStringLiteral("Failed to write format header: %1").arg(ret).toStdString());
     }
-    d->framePts = 0;
+    seg->framePts = 0;
 
     if (d->saveTimestamps) {
-        d->timestampFile.close(); // ensure file is closed
-        d->timestampFile.clear();
-        d->timestampFile.open(timestampFname.toStdString());
-        d->timestampFile << "frame; timestamp" << "\n";
-        d->timestampFile.flush();
+        seg->timestampFile.open(seg->timestampFname);
+        seg->timestampFile << "frame; timestamp" << "\n";
+        seg->timestampFile.flush();
     }
 
-    d->initialized = true;
+    if (d->saveMotionShifts) {
+        seg->motionFile.open(seg->motionFname);
+        seg->motionFile << "frame; shift_x; shift_y" << "\n";
+        seg->motionFile.flush();
+    }
+
+    return seg;
 }
 
-void VideoWriter::finalizeInternal(bool writeTrailer, bool stopRecThread)
+void VideoWriter::closeSegment(std::unique_ptr<Segment> seg, bool writeTrailer)
 {
-    // stop encoding frames and write the last bits to disk.
-    // wait for the encoding thread to join.
-    // if no thread was running, do nothing
-    // (unless of course we are in the recording thread and just want to start
-    // a new file, in this case `stopRecThread` will be set to false)
-    if (stopRecThread)
-        stopEncodeThread();
-
-    if (d->initialized) {
-        if (d->vstrm != nullptr)
-            avcodec_send_frame(d->cctx, nullptr);
-
-        // write trailer
-        if (writeTrailer && (d->octx != nullptr))
-            av_write_trailer(d->octx);
+    // signal the end of the stream to the encoder, and write out all frames it still holds
+    // (encoders with lookahead or frame threading may hold quite a few of them)
+    if (seg->vstrm != nullptr) {
+        QString error;
+        avcodec_send_frame(seg->cctx, nullptr);
+        if (!receivePackets(seg.get(), error))
+            std::cerr << "Unable to flush encoder: " << error.toStdString() << std::endl;
     }
 
-    // ensure timestamps file is closed
-    if (d->saveTimestamps)
-        d->timestampFile.close();
+    // write trailer
+    if (writeTrailer && (seg->octx != nullptr))
+        av_write_trailer(seg->octx);
 
-    // free all FFmpeg resources
-    if (d->frame != nullptr) {
-        av_frame_free(&d->frame);
-        d->frame = nullptr;
-    }
-    if (d->inputFrame != nullptr) {
-        av_frame_free(&d->inputFrame);
-        d->inputFrame = nullptr;
+    // the segment closes its files and frees all FFmpeg resources when it is destroyed
+}
+
+void VideoWriter::discardSegment(std::unique_ptr<Segment> seg)
+{
+    // only used for a segment which was prepared for a slice the recording never reached,
+    // so its files contain nothing but headers
+    const auto files = {seg->fname, seg->timestampFname, seg->motionFname};
+    seg.reset();
+    for (const auto &file : files) {
+        if (!file.empty())
+            std::remove(file.c_str());
     }
+}
 
-    if (d->cctx != nullptr) {
-        avcodec_free_context(&d->cctx);
-        d->cctx = nullptr;
+void VideoWriter::switchSegment()
+{
+    auto switchTime = std::chrono::steady_clock::now();
+
+    // this only waits if the next segment is not completely opened yet
+    std::unique_ptr<Segment> next;
+    try {
+        next = d->nextSegment.get();
+    } catch (const std::exception& e) {
+        // we can not really recover from this, so stop accepting new frames and let the
+        // remaining ones go to the current file
+        {
+            const std::lock_guard<std::mutex> lock(d->mutex);
+            d->lastError = e.what();
+            d->acceptFrames = false;
+        }
+        d->spaceAvailableCond.notify_all();
+        return;
     }
-    if (d->octx != nullptr) {
-        if (d->octx->pb != nullptr)
-            avio_close(d->octx->pb);
-        avformat_free_context(d->octx);
-        d->octx = nullptr;
+
+    // the previous segment had a whole slice interval to be closed, so this should never block
+    if (d->closingSegment.valid())
+        d->closingSegment.get();
+
+    // flush and close the finished segment in the background
+    d->closingSegment = std::async(std::launch::async, [this, seg = std::move(d->segment)]() mutable {
+        closeSegment(std::move(seg), true);
+    });
+
+    d->segment = std::move(next);
+    d->currentSliceNo = d->segment->sliceNo;
+    if (d->trace != nullptr)
+        d->trace->complete("switch slice", switchTime, std::chrono::steady_clock::now());
+}
+
+void VideoWriter::finalizeInternal(bool writeTrailer)
+{
+    // stop encoding frames and write the last bits to disk.
+    // wait for the encoding thread to join.
+    // if no thread was running, do nothing
+    stopEncodeThread();
+
+    // a segment that was prepared for the next slice is not needed anymore
+    if (d->nextSegment.valid()) {
+        try {
+            discardSegment(d->nextSegment.get());
+        } catch (const std::exception&) {
+            // opening it failed already, so there is nothing to clean up
+        }
     }
 
+    // wait for the previous slice to be written completely
+    if (d->closingSegment.valid())
+        d->closingSegment.get();
+
+    if (d->segment)
+        closeSegment(std::move(d->segment), writeTrailer);
+
     if (d->alignedInput != nullptr)
         av_freep(&d->alignedInput);
+    d->convertedInput.release();
 
     d->initialized = false;
 }
@@ -444,8 +723,35 @@ void VideoWriter::initialize(const QString &fname, int width, int height, int fp
     // select FFMpeg pixel format of OpenCV matrixes
     d->inputPixFormat = hasColor? AV_PIX_FMT_BGR24 : AV_PIX_FMT_GRAY8;
 
+    // sanity check. 'Raw' is the only "codec" that we allow to only actually work with one
+    // container, all other codecs have to work with all containers.
+    if ((d->codec == VideoCodec::Raw) && (d->container != VideoContainer::AVI)) {
+        std::cerr << "Video codec was set to 'Raw', but container was not 'AVI'. Assuming 'AVI' as desired container format." << std::endl;
+        d->container = VideoContainer::AVI;
+    }
+
+    // adjust the lossless setting to what the codec can do, before any segment reads it
+    if (d->codec == VideoCodec::FFV1)
+        d->lossless = true; // this codec is always lossless
+    if ((d->codec == VideoCodec::MPEG4) && d->lossless) {
+        // NOTE: MPEG-4 has no lossless option
+        std::cerr << "The MPEG-4 codec has no lossless preset, switching to lossy compression." << std::endl;
+        d->lossless = false;
+    }
+
     // initialize encoder
-    initializeInternal();
+    if (!d->activeCounted) {
+        g_activeWriterCount++;
+        d->activeCounted = true;
+    }
+    try {
+        d->segment = openSegment(d->currentSliceNo);
+    } catch (...) {
+        g_activeWriterCount--;
+        d->activeCounted = false;
+        throw;
+    }
+    d->initialized = true;
 
     // start encoding data
     startEncodeThread();
@@ -453,7 +759,21 @@ void VideoWriter::initialize(const QString &fname, int width, int height, int fp
 
 void VideoWriter::finalize()
 {
-    finalizeInternal(true, true);
+    finalizeInternal(true);
+    if (d->activeCounted) {
+        g_activeWriterCount--;
+        d->activeCounted = false;
+    }
+}
+
+int VideoWriter::effectiveEncoderThreads() const
+{
+    if (d->encoderThreads > 0)
+        return std::min(d->encoderThreads, MAX_ENCODER_THREADS);
+
+    const auto cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    const auto writers = std::max({1, d->concurrentWriters, g_activeWriterCount.load()});
+    return std::max(1, std::min(cores / writers, MAX_ENCODER_THREADS));
 }
 
 bool VideoWriter::initialized() const
@@ -471,16 +791,21 @@ void VideoWriter::setCaptureStartTimestamp(const std::chrono::milliseconds &star
     d->captureStartTimestamp = startTimestamp;
 }
 
-bool VideoWriter::prepareFrame(const cv::Mat &inImage)
+bool VideoWriter::prepareFrame(Segment *seg, const cv::Mat &inImage)
 {
     auto image = inImage;
 
     // convert to gray in case the frame has colors attached,
-    // and convert to BGR in case the frame - possibly - has an alpha channel
-    if ((d->inputPixFormat == AV_PIX_FMT_GRAY8) && (image.channels() != 1))
-        cv::cvtColor(inImage, image, cv::COLOR_BGR2GRAY);
-    else if ((d->inputPixFormat == AV_PIX_FMT_BGR24) && (image.channels() == 4))
-        cv::cvtColor(inImage, image, cv::COLOR_BGRA2BGR);
+    // and convert to BGR in case the frame - possibly - has an alpha channel.
+    // The encoder may reference the image data directly, so the converted image
+    // must stay alive until the frame was sent, which a local would not.
+    if ((d->inputPixFormat == AV_PIX_FMT_GRAY8) && (image.channels() != 1)) {
+        cv::cvtColor(inImage, d->convertedInput, cv::COLOR_BGR2GRAY);
+        image = d->convertedInput;
+    } else if ((d->inputPixFormat == AV_PIX_FMT_BGR24) && (image.channels() == 4)) {
+        cv::cvtColor(inImage, d->convertedInput, cv::COLOR_BGRA2BGR);
+        image = d->convertedInput;
+    }
 
     const auto channels = image.channels();
 
@@ -506,6 +831,8 @@ bool VideoWriter::prepareFrame(const cv::Mat &inImage)
     // the supplied input buffer. To ensure that doesn't happen, we pad the
     // step to a multiple of 32 (that's the minimal alignment for which Valgrind
     // doesn't raise any warnings).
+    // Frames captured by the Miniscope class come from a pool which already
+    // aligns them, so this copy is only made for frames from elsewhere.
     const size_t STEP_ALIGNMENT = 32;
     if (step % STEP_ALIGNMENT != 0) {
         auto aligned_step = (step + STEP_ALIGNMENT - 1) & -STEP_ALIGNMENT;
@@ -520,95 +847,119 @@ bool VideoWriter::prepareFrame(const cv::Mat &inImage)
         step = aligned_step;
     }
 
-    if (d->cctx->pix_fmt != d->inputPixFormat) {
+    if (seg->limitedLuma) {
+        // chroma planes were set up once already, only the luma plane changes
+        cv::Mat luma(height, width, CV_8UC1, seg->frame->data[0], static_cast<size_t>(seg->frame->linesize[0]));
+        cv::LUT(cv::Mat(height, width, CV_8UC1, data, step), seg->lumaLut, luma);
+    } else if (seg->grayLuma) {
+        // chroma planes were set up once already, only the luma plane changes
+        seg->frame->data[0] = data;
+        seg->frame->linesize[0] = static_cast<int>(step);
+    } else if (seg->cctx->pix_fmt != d->inputPixFormat) {
         // let input_picture point to the raw data buffer of 'image'
-        av_image_fill_arrays(d->inputFrame->data, d->inputFrame->linesize, static_cast<const uint8_t*>(data), d->inputPixFormat, width, height, 1);
-        d->inputFrame->linesize[0] = static_cast<int>(step);
+        av_image_fill_arrays(seg->inputFrame->data, seg->inputFrame->linesize, static_cast<const uint8_t*>(data), d->inputPixFormat, width, height, 1);
+        seg->inputFrame->linesize[0] = static_cast<int>(step);
 
-        if (sws_scale(d->swsctx, d->inputFrame->data,
-                               d->inputFrame->linesize, 0,
+        if (sws_scale(seg->swsctx, seg->inputFrame->data,
+                               seg->inputFrame->linesize, 0,
                                d->height,
-                               d->frame->data, d->frame->linesize) < 0) {
+                               seg->frame->data, seg->frame->linesize) < 0) {
             d->lastError = "Unable to scale image in pixel format comnversion.";
             return false;
         }
 
     } else {
-        av_image_fill_arrays(d->frame->data, d->frame->linesize, static_cast<const uint8_t*>(data), d->inputPixFormat, width, height, 1);
-        d->frame->linesize[0] = static_cast<int>(step);
+        av_image_fill_arrays(seg->frame->data, seg->frame->linesize, static_cast<const uint8_t*>(data), d->inputPixFormat, width, height, 1);
+        seg->frame->linesize[0] = static_cast<int>(step);
     }
 
-    d->frame->pts = d->framePts++;
+    seg->frame->pts = seg->framePts++;
     return true;
 }
 
-bool VideoWriter::encodeFrame(const cv::Mat &frame, const std::chrono::milliseconds &timestamp)
+bool VideoWriter::encodeFrame(const cv::Mat &frame, const std::chrono::milliseconds &timestamp, const cv::Point2d &motionShift)
 {
     int ret;
 
-    if (!prepareFrame(frame)) {
+    // once the recording is stopped or failed to slice, all remaining frames go to the current file
+    if ((d->fileSliceIntervalMin != 0) && d->acceptFrames) {
+        const auto sliceEnd = d->captureStartTimestamp + std::chrono::minutes(d->fileSliceIntervalMin * d->currentSliceNo);
+
+        // open the file of the next slice in the background shortly before we need it
+        if (!d->nextSegment.valid() && (timestamp >= sliceEnd - SLICE_PREPARE_LEAD))
+            d->nextSegment = std::async(std::launch::async, &VideoWriter::openSegment, this, d->currentSliceNo + 1);
+
+        // the maximum time for this file has elapsed, continue with the next one. This frame
+        // is the first one of the new encoder, and therefore a keyframe.
+        if (timestamp >= sliceEnd)
+            switchSegment();
+    }
+
+    auto seg = d->segment.get();
+    auto stageTime = std::chrono::steady_clock::now();
+
+    if (!prepareFrame(seg, frame)) {
         std::cerr << "Unable to prepare frame. N: " << d->frames_n + 1 << "(" << d->lastError.toStdString() << ")" << std::endl;
         return false;
     }
 
     // encode video frame
-    ret = avcodec_send_frame(d->cctx, d->frame);
+    ret = avcodec_send_frame(seg->cctx, seg->frame);
     if (ret < 0) {
         std::cerr << "Unable to send frame to encoder. N:" << d->frames_n + 1 << std::endl;
         return false;
     }
+    if (d->stats != nullptr)
+        stageTime = d->stats->record(PipelineStage::Encode, stageTime, d->trace);
 
-    AVPacket pkt;
-    pkt.data = nullptr;
-    pkt.size = 0;
-    av_init_packet(&pkt);
-    ret = avcodec_receive_packet(d->cctx, &pkt);
-    if (ret != 0) {
-        // some encoders need to be fed a few frames before they produce a useful result
-        // ignore errors in that case for a little bit.
-        if ((ret == AVERROR(EAGAIN)) &&
-            ((d->codec == VideoCodec::VP9) || (d->codec == VideoCodec::H264) || (d->codec == VideoCodec::HEVC)))
-            return true;
-        else
-            return false;
+    // write all packets the encoder has ready - encoders with lookahead may not have any yet,
+    // or emit several at once
+    if (!receivePackets(seg, d->lastError)) {
+        std::cerr << "Unable to write encoded frame. N:" << d->frames_n + 1 << " (" << d->lastError.toStdString() << ")" << std::endl;
+        return false;
     }
-
-    // rescale packet timestamp
-    pkt.duration = 1;
-    av_packet_rescale_ts(&pkt, d->cctx->time_base, d->vstrm->time_base);
-
-    // write packet
-    av_write_frame(d->octx, &pkt);
-    d->frames_n++;
-    av_packet_unref(&pkt);
+    if (d->stats != nullptr)
+        stageTime = d->stats->record(PipelineStage::Mux, stageTime, d->trace);
 
     // store timestamp (if necessary)
-    const auto tsMsec = timestamp.count();
-    if (d->saveTimestamps)
-        d->timestampFile << d->framePts << "; " << tsMsec << "\n";
-
-    if (d->fileSliceIntervalMin != 0) {
-        const auto tsMin = static_cast<double>(tsMsec - d->captureStartTimestamp.count()) / 1000.0 / 60.0;
-        if (tsMin >= (d->fileSliceIntervalMin * d->currentSliceNo)) {
-            try {
-                // we need to start a new file now since the maximum time for this file has elapsed,
-                // so finalize this one without suspending the thread we are currently in
-                finalizeInternal(true, false);
-
-                // increment current slice number and attempt to reinitialize recording.
-                d->currentSliceNo += 1;
-                initializeInternal();
-            } catch (const std::exception& e) {
-                // propagate error and stop encoding thread, as we can not really recover from this
-                d->lastError = e.what();
-                d->acceptFrames = false;
-            }
-        }
+    if (d->saveTimestamps) {
+        seg->timestampFile << seg->framePts << "; " << timestamp.count() << "\n";
+        if (d->stats != nullptr)
+            d->stats->record(PipelineStage::TimestampWrite, stageTime, d->trace);
     }
+    if (d->saveMotionShifts)
+        seg->motionFile << seg->framePts << "; " << motionShift.x << "; " << motionShift.y << "\n";
 
     return true;
 }
 
+bool VideoWriter::receivePackets(Segment *seg, QString &error)
+{
+    while (true) {
+        auto ret = avcodec_receive_packet(seg->cctx, seg->packet);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return true; // the encoder needs more input, or was flushed completely
+        if (ret < 0) {
+            error = QStringLiteral("Unable to receive packet from encoder: %1").arg(ret);
+            return false;
+        }
+
+        // rescale packet timestamp
+        seg->packet->duration = 1;
+        seg->packet->stream_index = seg->vstrm->index;
+        av_packet_rescale_ts(seg->packet, seg->cctx->time_base, seg->vstrm->time_base);
+
+        // write packet
+        ret = av_write_frame(seg->octx, seg->packet);
+        av_packet_unref(seg->packet);
+        if (ret < 0) {
+            error = QStringLiteral("Unable to write packet: %1").arg(ret);
+            return false;
+        }
+        d->frames_n++;
+    }
+}
+
 void VideoWriter::startEncodeThread()
 {
     assert(d->initialized);
@@ -618,6 +969,8 @@ void VideoWriter::startEncodeThread()
     stopEncodeThread();
     while (!d->frameQueue.empty())
         d->frameQueue.pop();
+    d->queuePeakDepth = 0;
+    d->backpressureCount = 0;
     d->acceptFrames = true;
     d->thread = new std::thread(encodeThread, this);
 }
@@ -628,26 +981,81 @@ void VideoWriter::stopEncodeThread()
         return;
     assert(d->initialized);
 
-    d->acceptFrames = false;
+    {
+        const std::lock_guard<std::mutex> lock(d->mutex);
+        d->acceptFrames = false;
+    }
+    d->frameAvailableCond.notify_all();
     d->thread->join();
     delete d->thread;
     d->thread = nullptr;
 }
 
-bool VideoWriter::pushFrame(const cv::Mat &frame, const std::chrono::milliseconds &time)
+bool VideoWriter::pushFrame(const cv::Mat &frame, const std::chrono::milliseconds &time, const cv::Point2d &motionShift)
 {
-    std::lock_guard<std::mutex> lock(d->mutex);
+    std::unique_lock<std::mutex> lock(d->mutex);
     if (!d->acceptFrames)
         return false;
-    if (d->frameQueue.size() > FRAME_QUEUE_MAX_COUNT) {
-        d->lastError = "Frame encoding buffer was full and new frame could not be added. Maybe encoding or storage is too slow.";
-        return false;
+
+    if (d->frameQueue.size() >= d->queueHighWatermark) {
+        // the encoder can't keep up, hold back the producer until it has caught up a bit
+        d->backpressureCount++;
+        const auto drained = d->spaceAvailableCond.wait_for(lock, QUEUE_BACKPRESSURE_TIMEOUT, [&] {
+            return d->frameQueue.size() <= d->queueLowWatermark || !d->acceptFrames;
+        });
+        if (!d->acceptFrames)
+            return false;
+        if (!drained) {
+            d->lastError = "Frame encoding buffer was full and new frame could not be added. Maybe encoding or storage is too slow.";
+            return false;
+        }
     }
 
-    d->frameQueue.push(std::make_pair(frame, time));
+    d->frameQueue.push({frame, time, motionShift, std::chrono::steady_clock::now()});
+    if (d->frameQueue.size() > d->queuePeakDepth)
+        d->queuePeakDepth = d->frameQueue.size();
+    lock.unlock();
+    d->frameAvailableCond.notify_one();
     return true;
 }
 
+void VideoWriter::setQueueWatermarks(size_t high, size_t low)
+{
+    const std::lock_guard<std::mutex> lock(d->mutex);
+    d->queueHighWatermark = (high < 1)? 1 : high;
+    d->queueLowWatermark = (low < d->queueHighWatermark)? low : d->queueHighWatermark - 1;
+}
+
+size_t VideoWriter::queueHighWatermark() const
+{
+    const std::lock_guard<std::mutex> lock(d->mutex);
+    return d->queueHighWatermark;
+}
+
+size_t VideoWriter::queueLowWatermark() const
+{
+    const std::lock_guard<std::mutex> lock(d->mutex);
+    return d->queueLowWatermark;
+}
+
+size_t VideoWriter::queueDepth() const
+{
+    const std::lock_guard<std::mutex> lock(d->mutex);
+    return d->frameQueue.size();
+}
+
+size_t VideoWriter::queuePeakDepth() const
+{
+    const std::lock_guard<std::mutex> lock(d->mutex);
+    return d->queuePeakDepth;
+}
+
+size_t VideoWriter::backpressureCount() const
+{
+    const std::lock_guard<std::mutex> lock(d->mutex);
+    return d->backpressureCount;
+}
+
 VideoCodec VideoWriter::codec() const
 {
     return d->codec;
@@ -688,6 +1096,67 @@ void VideoWriter::setLossless(bool enabled)
     d->lossless = enabled;
 }
 
+int VideoWriter::concurrentWriters() const
+{
+    return d->concurrentWriters;
+}
+
+void VideoWriter::setConcurrentWriters(int count)
+{
+    d->concurrentWriters = (count < 0)? 0 : count;
+}
+
+int VideoWriter::encoderThreads() const
+{
+    return d->encoderThreads;
+}
+
+void VideoWriter::setEncoderThreads(int count)
+{
+    d->encoderThreads = (count < 0)? 0 : count;
+}
+
+EncoderThreading VideoWriter::encoderThreading() const
+{
+    return d->threading;
+}
+
+void VideoWriter::setEncoderThreading(EncoderThreading threading)
+{
+    d->threading = threading;
+}
+
+int VideoWriter::ffv1Slices() const
+{
+    return d->ffv1Slices;
+}
+
+void VideoWriter::setFfv1Slices(int slices)
+{
+    d->ffv1Slices = (slices < 0)? 0 : slices;
+}
+
+bool VideoWriter::ffv1SliceCrc() const
+{
+    return d->ffv1SliceCrc;
+}
+
+void VideoWriter::setFfv1SliceCrc(bool enabled)
+{
+    d->ffv1SliceCrc = enabled;
+}
+
+bool VideoWriter::saveMotionShifts() const
+{
+    return d->saveMotionShifts;
+}
+
+void VideoWriter::setSaveMotionShifts(bool enabled)
+{
+    // must be set before the video writer is initialized
+    d->saveMotionShifts = enabled;
+}
+
 uint VideoWriter::fileSliceInterval() const
 {
     return d->fileSliceIntervalMin;
@@ -698,6 +1167,29 @@ void VideoWriter::setFileSliceInterval(uint minutes)
     d->fileSliceIntervalMin = minutes;
 }
 
+ThreadScheduling VideoWriter::threadScheduling() const
+{
+    return d->threadScheduling;
+}
+
+void VideoWriter::setThreadScheduling(const ThreadScheduling &sched)
+{
+    // applied when the encoder thread is started
+    d->threadScheduling = sched;
+}
+
+void VideoWriter::setPipelineStats(PipelineStats *stats)
+{
+    // must be set before the encoder thread is started, and outlive it
+    d->stats = stats;
+}
+
+void VideoWriter::setTraceRecorder(TraceRecorder *recorder)
+{
+    // must be set before the encoder thread is started, and outlive it
+    d->traceRecorder = recorder;
+}
+
 QString VideoWriter::lastError() const
 {
     return d->lastError;
@@ -712,24 +1204,39 @@ void VideoWriter::encodeThread(void *vwPtr)
 {
     VideoWriter *self = static_cast<VideoWriter*> (vwPtr);
 
-    while (self->d->acceptFrames) {
-        cv::Mat frame;
-        std::chrono::milliseconds timestamp;
-        while (self->getNextFrameFromQueue(&frame, &timestamp)) {
-            self->encodeFrame(frame, timestamp);
-        }
+    self->d->trace = (self->d->traceRecorder != nullptr)? self->d->traceRecorder->registerThread(QStringLiteral("encoder")) : nullptr;
+
+    QString schedError;
+    if (!self->d->threadScheduling.isDefault() && !applyThreadScheduling(self->d->threadScheduling, &schedError))
+        std::cerr << "Unable to apply scheduling settings for encoder thread: " << schedError.toStdString() << std::endl;
+
+    // sleep until there is work, so idle encoders take no CPU time away from the
+    // acquisition threads (of possibly multiple Miniscopes)
+    QueuedFrame item;
+    while (self->getNextFrameFromQueue(&item)) {
+        if (self->d->stats != nullptr)
+            self->d->stats->record(PipelineStage::EncoderQueue, item.queuedTime);
+        self->encodeFrame(item.frame, item.timestamp, item.motionShift);
     }
 }
 
-bool VideoWriter::getNextFrameFromQueue(cv::Mat *frame, std::chrono::milliseconds *timestamp)
+bool VideoWriter::getNextFrameFromQueue(QueuedFrame *item)
 {
-    std::lock_guard<std::mutex> lock(d->mutex);
-    if (d->frameQueue.empty())
+    std::unique_lock<std::mutex> lock(d->mutex);
+    d->frameAvailableCond.wait(lock, [&] {
+        return !d->frameQueue.empty() || !d->acceptFrames;
+    });
+
+    // when stopping, frames which are already queued are still encoded - unless
+    // the encoder itself failed and was shut down
+    if (d->frameQueue.empty() || !d->initialized)
         return false;
 
-    auto pair = d->frameQueue.front();
-    *frame = pair.first;
-    *timestamp = pair.second;
+    *item = std::move(d->frameQueue.front());
     d->frameQueue.pop();
+    if (d->frameQueue.size() <= d->queueLowWatermark)
+        d->spaceAvailableCond.notify_one();
+    if (d->trace != nullptr)
+        d->trace->counter("encoder queue", static_cast<int64_t>(d->frameQueue.size()));
     return true;
 }
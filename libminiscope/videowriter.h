@@ -22,8 +22,15 @@
 
 #include <QObject>
 #include <chrono>
+#include <memory>
 #include <opencv2/core.hpp>
 #include "mediatypes.h"
+#include "threadsched.h"
+
+namespace MScope {
+class PipelineStats;
+class TraceRecorder;
+}
 
 using namespace MScope;
 
@@ -48,7 +55,26 @@ public:
     std::chrono::milliseconds captureStartTimestamp() const;
     void setCaptureStartTimestamp(const std::chrono::milliseconds& startTimestamp);
 
-    bool pushFrame(const cv::Mat& frame, const std::chrono::milliseconds& time);
+    bool pushFrame(const cv::Mat& frame, const std::chrono::milliseconds& time,
+                   const cv::Point2d& motionShift = cv::Point2d());
+
+    /**
+     * @brief Limits of the encoder queue
+     *
+     * Once the queue holds @p high frames, pushFrame() blocks until the encoder has
+     * brought it down to @p low frames, and fails if that takes too long.
+     */
+    void setQueueWatermarks(size_t high, size_t low);
+    size_t queueHighWatermark() const;
+    size_t queueLowWatermark() const;
+
+    size_t queueDepth() const;
+    size_t queuePeakDepth() const;
+
+    /**
+     * @brief Number of times pushFrame() had to wait for the encoder, since the writer was initialized
+     */
+    size_t backpressureCount() const;
 
     VideoCodec codec() const;
     void setCodec(VideoCodec codec);
@@ -63,22 +89,85 @@ public:
     bool lossless() const;
     void setLossless(bool enabled);
 
+    /**
+     * @brief Number of encoder threads, 0 to pick automatically
+     *
+     * The automatic choice divides the CPU cores by the number of video writers
+     * recording at the same time, see setConcurrentWriters().
+     */
+    int encoderThreads() const;
+    void setEncoderThreads(int count);
+
+    /**
+     * @brief Number of video writers which will record at the same time, 0 if unknown
+     *
+     * Used to share the CPU cores between their encoders. If unknown, only the writers
+     * which are already active when a file is started are counted, so writers started
+     * one after another get fewer and fewer threads, and together use more threads
+     * than there are cores.
+     */
+    int concurrentWriters() const;
+    void setConcurrentWriters(int count);
+
+    EncoderThreading encoderThreading() const;
+    void setEncoderThreading(EncoderThreading threading);
+
+    /**
+     * @brief Number of slices per FFV1 frame, 0 to pick automatically
+     *
+     * Valid values are 4, 6, 9, 12, 16, 24 and 30. Slices are the unit of
+     * parallelism of the FFV1 encoder.
+     */
+    int ffv1Slices() const;
+    void setFfv1Slices(int slices);
+
+    /**
+     * @brief Add a CRC checksum to every FFV1 slice, to detect damaged data
+     */
+    bool ffv1SliceCrc() const;
+    void setFfv1SliceCrc(bool enabled);
+
+    /**
+     * @brief Write the motion shift of every frame to a "_motion.csv" file next to the timestamps
+     */
+    bool saveMotionShifts() const;
+    void setSaveMotionShifts(bool enabled);
+
+    /**
+     * @brief Start a new file every @p minutes, 0 to write everything to one file
+     *
+     * The file of the next slice is opened ahead of time and the finished one is
+     * closed in the background, so slicing does not stall the encoder.
+     */
     uint fileSliceInterval() const;
     void setFileSliceInterval(uint minutes);
 
+    ThreadScheduling threadScheduling() const;
+    void setThreadScheduling(const ThreadScheduling &sched);
+
+    void setPipelineStats(PipelineStats *stats);
+    void setTraceRecorder(TraceRecorder *recorder);
+
     QString lastError() const;
 
 private:
     class Private;
     Q_DISABLE_COPY(VideoWriter)
     QScopedPointer<Private> d;
-
-    void initializeInternal();
-    void finalizeInternal(bool writeTrailer, bool stopRecThread = true);
+    struct QueuedFrame;
+    struct Segment;
+
+    std::unique_ptr<Segment> openSegment(uint sliceNo);
+    void closeSegment(std::unique_ptr<Segment> seg, bool writeTrailer);
+    void discardSegment(std::unique_ptr<Segment> seg);
+    void switchSegment();
+    int effectiveEncoderThreads() const;
+    void finalizeInternal(bool writeTrailer);
     static void encodeThread(void* vwPtr);
-    bool getNextFrameFromQueue(cv::Mat *frame, std::chrono::milliseconds *timestamp);
-    bool prepareFrame(const cv::Mat &inImage);
-    bool encodeFrame(const cv::Mat& frame, const std::chrono::milliseconds& timestamp);
+    bool getNextFrameFromQueue(QueuedFrame *item);
+    bool prepareFrame(Segment *seg, const cv::Mat &inImage);
+    bool receivePackets(Segment *seg, QString &error);
+    bool encodeFrame(const cv::Mat& frame, const std::chrono::milliseconds& timestamp, const cv::Point2d& motionShift);
     void startEncodeThread();
     void stopEncodeThread();
 };
@@ -26,12 +26,17 @@
 #include "qstringtopy.h"
 #include "cvmatndsliceconvert.h"
 #include "miniscope.h"
+#include "miniscopegroup.h"
 
 using namespace MScope;
 namespace py = pybind11;
 
 PYBIND11_MAKE_OPAQUE(std::vector<ControlDefinition>);
 PYBIND11_MAKE_OPAQUE(std::vector<double>);
+PYBIND11_MAKE_OPAQUE(std::vector<float>);
+PYBIND11_MAKE_OPAQUE(std::vector<int>);
+PYBIND11_MAKE_OPAQUE(std::vector<ScopeHealth>);
+PYBIND11_MAKE_OPAQUE(std::vector<StageStatistics>);
 
 PYBIND11_MODULE(miniscope, m)
 {
@@ -39,7 +44,11 @@ PYBIND11_MODULE(miniscope, m)
 
     NDArrayConverter::initNDArray();
     py::bind_vector<std::vector<double>>(m, "VectorDouble");
+    py::bind_vector<std::vector<float>>(m, "VectorFloat");
+    py::bind_vector<std::vector<int>>(m, "VectorInt");
     py::bind_vector<std::vector<ControlDefinition>>(m, "VectorControlDefinition");
+    py::bind_vector<std::vector<ScopeHealth>>(m, "VectorScopeHealth");
+    py::bind_vector<std::vector<StageStatistics>>(m, "VectorStageStatistics");
 
     py::enum_<VideoCodec>(m, "VideoCodec", py::arithmetic())
             .value("UNKNOWN", VideoCodec::Unknown)
@@ -59,9 +68,25 @@ PYBIND11_MODULE(miniscope, m)
             .export_values()
     ;
 
+    py::enum_<EncoderThreading>(m, "EncoderThreading", py::arithmetic())
+            .value("AUTO", EncoderThreading::Auto)
+            .value("FRAME", EncoderThreading::Frame)
+            .value("SLICE", EncoderThreading::Slice)
+            .export_values()
+    ;
+
     py::enum_<DisplayMode>(m, "DisplayMode", py::arithmetic())
             .value("RAW_FRAMES", DisplayMode::RawFrames)
             .value("BACKGROUND_DIFF", DisplayMode::BackgroundDiff)
+            .value("DELTA_F_OVER_F", DisplayMode::DeltaFOverF)
+            .value("MAX_PROJECTION", DisplayMode::MaxProjection)
+            .value("STD_DEVIATION", DisplayMode::StdDeviation)
+            .export_values()
+    ;
+
+    py::enum_<BackgroundModelPrecision>(m, "BackgroundModelPrecision", py::arithmetic())
+            .value("FLOAT", BackgroundModelPrecision::Float)
+            .value("FIXED_POINT", BackgroundModelPrecision::FixedPoint)
             .export_values()
     ;
 
@@ -72,6 +97,103 @@ PYBIND11_MODULE(miniscope, m)
             .export_values()
     ;
 
+    py::enum_<FrameSourceKind>(m, "FrameSourceKind", py::arithmetic())
+            .value("DEVICE", FrameSourceKind::Device)
+            .value("SYNTHETIC", FrameSourceKind::Synthetic)
+            .value("REPLAY", FrameSourceKind::Replay)
+            .value("DEVICE_V4L2", FrameSourceKind::DeviceV4L2)
+            .export_values()
+    ;
+
+    py::enum_<PipelineStage>(m, "PipelineStage", py::arithmetic())
+            .value("GRAB_WAIT", PipelineStage::GrabWait)
+            .value("RETRIEVE", PipelineStage::Retrieve)
+            .value("CONVERSION", PipelineStage::Conversion)
+            .value("MOTION_CORRECTION", PipelineStage::MotionCorrection)
+            .value("ROI_TRACES", PipelineStage::RoiTraces)
+            .value("FRAME_CALLBACK", PipelineStage::FrameCallback)
+            .value("HANDOFF", PipelineStage::Handoff)
+            .value("CYCLE", PipelineStage::Cycle)
+            .value("BACKGROUND_MODEL", PipelineStage::BackgroundModel)
+            .value("DISPLAY_MAPPING", PipelineStage::DisplayMapping)
+            .value("RECORD_HANDOFF", PipelineStage::RecordHandoff)
+            .value("ENCODER_QUEUE", PipelineStage::EncoderQueue)
+            .value("ENCODE", PipelineStage::Encode)
+            .value("MUX", PipelineStage::Mux)
+            .value("TIMESTAMP_WRITE", PipelineStage::TimestampWrite)
+            .export_values()
+    ;
+
+    py::class_<StageStatistics>(m, "StageStatistics")
+        .def(py::init<>())
+
+        .def_readonly("stage", &StageStatistics::stage)
+        .def_readonly("name", &StageStatistics::name)
+        .def_readonly("count", &StageStatistics::count, "Number of measurements since the statistics were last reset")
+        .def_readonly("min_usec", &StageStatistics::minUsec)
+        .def_readonly("mean_usec", &StageStatistics::meanUsec)
+        .def_readonly("max_usec", &StageStatistics::maxUsec)
+        .def_readonly("p50_usec", &StageStatistics::p50Usec)
+        .def_readonly("p90_usec", &StageStatistics::p90Usec)
+        .def_readonly("p99_usec", &StageStatistics::p99Usec)
+        .def_readonly("p999_usec", &StageStatistics::p999Usec)
+        .def_readonly("rate", &StageStatistics::rate, "Measurements per second, over the last few seconds")
+    ;
+
+    py::enum_<ThreadRole>(m, "ThreadRole", py::arithmetic())
+            .value("ACQUISITION", ThreadRole::Acquisition)
+            .value("DISPLAY", ThreadRole::Display)
+            .value("RECORDING", ThreadRole::Recording)
+            .value("CONTROL", ThreadRole::Control)
+            .value("ENCODER", ThreadRole::Encoder)
+            .export_values()
+    ;
+
+    py::enum_<SchedulingPolicy>(m, "SchedulingPolicy", py::arithmetic())
+            .value("DEFAULT", SchedulingPolicy::Default)
+            .value("FIFO", SchedulingPolicy::Fifo)
+            .value("ROUND_ROBIN", SchedulingPolicy::RoundRobin)
+            .export_values()
+    ;
+
+    py::class_<ThreadScheduling>(m, "ThreadScheduling")
+        .def(py::init<>())
+
+        .def_readwrite("policy", &ThreadScheduling::policy, "Scheduling policy of the thread")
+        .def_readwrite("priority", &ThreadScheduling::priority, "Real-time priority, only used with real-time policies")
+        .def_readwrite("nice_level", &ThreadScheduling::niceLevel, "Nice level, only used with the default policy")
+        .def_readwrite("cpus", &ThreadScheduling::cpus, "CPUs the thread may run on, empty for all")
+    ;
+
+    py::class_<SyntheticSourceSettings>(m, "SyntheticSourceSettings")
+        .def(py::init<>())
+
+        .def_readwrite("base_fluorescence", &SyntheticSourceSettings::baseFluorescence, "Mean background brightness, in pixel values")
+        .def_readwrite("noise_level", &SyntheticSourceSettings::noiseLevel, "Standard deviation of the sensor noise, in pixel values")
+        .def_readwrite("cell_count", &SyntheticSourceSettings::cellCount, "Number of simulated active cells")
+        .def_readwrite("activity_rate", &SyntheticSourceSettings::activityRate, "Average number of calcium transients per cell and second")
+        .def_readwrite("drop_rate", &SyntheticSourceSettings::dropRate, "Probability that a frame is dropped")
+        .def_readwrite("timestamp_glitch_rate", &SyntheticSourceSettings::timestampGlitchRate, "Probability that a frame has a bogus timestamp")
+        .def_readwrite("realtime", &SyntheticSourceSettings::realtime, "Deliver frames at the selected framerate, instead of as fast as possible")
+        .def_readwrite("seed", &SyntheticSourceSettings::seed, "Seed for the random generator, 0 to pick one randomly")
+    ;
+
+    py::class_<DisplayFrame>(m, "DisplayFrame")
+        .def(py::init<>())
+
+        .def_property_readonly("frame", [](const DisplayFrame &df) { return df.frame; }, "The frame image")
+        .def_readonly("sequence", &DisplayFrame::sequence, "Increases by one with every display frame, 0 if there was no frame yet")
+        .def_readonly("timestamp", &DisplayFrame::timestamp)
+    ;
+
+    py::class_<RoiTrace>(m, "RoiTrace")
+        .def(py::init<>())
+
+        .def_readonly("values", &RoiTrace::values, "Fluorescence of every ROI, in the order they were added")
+        .def_readonly("sequence", &RoiTrace::sequence, "Number of the frame since acquisition was started")
+        .def_readonly("timestamp", &RoiTrace::timestamp)
+    ;
+
     py::class_<ControlDefinition>(m, "ControlDefinition")
         .def(py::init<>())
 
@@ -93,10 +215,20 @@ PYBIND11_MODULE(miniscope, m)
 
         .def_property_readonly("available_device_types", &Miniscope::availableDeviceTypes, "Get a list of all Miniscope variants we can communicate with")
         .def("load_device_config", &Miniscope::loadDeviceConfig, "Load harware definition for a given Miniscope device type")
+        .def("load_device_definitions", &Miniscope::loadDeviceDefinitions, "Load additional Miniscope device definitions from a JSON file, for all Miniscope instances")
 
         .def_property_readonly("device_type", &Miniscope::deviceType, "get the name of the currently loaded Miniscope device type")
         .def("set_cam_id", &Miniscope::setScopeCamId, "Set the Miniscope camera ID")
 
+        .def_property("frame_source", &Miniscope::frameSourceKind, &Miniscope::setFrameSourceKind, "Where frames are acquired from (takes effect on the next connect)")
+        .def_property("synthetic_source_settings", &Miniscope::syntheticSourceSettings, &Miniscope::setSyntheticSourceSettings, "Settings for the synthetic frame generator")
+        .def_property("replay_filename", &Miniscope::replayFilename, &Miniscope::setReplayFilename, "Video file to replay when using the replay frame source")
+        .def_property("replay_speed", &Miniscope::replaySpeed, &Miniscope::setReplaySpeed, "Replay speed factor, 1 for the original pace, 0 for as fast as possible")
+        .def_property("replay_loop", &Miniscope::replayLoop, &Miniscope::setReplayLoop, "Start over when the end of the replayed video is reached")
+        .def_property("capture_buffer_count", &Miniscope::captureBufferCount, &Miniscope::setCaptureBufferCount, "Number of kernel capture buffers used by the V4L2 frame source")
+        .def("thread_scheduling", &Miniscope::threadScheduling, "Get the scheduling settings for the given thread role")
+        .def("set_thread_scheduling", &Miniscope::setThreadScheduling, "Set scheduling policy, nice level and CPU affinity for the given thread role (takes effect on the next run)")
+
         .def("connect", &Miniscope::connect, "Connect the selected Miniscope")
         .def("disconnect", &Miniscope::disconnect, "Disconnect the selected Miniscope and stop all operations")
         .def("run", &Miniscope::run, "Start image acquisition with the selected settings")
@@ -118,26 +250,140 @@ PYBIND11_MODULE(miniscope, m)
         .def_property_readonly("is_recording", &Miniscope::isRecording, "Is True if we are recording data")
 
         .def_property_readonly("current_disp_frame", &Miniscope::currentDisplayFrame, "Retrieve the current frame intended for display. May not be the recorded frame.")
+        .def_property_readonly("latest_disp_frame", &Miniscope::latestDisplayFrame, "Retrieve the latest display frame with its sequence number, even if it was retrieved before")
+        .def_property("headless", &Miniscope::headless, &Miniscope::setHeadless, "Do not produce any display frames, to save CPU time when only recording")
+        .def_property("display_rate_limit", &Miniscope::displayRateLimit, &Miniscope::setDisplayRateLimit, "Maximum rate at which display frames are produced in Hz, 0 for every frame")
+        .def_property("display_history_length", &Miniscope::displayHistoryLength, &Miniscope::setDisplayHistoryLength, "Number of display frames to keep for take_display_history_frame(), 0 to disable")
+        .def("take_display_history_frame", [](Miniscope &mscope) -> py::object {
+                DisplayFrame frame;
+                if (!mscope.takeDisplayHistoryFrame(frame))
+                    return py::none();
+                return py::cast(frame);
+            }, "Take the oldest frame from the display history, None if it is empty")
         .def_property_readonly("current_fps", &Miniscope::currentFps)
         .def_property_readonly("dropped_frames_count", &Miniscope::droppedFramesCount)
         .def_property_readonly("last_recorded_frame_time", &Miniscope::lastRecordedFrameTime)
+        .def_property_readonly("pipeline_statistics", &Miniscope::pipelineStatistics, "Latency statistics for every stage of the acquisition pipeline")
+        .def("reset_pipeline_statistics", &Miniscope::resetPipelineStatistics, "Reset the pipeline latency statistics")
+        .def_property("trace_filename", &Miniscope::traceFilename, &Miniscope::setTraceFilename, "File to write a Chrome trace of the acquisition pipeline to while running, empty to disable tracing")
 
         .def_property("video_filename", &Miniscope::videoFilename, &Miniscope::setVideoFilename, "The name of the saved video")
         .def_property("video_codec", &Miniscope::videoCodec, &Miniscope::setVideoCodec, "The video codec to use")
         .def_property("video_container", &Miniscope::videoContainer, &Miniscope::setVideoContainer, "The video container to use")
         .def_property("record_lossless", &Miniscope::recordLossless, &Miniscope::setRecordLossless, "Toggle lossless recording, if the codec supports it")
+        .def_property("video_encoder_threads", &Miniscope::videoEncoderThreads, &Miniscope::setVideoEncoderThreads, "Number of video encoder threads, 0 to share the CPU cores between all recording Miniscopes")
+        .def_property("concurrent_recordings", &Miniscope::concurrentRecordings, &Miniscope::setConcurrentRecordings, "Number of Miniscopes recording at the same time, used to share the CPU cores between their encoders (0 if unknown)")
+        .def_property("video_encoder_threading", &Miniscope::videoEncoderThreading, &Miniscope::setVideoEncoderThreading, "Whether the encoder works on multiple frames or on slices of a frame in parallel")
+        .def_property("video_ffv1_slices", &Miniscope::videoFfv1Slices, &Miniscope::setVideoFfv1Slices, "Number of slices per FFV1 frame (4, 6, 9, 12, 16, 24 or 30), 0 to pick automatically")
+        .def_property("video_ffv1_slice_crc", &Miniscope::videoFfv1SliceCrc, &Miniscope::setVideoFfv1SliceCrc, "Add a CRC checksum to every FFV1 slice")
 
         .def_property("min_fluor_display", &Miniscope::minFluorDisplay, &Miniscope::setMinFluorDisplay, "Minimum fluorescence to display")
         .def_property("max_fluor_display", &Miniscope::maxFluorDisplay, &Miniscope::setMaxFluorDisplay, "Maximum fluorescence to display")
         .def_property_readonly("min_fluor", &Miniscope::minFluor, "Minimum fluorescence (pixel value) in the current image")
         .def_property_readonly("max_fluor", &Miniscope::maxFluor, "Maximum fluorescence (pixel value) in the current image")
+        .def_property("auto_contrast", &Miniscope::autoContrast, &Miniscope::setAutoContrast, "Set the display window from percentiles of the pixel values")
+        .def_property_readonly("auto_contrast_low_percentile", &Miniscope::autoContrastLowPercentile)
+        .def_property_readonly("auto_contrast_high_percentile", &Miniscope::autoContrastHighPercentile)
+        .def("set_auto_contrast_percentiles", &Miniscope::setAutoContrastPercentiles, "Set the low and high percentile for auto-contrast")
+        .def_property_readonly("display_histogram", &Miniscope::displayHistogram, "Histogram of the pixel values of the last display frame")
 
         .def_property("display_mode", &Miniscope::displayMode, &Miniscope::setDisplayMode, "Set styling mode for the displayed images")
         .def_property("bg_accumulate_alpha", &Miniscope::bgAccumulateAlpha, &Miniscope::setBgAccumulateAlpha)
+        .def_property("background_model_precision", &Miniscope::backgroundModelPrecision, &Miniscope::setBackgroundModelPrecision,
+                      "Numeric precision of the background model, fixed point is faster")
+
+        .def_property("motion_correction", &Miniscope::motionCorrection, &Miniscope::setMotionCorrection, "Estimate the rigid motion of every frame, and save it alongside recordings")
+        .def_property("motion_correct_display", &Miniscope::motionCorrectDisplay, &Miniscope::setMotionCorrectDisplay, "Show motion corrected frames")
+        .def_property("motion_correct_recording", &Miniscope::motionCorrectRecording, &Miniscope::setMotionCorrectRecording, "Record motion corrected frames")
+        .def_property("motion_correction_downsample", &Miniscope::motionCorrectionDownsample, &Miniscope::setMotionCorrectionDownsample,
+                      "Factor by which frames are shrunk before estimating their motion")
+        .def("set_motion_correction_region", [](Miniscope &mscope, int x, int y, int width, int height) {
+                mscope.setMotionCorrectionRegion(cv::Rect(x, y, width, height));
+            }, "Set the part of the frame (x, y, width, height) the motion is estimated from, an empty region for the whole frame")
+        .def_property_readonly("motion_correction_region", [](const Miniscope &mscope) {
+                const auto region = mscope.motionCorrectionRegion();
+                return py::make_tuple(region.x, region.y, region.width, region.height);
+            }, "Part of the frame (x, y, width, height) the motion is estimated from")
+        .def_property_readonly("motion_shift", [](const Miniscope &mscope) {
+                const auto shift = mscope.motionShift();
+                return py::make_tuple(shift.x, shift.y);
+            }, "Estimated shift (x, y) of the last frame, in pixels")
+
+        .def("add_roi", &Miniscope::addRoi, "Add a ROI from a weight mask with the size of the frames, returns its index in the traces")
+        .def("add_roi_polygon", [](Miniscope &mscope, const py::iterable &points) {
+                std::vector<cv::Point> polygon;
+                for (const auto &point : points) {
+                    const auto xy = point.cast<py::sequence>();
+                    polygon.emplace_back(xy[0].cast<int>(), xy[1].cast<int>());
+                }
+                return mscope.addRoiPolygon(polygon);
+            }, "Add a ROI from a list of (x, y) polygon points, returns its index in the traces")
+        .def("clear_rois", &Miniscope::clearRois, "Remove all ROIs")
+        .def_property_readonly("roi_count", &Miniscope::roiCount)
+        .def_property("roi_neuropil_subtraction", &Miniscope::roiNeuropilSubtraction, &Miniscope::setRoiNeuropilSubtraction,
+                      "Subtract the surrounding neuropil from the ROI traces")
+        .def_property("roi_neuropil_factor", &Miniscope::roiNeuropilFactor, &Miniscope::setRoiNeuropilFactor,
+                      "Weight of the neuropil that is subtracted from the ROI traces")
+        .def_property("roi_trace_history_length", &Miniscope::roiTraceHistoryLength, &Miniscope::setRoiTraceHistoryLength,
+                      "Number of ROI traces to keep for take_roi_trace(), 0 to disable")
+        .def("take_roi_trace", [](Miniscope &mscope) -> py::object {
+                RoiTrace trace;
+                if (!mscope.takeRoiTrace(trace))
+                    return py::none();
+                return py::cast(trace);
+            }, "Take the oldest ROI traces from the history, None if it is empty")
 
         .def_property("recording_slice_interval", &Miniscope::recordingSliceInterval, &Miniscope::setRecordingSliceInterval, "The interval at which new video files should be started when recording, in minutes")
+        .def("set_encoder_queue_watermarks", &Miniscope::setEncoderQueueWatermarks, "Set the encoder queue depth (high, low) at which recording waits for the encoder, and at which it resumes")
+        .def_property_readonly("encoder_queue_high_watermark", &Miniscope::encoderQueueHighWatermark)
+        .def_property_readonly("encoder_queue_low_watermark", &Miniscope::encoderQueueLowWatermark)
+        .def_property_readonly("encoder_queue_depth", &Miniscope::encoderQueueDepth, "Number of frames waiting to be encoded")
+        .def_property_readonly("encoder_queue_peak_depth", &Miniscope::encoderQueuePeakDepth, "Most frames waiting to be encoded at once during the current recording")
+        .def_property_readonly("encoder_backpressure_count", &Miniscope::encoderBackpressureCount, "Number of times recording had to wait for the encoder during the current recording")
 
         .def("set_print_extra_debug", &Miniscope::setPrintExtraDebug, "Set whether protocol transmission debug messages should be printed to stdout")
         .def_property_readonly("last_error", &Miniscope::lastError, "Message of the last error, if there was one")
     ;
+
+    py::class_<ScopeHealth>(m, "ScopeHealth")
+        .def(py::init<>())
+
+        .def_readonly("device_type", &ScopeHealth::deviceType)
+        .def_readonly("cam_id", &ScopeHealth::scopeCamId)
+        .def_readonly("connected", &ScopeHealth::connected)
+        .def_readonly("running", &ScopeHealth::running)
+        .def_readonly("recording", &ScopeHealth::recording)
+        .def_readonly("current_fps", &ScopeHealth::currentFps)
+        .def_readonly("dropped_frames", &ScopeHealth::droppedFrames)
+        .def_readonly("last_recorded_frame_time", &ScopeHealth::lastRecordedFrameTime)
+        .def_readonly("last_error", &ScopeHealth::lastError)
+    ;
+
+    py::class_<MiniscopeGroup>(m, "MiniscopeGroup")
+        .def(py::init<>())
+
+        .def("add_scope", &MiniscopeGroup::addScope, py::return_value_policy::reference_internal, "Add a new Miniscope to the group and return it for configuration")
+        .def("scope", [](const MiniscopeGroup &g, size_t idx) {
+                const auto scopes = g.scopes();
+                if (idx >= scopes.size())
+                    throw py::index_error();
+                return scopes[idx];
+            }, py::return_value_policy::reference_internal, "Get the Miniscope with the given index")
+        .def_property_readonly("count", &MiniscopeGroup::count, "Number of Miniscopes in this group")
+
+        .def("connect", &MiniscopeGroup::connect, "Connect all Miniscopes of the group")
+        .def("disconnect", &MiniscopeGroup::disconnect, "Disconnect all Miniscopes and stop all operations")
+        .def("run", &MiniscopeGroup::run, "Start acquisition on all Miniscopes, using a shared time base")
+        .def("stop", &MiniscopeGroup::stop, "Stop acquisition on all Miniscopes")
+        .def("start_recording", &MiniscopeGroup::startRecording, "Start recording on all Miniscopes at the same time")
+        .def("stop_recording", &MiniscopeGroup::stopRecording, "Finish the current recordings")
+
+        .def_property_readonly("is_running", &MiniscopeGroup::isRunning)
+        .def_property_readonly("is_recording", &MiniscopeGroup::isRecording)
+        .def_property_readonly("health", &MiniscopeGroup::health, "Status of the individual Miniscopes")
+        .def_property_readonly("healthy", &MiniscopeGroup::healthy, "Is True if all Miniscopes are acquiring without errors")
+        .def_property_readonly("dropped_frames_count", &MiniscopeGroup::droppedFramesCount)
+        .def_property_readonly("recording_time_spread", &MiniscopeGroup::recordingTimeSpread, "Difference between the last recorded frame times of all Miniscopes")
+        .def_property_readonly("last_error", &MiniscopeGroup::lastError, "Message of the last error, if there was one")
+    ;
 }
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "diagnosticsdialog.h"
+
+#include <QTableWidget>
+#include <QHeaderView>
+#include <QTimer>
+#include <QLabel>
+#include <QPushButton>
+#include <QVBoxLayout>
+#include <QHBoxLayout>
+#include <miniscope.h>
+
+using namespace MScope;
+
+DiagnosticsDialog::DiagnosticsDialog(Miniscope *mscope, QWidget *parent)
+    : QDialog(parent),
+      m_mscope(mscope)
+{
+    setWindowTitle(QStringLiteral("Pipeline Diagnostics"));
+    resize(760, 420);
+
+    const auto layout = new QVBoxLayout(this);
+
+    const QStringList headers = {QStringLiteral("Stage"),
+                                 QStringLiteral("Count"),
+                                 QStringLiteral("Rate [1/s]"),
+                                 QStringLiteral("Mean [µs]"),
+                                 QStringLiteral("p50 [µs]"),
+                                 QStringLiteral("p90 [µs]"),
+                                 QStringLiteral("p99 [µs]"),
+                                 QStringLiteral("p99.9 [µs]"),
+                                 QStringLiteral("Max [µs]")};
+    m_table = new QTableWidget(this);
+    m_table->setColumnCount(headers.length());
+    m_table->setHorizontalHeaderLabels(headers);
+    m_table->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    m_table->setSelectionMode(QAbstractItemView::NoSelection);
+    m_table->verticalHeader()->setVisible(false);
+    m_table->horizontalHeader()->setSectionResizeMode(QHeaderView::ResizeToContents);
+    layout->addWidget(m_table);
+
+    const auto hint = new QLabel(QStringLiteral("Stages whose p99 latency gets close to the frame interval will soon cause dropped frames."), this);
+    hint->setWordWrap(true);
+    layout->addWidget(hint);
+
+    const auto buttonLayout = new QHBoxLayout;
+    const auto resetButton = new QPushButton(QStringLiteral("Reset"), this);
+    const auto closeButton = new QPushButton(QStringLiteral("Close"), this);
+    buttonLayout->addStretch();
+    buttonLayout->addWidget(resetButton);
+    buttonLayout->addWidget(closeButton);
+    layout->addLayout(buttonLayout);
+
+    connect(resetButton, &QPushButton::clicked, this, [this]() {
+        m_mscope->resetPipelineStatistics();
+        updateStatistics();
+    });
+    connect(closeButton, &QPushButton::clicked, this, &QDialog::close);
+
+    m_timer = new QTimer(this);
+    m_timer->setInterval(1000);
+    connect(m_timer, &QTimer::timeout, this, &DiagnosticsDialog::updateStatistics);
+}
+
+void DiagnosticsDialog::showEvent(QShowEvent *event)
+{
+    updateStatistics();
+    m_timer->start();
+    QDialog::showEvent(event);
+}
+
+void DiagnosticsDialog::hideEvent(QHideEvent *event)
+{
+    m_timer->stop();
+    QDialog::hideEvent(event);
+}
+
+void DiagnosticsDialog::updateStatistics()
+{
+    const auto allStats = m_mscope->pipelineStatistics();
+    m_table->setRowCount(static_cast<int>(allStats.size()));
+
+    auto setCell = [this](int row, int column, const QString &text) {
+        auto item = m_table->item(row, column);
+        if (item == nullptr) {
+            item = new QTableWidgetItem;
+            if (column > 0)
+                item->setTextAlignment(Qt::AlignRight | Qt::AlignVCenter);
+            m_table->setItem(row, column, item);
+        }
+        item->setText(text);
+    };
+
+    for (int row = 0; row < static_cast<int>(allStats.size()); row++) {
+        const auto &stats = allStats[static_cast<size_t>(row)];
+        setCell(row, 0, stats.name);
+        setCell(row, 1, QString::number(stats.count));
+        setCell(row, 2, QString::number(stats.rate, 'f', 1));
+        setCell(row, 3, QString::number(stats.meanUsec, 'f', 1));
+        setCell(row, 4, QString::number(stats.p50Usec, 'f', 1));
+        setCell(row, 5, QString::number(stats.p90Usec, 'f', 1));
+        setCell(row, 6, QString::number(stats.p99Usec, 'f', 1));
+        setCell(row, 7, QString::number(stats.p999Usec, 'f', 1));
+        setCell(row, 8, QString::number(stats.maxUsec, 'f', 1));
+    }
+}
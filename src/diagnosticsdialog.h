@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <QDialog>
+
+class QTableWidget;
+class QTimer;
+namespace MScope {
+class Miniscope;
+}
+
+/**
+ * @brief Shows live latency statistics of the acquisition pipeline stages
+ */
+class DiagnosticsDialog : public QDialog
+{
+    Q_OBJECT
+public:
+    explicit DiagnosticsDialog(MScope::Miniscope *mscope, QWidget *parent = nullptr);
+
+protected:
+    void showEvent(QShowEvent *event) override;
+    void hideEvent(QHideEvent *event) override;
+
+private slots:
+    void updateStatistics();
+
+private:
+    MScope::Miniscope *m_mscope;
+    QTableWidget *m_table;
+    QTimer *m_timer;
+};
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "histogramwidget.h"
+
+#include <algorithm>
+#include <cmath>
+#include <QPainter>
+#include <QPainterPath>
+
+HistogramWidget::HistogramWidget(QWidget *parent)
+    : QWidget(parent),
+      m_windowMin(0),
+      m_windowMax(255)
+{
+    setMinimumHeight(48);
+    setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Fixed);
+}
+
+void HistogramWidget::setHistogram(const std::vector<int> &histogram)
+{
+    m_histogram = histogram;
+    update();
+}
+
+void HistogramWidget::setDisplayWindow(int min, int max)
+{
+    if (m_windowMin == min && m_windowMax == max)
+        return;
+    m_windowMin = min;
+    m_windowMax = max;
+    update();
+}
+
+void HistogramWidget::paintEvent(QPaintEvent *)
+{
+    QPainter painter(this);
+    painter.fillRect(rect(), palette().base());
+    if (m_histogram.empty())
+        return;
+
+    const auto binWidth = static_cast<double>(width()) / m_histogram.size();
+
+    // shade everything outside of the display window
+    const auto shade = palette().color(QPalette::Disabled, QPalette::Window);
+    painter.fillRect(QRectF(0, 0, m_windowMin * binWidth, height()), shade);
+    painter.fillRect(QRectF((m_windowMax + 1) * binWidth, 0, width(), height()), shade);
+
+    // counts span a huge range, a log scale keeps the interesting parts visible
+    const auto maxCount = *std::max_element(m_histogram.begin(), m_histogram.end());
+    if (maxCount <= 0)
+        return;
+    const auto scale = height() / std::log1p(static_cast<double>(maxCount));
+
+    QPainterPath path;
+    path.moveTo(0, height());
+    for (size_t i = 0; i < m_histogram.size(); i++) {
+        const auto y = height() - std::log1p(static_cast<double>(m_histogram[i])) * scale;
+        path.lineTo(i * binWidth, y);
+        path.lineTo((i + 1) * binWidth, y);
+    }
+    path.lineTo(width(), height());
+    path.closeSubpath();
+    painter.fillPath(path, palette().highlight());
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef HISTOGRAMWIDGET_H
+#define HISTOGRAMWIDGET_H
+
+#include <vector>
+#include <QWidget>
+
+/**
+ * @brief Small plot of a pixel value histogram and the current display window
+ */
+class HistogramWidget : public QWidget
+{
+    Q_OBJECT
+
+public:
+    explicit HistogramWidget(QWidget *parent = nullptr);
+
+    void setHistogram(const std::vector<int> &histogram);
+    void setDisplayWindow(int min, int max);
+
+protected:
+    void paintEvent(QPaintEvent *event) override;
+
+private:
+    std::vector<int> m_histogram;
+    int m_windowMin;
+    int m_windowMax;
+};
+
+#endif // HISTOGRAMWIDGET_H
@@ -30,10 +30,20 @@
 #include <QDateTime>
 #include <QSettings>
 #include <QInputDialog>
+#include <QDialog>
+#include <QDialogButtonBox>
+#include <QGridLayout>
+#include <QComboBox>
+#include <QSpinBox>
+#include <QLineEdit>
+#include <QSignalBlocker>
+#include <QThread>
 #include <miniscope.h>
 
 #include "imageviewwidget.h"
 #include "mscontrolwidget.h"
+#include "diagnosticsdialog.h"
+#include "histogramwidget.h"
 
 #ifdef Q_OS_LINUX
 #include <KSharedConfig>
@@ -42,6 +52,38 @@
 
 using namespace MScope;
 
+static std::vector<int> parseCpuList(const QString &text)
+{
+    // accepts lists like "0,2,4-7", CPUs the system does not have are dropped
+    std::vector<int> cpus;
+    const auto lastCpu = std::max(QThread::idealThreadCount(), 1) - 1;
+    for (const auto &part : text.split(QLatin1Char(','))) {
+        if (part.trimmed().isEmpty())
+            continue;
+        const auto range = part.trimmed().split(QLatin1Char('-'));
+        bool okFirst = false;
+        bool okLast = true;
+        const auto first = range.first().toInt(&okFirst);
+        auto last = range.size() > 1? range.last().toInt(&okLast) : first;
+        if (!okFirst || !okLast)
+            continue;
+        if (first < 0 || first > last)
+            continue;
+        last = std::min(last, lastCpu);
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+static QString cpuListToString(const std::vector<int> &cpus)
+{
+    QStringList parts;
+    for (const auto cpu : cpus)
+        parts.append(QString::number(cpu));
+    return parts.join(QLatin1Char(','));
+}
+
 static bool darkColorSchemeAvailable()
 {
 #ifdef Q_OS_LINUX
@@ -169,7 +211,12 @@ MainWindow::MainWindow(QWidget *parent) :
     m_scopeView = new ImageViewWidget(this);
     ui->videoDisplayWidget->layout()->addWidget(m_scopeView);
 
+    // histogram of the displayed values, below the display settings
+    m_histogramView = new HistogramWidget(ui->groupBoxDisplay);
+    ui->verticalLayout_5->addWidget(m_histogramView);
+
     m_mscope = new Miniscope();
+    m_diagDialog = nullptr;
     m_mscope->setOnStatusMessage([&](const QString &msg, void*) {
         setStatusText(msg);
     });
@@ -210,10 +257,14 @@ MainWindow::MainWindow(QWidget *parent) :
     }
     setUseUnixTimestamps(settings.value("recording/useUnixTimestamps", false).toBool());
     ui->sliceIntervalSpinBox->setValue(settings.value("recording/videoSliceInterval", 5).toInt());
+    loadThreadScheduling();
 
     // set display modes
     ui->displayModeCB->addItem(QStringLiteral("Raw Data"), QVariant::fromValue(DisplayMode::RawFrames));
     ui->displayModeCB->addItem(QStringLiteral("F - F₀"), QVariant::fromValue(DisplayMode::BackgroundDiff));
+    ui->displayModeCB->addItem(QStringLiteral("ΔF/F₀"), QVariant::fromValue(DisplayMode::DeltaFOverF));
+    ui->displayModeCB->addItem(QStringLiteral("Max Projection"), QVariant::fromValue(DisplayMode::MaxProjection));
+    ui->displayModeCB->addItem(QStringLiteral("Std. Deviation"), QVariant::fromValue(DisplayMode::StdDeviation));
 
     // set device list
     ui->deviceTypeComboBox->addItems(m_mscope->availableDeviceTypes());
@@ -409,6 +460,16 @@ void MainWindow::on_btnDevConnect_clicked()
             ui->labelScopeMin->setText(QString::number(m_mscope->minFluor()).rightJustified(3, '0'));
             ui->labelScopeMax->setText(QString::number(m_mscope->maxFluor()).rightJustified(3, '0'));
 
+            m_histogramView->setHistogram(m_mscope->displayHistogram());
+            m_histogramView->setDisplayWindow(m_mscope->minFluorDisplay(), m_mscope->maxFluorDisplay());
+            if (m_mscope->autoContrast()) {
+                // show the automatically picked window, without feeding it back to the Miniscope
+                const QSignalBlocker minBlocker(ui->sbDisplayMin);
+                const QSignalBlocker maxBlocker(ui->sbDisplayMax);
+                ui->sbDisplayMin->setValue(m_mscope->minFluorDisplay());
+                ui->sbDisplayMax->setValue(m_mscope->maxFluorDisplay());
+            }
+
             auto recMsecTimestamp = static_cast<int>(m_mscope->lastRecordedFrameTime().count());
             if (recMsecTimestamp > 0) {
                 if (m_useUnixTimestamps) {
@@ -568,6 +629,17 @@ void MainWindow::on_btnDispLimitsReset_clicked()
     ui->btnDispLimitsReset->setEnabled(false);
 }
 
+void MainWindow::on_cbAutoContrast_toggled(bool checked)
+{
+    m_mscope->setAutoContrast(checked);
+    ui->displayMinMaxWidget->setEnabled(!checked);
+}
+
+void MainWindow::on_cbMotionCorrection_toggled(bool checked)
+{
+    m_mscope->setMotionCorrection(checked);
+}
+
 void MainWindow::on_btnOpenSaveDir_clicked()
 {
     on_actionSetDataLocation_triggered();
@@ -643,8 +715,8 @@ void MainWindow::on_displayModeCB_currentIndexChanged(int)
 {
     const auto mode = ui->displayModeCB->currentData().value<DisplayMode>();
 
-    ui->accAlphaSpinBox->setEnabled(mode == DisplayMode::BackgroundDiff);
-    ui->accumulateAlphaLabel->setEnabled(mode == DisplayMode::BackgroundDiff);
+    ui->accAlphaSpinBox->setEnabled(mode != DisplayMode::RawFrames);
+    ui->accumulateAlphaLabel->setEnabled(mode != DisplayMode::RawFrames);
 
     m_mscope->setDisplayMode(mode);
 }
@@ -664,6 +736,14 @@ void MainWindow::on_actionShowMiniscopeLog_toggled(bool arg1)
     ui->logTextList->setVisible(arg1);
 }
 
+void MainWindow::on_actionShowDiagnostics_triggered()
+{
+    if (m_diagDialog == nullptr)
+        m_diagDialog = new DiagnosticsDialog(m_mscope, this);
+    m_diagDialog->show();
+    m_diagDialog->raise();
+}
+
 void MainWindow::on_actionUseDarkTheme_toggled(bool arg1)
 {
 #ifdef Q_OS_LINUX
@@ -692,3 +772,110 @@ void MainWindow::on_actionSetTimestampStyle_triggered()
             setUseUnixTimestamps(true);
     }
 }
+
+void MainWindow::loadThreadScheduling()
+{
+    QSettings settings(qApp->organizationName(), qApp->applicationName());
+    for (int i = 0; i < static_cast<int>(ThreadRole::Last); i++) {
+        const auto role = static_cast<ThreadRole>(i);
+        const auto group = QStringLiteral("threads/%1/").arg(QString::fromStdString(threadRoleToString(role)));
+
+        ThreadScheduling sched;
+        sched.policy = static_cast<SchedulingPolicy>(settings.value(group + "policy", 0).toInt());
+        sched.priority = settings.value(group + "priority", 0).toInt();
+        sched.niceLevel = settings.value(group + "niceLevel", 0).toInt();
+        sched.cpus = parseCpuList(settings.value(group + "cpus").toString());
+        m_mscope->setThreadScheduling(role, sched);
+    }
+}
+
+void MainWindow::saveThreadScheduling()
+{
+    QSettings settings(qApp->organizationName(), qApp->applicationName());
+    for (int i = 0; i < static_cast<int>(ThreadRole::Last); i++) {
+        const auto role = static_cast<ThreadRole>(i);
+        const auto group = QStringLiteral("threads/%1/").arg(QString::fromStdString(threadRoleToString(role)));
+
+        const auto sched = m_mscope->threadScheduling(role);
+        settings.setValue(group + "policy", static_cast<int>(sched.policy));
+        settings.setValue(group + "priority", sched.priority);
+        settings.setValue(group + "niceLevel", sched.niceLevel);
+        settings.setValue(group + "cpus", cpuListToString(sched.cpus));
+    }
+}
+
+void MainWindow::on_actionSetThreadScheduling_triggered()
+{
+    QDialog dialog(this);
+    dialog.setWindowTitle(QStringLiteral("Thread scheduling"));
+    auto layout = new QGridLayout(&dialog);
+
+    layout->addWidget(new QLabel(QStringLiteral("Thread"), &dialog), 0, 0);
+    layout->addWidget(new QLabel(QStringLiteral("Policy"), &dialog), 0, 1);
+    layout->addWidget(new QLabel(QStringLiteral("RT Priority"), &dialog), 0, 2);
+    layout->addWidget(new QLabel(QStringLiteral("Nice Level"), &dialog), 0, 3);
+    layout->addWidget(new QLabel(QStringLiteral("CPUs"), &dialog), 0, 4);
+
+    QList<QComboBox*> policyBoxes;
+    QList<QSpinBox*> prioBoxes;
+    QList<QSpinBox*> niceBoxes;
+    QList<QLineEdit*> cpuEdits;
+    for (int i = 0; i < static_cast<int>(ThreadRole::Last); i++) {
+        const auto role = static_cast<ThreadRole>(i);
+        const auto sched = m_mscope->threadScheduling(role);
+        auto roleName = QString::fromStdString(threadRoleToString(role));
+        roleName[0] = roleName[0].toUpper();
+
+        auto policyBox = new QComboBox(&dialog);
+        policyBox->addItem(QStringLiteral("Default"), QVariant::fromValue(static_cast<int>(SchedulingPolicy::Default)));
+        policyBox->addItem(QStringLiteral("Real-time (FIFO)"), QVariant::fromValue(static_cast<int>(SchedulingPolicy::Fifo)));
+        policyBox->addItem(QStringLiteral("Real-time (Round-Robin)"), QVariant::fromValue(static_cast<int>(SchedulingPolicy::RoundRobin)));
+        policyBox->setCurrentIndex(static_cast<int>(sched.policy));
+
+        auto prioBox = new QSpinBox(&dialog);
+        prioBox->setRange(1, 99);
+        prioBox->setValue(sched.priority > 0? sched.priority : 50);
+
+        auto niceBox = new QSpinBox(&dialog);
+        niceBox->setRange(-20, 19);
+        niceBox->setValue(sched.niceLevel);
+
+        auto cpuEdit = new QLineEdit(cpuListToString(sched.cpus), &dialog);
+        cpuEdit->setPlaceholderText(QStringLiteral("all"));
+        cpuEdit->setToolTip(QStringLiteral("Comma-separated list of CPUs, ranges like 2-3 are allowed"));
+
+        layout->addWidget(new QLabel(roleName, &dialog), i + 1, 0);
+        layout->addWidget(policyBox, i + 1, 1);
+        layout->addWidget(prioBox, i + 1, 2);
+        layout->addWidget(niceBox, i + 1, 3);
+        layout->addWidget(cpuEdit, i + 1, 4);
+        policyBoxes.append(policyBox);
+        prioBoxes.append(prioBox);
+        niceBoxes.append(niceBox);
+        cpuEdits.append(cpuEdit);
+    }
+
+    auto note = new QLabel(QStringLiteral("Changes take effect the next time the Miniscope is started. "
+                                          "Real-time policies and negative nice levels may need extra permissions, "
+                                          "settings that can not be applied are ignored."), &dialog);
+    note->setWordWrap(true);
+    layout->addWidget(note, layout->rowCount(), 0, 1, 5);
+
+    auto buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel, &dialog);
+    connect(buttons, &QDialogButtonBox::accepted, &dialog, &QDialog::accept);
+    connect(buttons, &QDialogButtonBox::rejected, &dialog, &QDialog::reject);
+    layout->addWidget(buttons, layout->rowCount(), 0, 1, 5);
+
+    if (dialog.exec() != QDialog::Accepted)
+        return;
+
+    for (int i = 0; i < static_cast<int>(ThreadRole::Last); i++) {
+        ThreadScheduling sched;
+        sched.policy = static_cast<SchedulingPolicy>(policyBoxes[i]->currentData().toInt());
+        sched.priority = prioBoxes[i]->value();
+        sched.niceLevel = niceBoxes[i]->value();
+        sched.cpus = parseCpuList(cpuEdits[i]->text());
+        m_mscope->setThreadScheduling(static_cast<ThreadRole>(i), sched);
+    }
+    saveThreadScheduling();
+}
@@ -24,6 +24,8 @@
 #include <QVBoxLayout>
 
 class ImageViewWidget;
+class DiagnosticsDialog;
+class HistogramWidget;
 class MSControlWidget;
 class QLabel;
 namespace MScope {
@@ -55,6 +57,8 @@ private slots:
     void on_sbDisplayMax_valueChanged(int arg1);
     void on_sbDisplayMin_valueChanged(int arg1);
     void on_btnDispLimitsReset_clicked();
+    void on_cbAutoContrast_toggled(bool checked);
+    void on_cbMotionCorrection_toggled(bool checked);
     void on_sliceIntervalSpinBox_valueChanged(int arg1);
 
     void on_actionAbout_triggered();
@@ -67,8 +71,10 @@ private slots:
     void on_accAlphaSpinBox_valueChanged(double arg1);
 
     void on_actionShowMiniscopeLog_toggled(bool arg1);
+    void on_actionShowDiagnostics_triggered();
     void on_actionUseDarkTheme_toggled(bool arg1);
     void on_actionSetTimestampStyle_triggered();
+    void on_actionSetThreadScheduling_triggered();
 
 protected:
     void closeEvent(QCloseEvent *event) override;
@@ -81,6 +87,8 @@ private:
     QList<MSControlWidget*> m_controls;
     QVBoxLayout *m_controlsLayout;
     ImageViewWidget *m_scopeView;
+    HistogramWidget *m_histogramView;
+    DiagnosticsDialog *m_diagDialog;
 
     QString m_dataDir;
     bool m_useUnixTimestamps;
@@ -92,4 +100,6 @@ private:
     void setStatusText(const QString& msg);
     void setDataExportDir(const QString& dir);
     void setUseUnixTimestamps(bool useUnixTimestamp);
+    void loadThreadScheduling();
+    void saveThreadScheduling();
 };
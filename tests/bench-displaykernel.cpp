@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "displaykernel.h"
+#include "testframes.h"
+
+using namespace MScope;
+
+static const int WARMUP_FRAMES = 20;
+static const int MEASURED_FRAMES = 300;
+static const double BG_ALPHA = 0.01;
+static const int MIN_DISPLAY = 0;
+static const int MAX_DISPLAY = 255;
+
+/**
+ * Median time per frame of @p process, in microseconds
+ */
+static double benchmark(const std::vector<cv::Mat> &frames, const std::function<void(const cv::Mat&)> &process)
+{
+    for (int i = 0; i < WARMUP_FRAMES; i++)
+        process(frames[static_cast<size_t>(i) % frames.size()]);
+
+    std::vector<double> times;
+    times.reserve(MEASURED_FRAMES);
+    for (int i = 0; i < MEASURED_FRAMES; i++) {
+        const auto &frame = frames[static_cast<size_t>(i) % frames.size()];
+        const auto start = std::chrono::steady_clock::now();
+        process(frame);
+        const auto end = std::chrono::steady_clock::now();
+        times.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+    }
+
+    std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+    return times[times.size() / 2];
+}
+
+static void benchmarkSize(int width, int height)
+{
+    const auto frames = makeTestFrames(width, height, 64);
+    std::printf("%dx%d, median time per frame:\n", width, height);
+
+    // the sequence of OpenCV calls the display path used before DisplayKernel existed
+    cv::Mat accumulatedMat;
+    double minF, maxF;
+    const auto openCvTime = benchmark(frames, [&](const cv::Mat &frame) {
+        cv::Mat displayFrame;
+        frame.copyTo(displayFrame);
+        if (accumulatedMat.rows == 0)
+            accumulatedMat = cv::Mat::zeros(frame.rows, frame.cols, CV_32FC(frame.channels()));
+
+        cv::Mat displayF32;
+        displayFrame.convertTo(displayF32, CV_32F, 1.0 / 255.0);
+        cv::accumulateWeighted(displayF32, accumulatedMat, BG_ALPHA);
+        cv::Mat tmpBgMat;
+        accumulatedMat.convertTo(tmpBgMat, CV_8UC1, 255.0);
+        cv::subtract(displayFrame, tmpBgMat, displayFrame);
+
+        cv::minMaxLoc(displayFrame, &minF, &maxF);
+        displayFrame.convertTo(displayFrame, CV_8U, 255.0 / (MAX_DISPLAY - MIN_DISPLAY),
+                               -MIN_DISPLAY * 255.0 / (MAX_DISPLAY - MIN_DISPLAY));
+    });
+    std::printf("  %-28s %9.1f us\n", "OpenCV sequence", openCvTime);
+
+    for (const auto isa : DisplayKernel::availableIsas()) {
+        for (const auto precision : {BackgroundModelPrecision::Float, BackgroundModelPrecision::FixedPoint}) {
+            DisplayKernel kernel;
+            kernel.setIsa(isa);
+            kernel.setPrecision(precision);
+            cv::Mat out;
+            const auto time = benchmark(frames, [&](const cv::Mat &frame) {
+                kernel.process(frame, out, DisplayMode::BackgroundDiff, BG_ALPHA, MIN_DISPLAY, MAX_DISPLAY);
+            });
+
+            char name[64];
+            std::snprintf(name, sizeof(name), "DisplayKernel %s, %s", isa,
+                          precision == BackgroundModelPrecision::FixedPoint? "fixed" : "float");
+            std::printf("  %-28s %9.1f us  (%.1fx)\n", name, time, openCvTime / time);
+        }
+    }
+}
+
+int main()
+{
+    // the sensor sizes of the Miniscope V4 and of larger CMOS cameras
+    benchmarkSize(608, 608);
+    benchmarkSize(1024, 768);
+    return 0;
+}
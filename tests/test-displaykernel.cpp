@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "displaykernel.h"
+#include "testframes.h"
+
+using namespace MScope;
+
+static int g_failures = 0;
+
+static void fail(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    std::fprintf(stderr, "FAIL: ");
+    std::vfprintf(stderr, format, args);
+    std::fprintf(stderr, "\n");
+    va_end(args);
+    g_failures++;
+}
+
+static const char *modeName(DisplayMode mode)
+{
+    switch (mode) {
+    case DisplayMode::RawFrames: return "raw";
+    case DisplayMode::BackgroundDiff: return "background difference";
+    case DisplayMode::DeltaFOverF: return "dF/F";
+    case DisplayMode::MaxProjection: return "max projection";
+    case DisplayMode::StdDeviation: return "standard deviation";
+    }
+    return "unknown";
+}
+
+/**
+ * The fixed point background model must not change the background difference
+ * display by more than one gray level, compared to the float model.
+ */
+static void testFixedPointMatchesFloat(const std::vector<cv::Mat> &frames)
+{
+    for (const auto alpha : {0.01, 0.05, 0.2}) {
+        DisplayKernel reference;
+        DisplayKernel fixed;
+        fixed.setPrecision(BackgroundModelPrecision::FixedPoint);
+
+        int maxDiff = 0;
+        size_t differentCount = 0;
+        size_t totalCount = 0;
+        cv::Mat refOut, fixedOut;
+        for (const auto &frame : frames) {
+            // a 0-255 window shows the values before contrast mapping, which may scale up any difference
+            reference.process(frame, refOut, DisplayMode::BackgroundDiff, alpha, 0, 255);
+            fixed.process(frame, fixedOut, DisplayMode::BackgroundDiff, alpha, 0, 255);
+
+            for (int y = 0; y < frame.rows; y++) {
+                const auto a = refOut.ptr<uint8_t>(y);
+                const auto b = fixedOut.ptr<uint8_t>(y);
+                for (int x = 0; x < frame.cols; x++) {
+                    const auto diff = std::abs(a[x] - b[x]);
+                    maxDiff = std::max(maxDiff, diff);
+                    if (diff != 0)
+                        differentCount++;
+                }
+            }
+            totalCount += static_cast<size_t>(frame.rows * frame.cols);
+
+            if (std::abs(reference.minValue() - fixed.minValue()) > 1 || std::abs(reference.maxValue() - fixed.maxValue()) > 1)
+                fail("fixed point min/max (%d, %d) differs from float (%d, %d) at alpha %.2f",
+                     fixed.minValue(), fixed.maxValue(), reference.minValue(), reference.maxValue(), alpha);
+        }
+
+        std::printf("fixed point vs. float, alpha %.2f: %.2f%% of values differ, by at most %d\n",
+                    alpha, 100.0 * differentCount / totalCount, maxDiff);
+        if (maxDiff > 1)
+            fail("fixed point background difference deviates from float by %d gray levels at alpha %.2f", maxDiff, alpha);
+    }
+}
+
+/**
+ * All implementations of the kernel must give exactly the same results.
+ */
+static void testImplementationsIdentical(const std::vector<cv::Mat> &frames)
+{
+    const auto isas = DisplayKernel::availableIsas();
+    std::printf("implementations on this machine:");
+    for (const auto name : isas)
+        std::printf(" %s", name);
+    std::printf("\n");
+
+    const auto modes = {DisplayMode::RawFrames, DisplayMode::BackgroundDiff, DisplayMode::DeltaFOverF,
+                        DisplayMode::MaxProjection, DisplayMode::StdDeviation};
+    for (const auto precision : {BackgroundModelPrecision::Float, BackgroundModelPrecision::FixedPoint}) {
+        for (const auto mode : modes) {
+            std::vector<DisplayKernel> kernels(isas.size());
+            for (size_t i = 0; i < isas.size(); i++) {
+                kernels[i].setIsa(isas[i]);
+                kernels[i].setPrecision(precision);
+            }
+
+            std::vector<cv::Mat> outs(isas.size());
+            for (size_t n = 0; n < frames.size(); n++) {
+                for (size_t i = 0; i < isas.size(); i++)
+                    kernels[i].process(frames[n], outs[i], mode, 0.05, 10, 200);
+
+                for (size_t i = 1; i < isas.size(); i++) {
+                    bool same = kernels[i].minValue() == kernels[0].minValue()
+                                    && kernels[i].maxValue() == kernels[0].maxValue()
+                                    && kernels[i].histogram() == kernels[0].histogram();
+                    for (int y = 0; y < frames[n].rows && same; y++)
+                        same = std::memcmp(outs[i].ptr(y), outs[0].ptr(y), static_cast<size_t>(frames[n].cols)) == 0;
+                    if (!same) {
+                        fail("%s result differs from %s in %s mode (%s background), frame %zu",
+                             isas[i], isas[0], modeName(mode),
+                             precision == BackgroundModelPrecision::FixedPoint? "fixed point" : "float", n);
+                        n = frames.size();
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    // odd sizes, so the scalar tail after the vectorized part of each row is exercised as well
+    testFixedPointMatchesFloat(makeTestFrames(157, 61, 1500));
+    testImplementationsIdentical(makeTestFrames(157, 61, 200));
+
+    if (g_failures > 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", g_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
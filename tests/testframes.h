@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2019-2021 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TESTFRAMES_H
+#define TESTFRAMES_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <opencv2/core.hpp>
+
+/**
+ * @brief Make a reproducible sequence of Miniscope-like 8-bit gray frames
+ *
+ * The frames show a vignetted background whose brightness drifts slowly,
+ * a few blinking cells and some noise, so all display modes have something
+ * to work with. The same seed always gives the same frames.
+ */
+static inline std::vector<cv::Mat> makeTestFrames(int width, int height, int count, uint32_t seed = 42)
+{
+    auto state = seed;
+    const auto random = [&state]() {
+        state = state * 1664525u + 1013904223u;
+        return static_cast<int>(state >> 24);
+    };
+
+    std::vector<cv::Mat> frames;
+    frames.reserve(static_cast<size_t>(count));
+    const auto cx = width / 2.0;
+    const auto cy = height / 2.0;
+    const auto maxDist2 = cx * cx + cy * cy;
+    for (int i = 0; i < count; i++) {
+        cv::Mat frame(height, width, CV_8UC1);
+        const auto drift = 20.0 * std::sin(i / 200.0);
+        for (int y = 0; y < height; y++) {
+            auto row = frame.ptr<uint8_t>(y);
+            for (int x = 0; x < width; x++) {
+                const auto dist2 = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+                auto value = 40.0 + 80.0 * (1.0 - dist2 / maxDist2) + drift;
+
+                // a grid of cells, which light up at different times
+                const auto cell = (x / 24) * 7 + (y / 24) * 13;
+                const auto inCell = (x % 24 - 12) * (x % 24 - 12) + (y % 24 - 12) * (y % 24 - 12) < 36;
+                if (inCell && (i + cell * 17) % 90 < 12)
+                    value += 100.0 * std::exp(-((i + cell * 17) % 90) / 4.0);
+
+                value += (random() % 13) - 6;
+                row[x] = static_cast<uint8_t>(std::min(std::max(value, 0.0), 255.0));
+            }
+        }
+        frames.push_back(frame);
+    }
+
+    return frames;
+}
+
+#endif // TESTFRAMES_H